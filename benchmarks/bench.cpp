@@ -0,0 +1,975 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../bmp.h"
+
+using Clock = std::chrono::steady_clock;
+
+const char *BENCH_FILE = "bench_input.bmp";
+const uint32_t BENCH_W = 4096;
+const uint32_t BENCH_H = 4096;
+
+double SecondsSince(Clock::time_point t0) {
+  return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+// One reported measurement, collected for the JSON output
+struct Result {
+  std::string name;
+  double seconds;
+  double throughput;
+  const char *unit;
+};
+
+std::vector<Result> results;
+
+void Report(const char *name, double seconds, double bytes) {
+  std::printf("%-28s %10.3f ms %10.1f MB/s\n", name, seconds * 1e3,
+              bytes / seconds / 1e6);
+  results.push_back({name, seconds, bytes / seconds / 1e6, "MB/s"});
+}
+
+void ReportPixels(const char *name, double seconds, double pixels) {
+  std::printf("%-28s %10.3f ms %10.1f Mpix/s\n", name, seconds * 1e3,
+              pixels / seconds / 1e6);
+  results.push_back({name, seconds, pixels / seconds / 1e6, "Mpix/s"});
+}
+
+// Writes all results as {"context": {...}, "benchmarks": [...]}, names only
+// contain characters that need no escaping
+bool WriteJson(const char *fn) {
+  FILE *file = std::fopen(fn, "w");
+  if (!file) {
+    std::printf("Unable to open %s\n", fn);
+    return false;
+  }
+  std::fprintf(file,
+               "{\n  \"context\": {\"compiler\": \"%s\", "
+               "\"hardware_threads\": %u},\n  \"benchmarks\": [",
+               __VERSION__, std::thread::hardware_concurrency());
+  for (size_t i = 0; i < results.size(); i++)
+    std::fprintf(file,
+                 "%s\n    {\"name\": \"%s\", \"ms\": %.6f, "
+                 "\"throughput\": %.3f, \"unit\": \"%s\"}",
+                 i ? "," : "", results[i].name.c_str(),
+                 results[i].seconds * 1e3, results[i].throughput,
+                 results[i].unit);
+  std::fprintf(file, "\n  ]\n}\n");
+  return std::fclose(file) == 0;
+}
+
+// Writes the input image used by the reader benchmarks
+void CreateInput() {
+  BMP::BitmapWriter writer(BENCH_FILE, BENCH_W, BENCH_H, false);
+  std::vector<uint8_t> row(3 * BENCH_W);
+  for (uint32_t y = 0; y < BENCH_H; y++) {
+    for (uint32_t x = 0; x < row.size(); x++)
+      row[x] = (uint8_t)(x ^ y);
+    writer.WriteRow(row.data());
+  }
+  writer.Close();
+}
+
+// Single pass over all rows through the read-ahead buffer
+void BenchReaderRows(size_t read_ahead) {
+  BMP::BitmapReader reader(BENCH_FILE, read_ahead);
+  uint64_t checksum = 0;
+  auto t0 = Clock::now();
+  for (uint32_t y = 0; y < reader.Height(); y++)
+    checksum += reader.Row(y)[y % (3 * reader.Width())];
+  double s = SecondsSince(t0);
+  char name[64];
+  std::snprintf(name, sizeof(name), "reader_rows/%zuKB", read_ahead >> 10);
+  Report(name, s, (double)reader.Stride() * reader.Height());
+  if (checksum == 1)
+    std::printf("\n");
+}
+
+// Random tile access, tile_size x tile_size tiles anywhere in the image
+void BenchReaderTiles(uint32_t tile_size, int n_tiles) {
+  BMP::BitmapReader reader(BENCH_FILE);
+  std::vector<uint8_t> tile(3 * tile_size * tile_size);
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<uint32_t> dx(0, reader.Width() - tile_size);
+  std::uniform_int_distribution<uint32_t> dy(0, reader.Height() - tile_size);
+  auto t0 = Clock::now();
+  for (int i = 0; i < n_tiles; i++)
+    reader.ReadTile(dx(rng), dy(rng), tile_size, tile_size, tile.data(),
+                    3 * tile_size);
+  double s = SecondsSince(t0);
+  char name[64];
+  std::snprintf(name, sizeof(name), "reader_tiles/%ux%u", tile_size,
+                tile_size);
+  Report(name, s, (double)tile.size() * n_tiles);
+}
+
+// Saving a whole in-memory bitmap and reading it back, repeated so that the
+// small sizes run long enough to measure
+void BenchReadWrite(uint32_t size, bool alpha) {
+  const char *file = "bench_output.bmp";
+  BMP::Bitmap image(file, size, size, alpha);
+  image.Fill(BMP::Color{10, 20, 30});
+  const int reps =
+      (int)std::clamp<uint64_t>(10000000 / ((uint64_t)size * size), 1, 200);
+  const int bd = alpha ? 32 : 24;
+  char name[64];
+
+  auto t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    image.Save();
+  double s = SecondsSince(t0) / reps;
+  std::snprintf(name, sizeof(name), "write/%ux%u/%d", size, size, bd);
+  Report(name, s, (double)image.GetFileSize());
+
+  BMP::Bitmap loaded(file, 1, 1, alpha);
+  t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    loaded.Read(file);
+  s = SecondsSince(t0) / reps;
+  std::snprintf(name, sizeof(name), "read/%ux%u/%d", size, size, bd);
+  Report(name, s, (double)loaded.GetFileSize());
+  std::remove(file);
+}
+
+// Saving and loading a chart-like image of few flat colors run-length
+// encoded, reported per byte of the uncompressed pixels
+void BenchRLE(uint32_t size) {
+  const char *file = "bench_output.bmp";
+  BMP::Bitmap image(file, size, size, false);
+  image.Fill(BMP::Color{255, 255, 255});
+  // 14 bars, black lines and the white background make 16 colors
+  for (int i = 0; i < 14; i++)
+    image.FillRect(i * (int)size / 14, (int)size / (i + 2), (int)size / 20,
+                   (int)size, BMP::Color{(uint8_t)(i * 16), 80, 160});
+  for (int i = 0; i < 64; i++)
+    image.DrawLine(0, i * 64, (int)size - 1, (int)size - 1 - i * 32,
+                   BMP::Color{});
+  const double bytes = (double)image.vec_pixels.size();
+  char name[64];
+  for (auto [compression, label] :
+       {std::pair{BMP::COMPRESSION::RLE8, "rle8"},
+        {BMP::COMPRESSION::RLE4, "rle4"}}) {
+    auto t0 = Clock::now();
+    image.Write(file, compression);
+    std::snprintf(name, sizeof(name), "write/%ux%u/%s", size, size, label);
+    Report(name, SecondsSince(t0), bytes);
+    t0 = Clock::now();
+    BMP::Bitmap loaded(file);
+    std::snprintf(name, sizeof(name), "read/%ux%u/%s", size, size, label);
+    Report(name, SecondsSince(t0), bytes);
+    std::ifstream compressed(file, std::ios::binary | std::ios::ate);
+    std::printf("%-28s %10.1f x smaller\n", label,
+                image.GetFileSize() / (double)compressed.tellg());
+  }
+  std::remove(file);
+}
+
+// 16-bit RGB565 files against 24 and 32-bit ones of the same image, reported
+// as bytes of the unpacked image per second
+void BenchBitfields(uint32_t size) {
+  const char *file = "bench_output.bmp";
+  char name[64];
+  for (bool alpha : {false, true}) {
+    BMP::Bitmap image(file, size, size, alpha);
+    image.Fill(BMP::Color{40, 90, 200});
+    const double bytes = (double)image.vec_pixels.size();
+    const int bits = alpha ? 32 : 24;
+    for (auto [compression, label] :
+         {std::pair{BMP::COMPRESSION::RGB, "raw"},
+          {BMP::COMPRESSION::BITFIELDS, "rgb565"}}) {
+      auto t0 = Clock::now();
+      image.Write(file, compression);
+      std::snprintf(name, sizeof(name), "write/%ux%u/%d/%s", size, size, bits,
+                    label);
+      Report(name, SecondsSince(t0), bytes);
+      t0 = Clock::now();
+      BMP::Bitmap loaded(file);
+      std::snprintf(name, sizeof(name), "read/%ux%u/%d/%s", size, size, bits,
+                    label);
+      Report(name, SecondsSince(t0), bytes);
+    }
+  }
+  std::remove(file);
+}
+
+// Reducing a smooth image with many colors to a palette, with and without
+// dithering, and expanding it back
+void BenchQuantize(uint32_t size) {
+  BMP::Bitmap image("", size, size, false);
+  image.ForEachRow([&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++)
+      for (uint32_t x = 0; x < size; x++)
+        image.SetPixelUnchecked(
+            (int)x, (int)y,
+            BMP::Color{(uint8_t)(x * 255 / size), (uint8_t)(y * 255 / size),
+                       (uint8_t)((x ^ y) & 255)});
+  });
+  const double pixels = (double)size * size;
+  char name[64];
+  for (auto [bits, dither, label] :
+       {std::tuple{8, BMP::DITHER::NONE, "8bit"},
+        {8, BMP::DITHER::FLOYD_STEINBERG, "8bit/dither"},
+        {4, BMP::DITHER::FLOYD_STEINBERG, "4bit/dither"}}) {
+    auto t0 = Clock::now();
+    BMP::IndexedBitmap indexed(image, (uint16_t)bits, dither);
+    std::snprintf(name, sizeof(name), "quantize/%ux%u/%s", size, size, label);
+    ReportPixels(name, SecondsSince(t0), pixels);
+    t0 = Clock::now();
+    BMP::Bitmap expanded = indexed.ToBitmap();
+    std::snprintf(name, sizeof(name), "expand/%ux%u/%s", size, size, label);
+    ReportPixels(name, SecondsSince(t0), pixels);
+  }
+}
+
+// Loading and saving n files one after another against the batch API on the
+// I/O pool, reported as file bytes per second
+void BenchBatchIO(int n, uint32_t size) {
+  std::vector<BMP::Bitmap> images;
+  std::vector<std::string> files;
+  for (int i = 0; i < n; i++) {
+    images.emplace_back("", size, size, false);
+    images.back().Fill(BMP::Color{(uint8_t)i, 20, 30});
+    files.push_back("bench_batch_" + std::to_string(i) + ".bmp");
+  }
+  const double bytes = (double)images[0].GetFileSize() * n;
+  char name[64];
+  // Created up front, both variants overwrite existing files
+  BMP::SaveBatch(images, files);
+
+  auto t0 = Clock::now();
+  for (int i = 0; i < n; i++)
+    images[i].Write(files[i].c_str());
+  double s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "save/%dx%u/serial", n, size);
+  Report(name, s, bytes);
+
+  t0 = Clock::now();
+  BMP::SaveBatch(images, files);
+  s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "save/%dx%u/batch", n, size);
+  Report(name, s, bytes);
+
+  // Both variants keep all loaded images
+  t0 = Clock::now();
+  std::vector<BMP::Bitmap> serial;
+  for (int i = 0; i < n; i++)
+    serial.emplace_back(files[i].c_str());
+  s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "load/%dx%u/serial", n, size);
+  Report(name, s, bytes);
+
+  t0 = Clock::now();
+  std::vector<BMP::LoadResult> loaded = BMP::LoadBatch(files);
+  s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "load/%dx%u/batch", n, size);
+  Report(name, s, bytes);
+
+  for (const std::string &file : files)
+    std::remove(file.c_str());
+}
+
+// Clearing a whole frame and filling a clipped rectangle
+void BenchFill(uint32_t size, bool alpha) {
+  BMP::Bitmap image("bench_output.bmp", size, size, alpha);
+  const int reps = 20;
+  auto t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    image.Fill(BMP::Color{(uint8_t)i, 20, 30});
+  double s = SecondsSince(t0) / reps;
+  char name[64];
+  std::snprintf(name, sizeof(name), "fill/%ux%u/%d", size, size,
+                alpha ? 32 : 24);
+  Report(name, s, (double)image.vec_pixels.size());
+
+  t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    image.FillRect(-(int)size / 4, size / 4, size, size, BMP::Color{1, 2, 3});
+  s = SecondsSince(t0) / reps;
+  std::snprintf(name, sizeof(name), "fill_rect/%ux%u/%d", size, size,
+                alpha ? 32 : 24);
+  Report(name, s, (double)image.vec_pixels.size() * 9 / 16);
+}
+
+// Copying an image: the copy shares the pixels, the first write to it pays
+// for copying them
+void BenchCopy(uint32_t size) {
+  BMP::Bitmap image("bench_output.bmp", size, size, true);
+  const int reps = 20;
+  char name[64];
+  auto t0 = Clock::now();
+  size_t total = 0;
+  for (int i = 0; i < reps; i++) {
+    BMP::Bitmap snapshot = image;
+    total += snapshot.Width();
+  }
+  double s = SecondsSince(t0) / reps;
+  std::snprintf(name, sizeof(name), "copy/%ux%u/shared", size, size);
+  Report(name, s, (double)image.vec_pixels.size());
+
+  t0 = Clock::now();
+  for (int i = 0; i < reps; i++) {
+    BMP::Bitmap snapshot = image;
+    snapshot.SetPixel(0, 0, BMP::Color{1, 2, 3});
+    total += snapshot.Width();
+  }
+  s = SecondsSince(t0) / reps;
+  std::snprintf(name, sizeof(name), "copy/%ux%u/written", size, size);
+  Report(name, s, (double)image.vec_pixels.size());
+  if (total == 0)
+    std::printf("\n");
+}
+
+// Frame loop creating, filling and dropping an image per frame: zeroed and
+// freshly allocated, against uninitialized and recycled through a pool
+void BenchFrames(uint32_t w, uint32_t h) {
+  const int frames = 50;
+  char name[64];
+  auto t0 = Clock::now();
+  for (int i = 0; i < frames; i++) {
+    BMP::Bitmap frame("bench_output.bmp", w, h, true);
+    frame.Fill(BMP::Color{(uint8_t)i, 20, 30});
+  }
+  double s = SecondsSince(t0) / frames;
+  std::snprintf(name, sizeof(name), "frame/%ux%u/new", w, h);
+  ReportPixels(name, s, (double)w * h);
+
+  BMP::BitmapPool pool;
+  t0 = Clock::now();
+  for (int i = 0; i < frames; i++) {
+    BMP::Bitmap frame("bench_output.bmp", w, h, true, BMP::uninitialized,
+                      &pool);
+    frame.Fill(BMP::Color{(uint8_t)i, 20, 30});
+  }
+  s = SecondsSince(t0) / frames;
+  std::snprintf(name, sizeof(name), "frame/%ux%u/pooled", w, h);
+  ReportPixels(name, s, (double)w * h);
+}
+
+// 24 <-> 32-bit conversion, reported as bytes read and written per second.
+// The per-pixel Load/Store loop is the baseline for the row kernels, ConvertTo
+// also allocates the new buffer
+void BenchConvert(uint32_t size) {
+  BMP::Bitmap image("bench_output.bmp", size, size, false);
+  for (uint32_t y = 0; y < size; y++)
+    for (uint32_t x = 0; x < size; x++)
+      image.SetPixelUnchecked(x, y, BMP::Color{(uint8_t)x, (uint8_t)y, 7});
+  std::vector<uint8_t> wide((size_t)4 * size * size, 0);
+  const double bytes = 7.0 * size * size;
+  const int reps = 10;
+  char name[64];
+
+  auto t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    for (uint32_t y = 0; y < size; y++)
+      for (uint32_t x = 0; x < size; x++)
+        BMP::BGRA32::Store(&wide[((size_t)y * size + x) * 4],
+                           BMP::BGR24::Load(image.Row(y) + (size_t)x * 3));
+  std::snprintf(name, sizeof(name), "convert/%ux%u/scalar", size, size);
+  Report(name, SecondsSince(t0) / reps, bytes);
+
+  t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    for (uint32_t y = 0; y < size; y++)
+      BMP::ConvertPixels<BMP::BGR24, BMP::BGRA32>(
+          image.Row(y), &wide[(size_t)y * size * 4], size);
+  std::snprintf(name, sizeof(name), "convert/%ux%u/rows_24_to_32", size, size);
+  Report(name, SecondsSince(t0) / reps, bytes);
+
+  t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    for (uint32_t y = 0; y < size; y++)
+      BMP::ConvertPixels<BMP::BGRA32, BMP::BGR24>(&wide[(size_t)y * size * 4],
+                                                  image.Row(y), size);
+  std::snprintf(name, sizeof(name), "convert/%ux%u/rows_32_to_24", size, size);
+  Report(name, SecondsSince(t0) / reps, bytes);
+
+  double to32 = 0, to24 = 0;
+  for (int i = 0; i < reps; i++) {
+    t0 = Clock::now();
+    image.ConvertTo(BMP::BIT_DEPTH::BD_32);
+    to32 += SecondsSince(t0);
+    t0 = Clock::now();
+    image.ConvertTo(BMP::BIT_DEPTH::BD_24);
+    to24 += SecondsSince(t0);
+  }
+  std::snprintf(name, sizeof(name), "convert/%ux%u/image_24_to_32", size,
+                size);
+  Report(name, to32 / reps, bytes);
+  std::snprintf(name, sizeof(name), "convert/%ux%u/image_32_to_24", size,
+                size);
+  Report(name, to24 / reps, bytes);
+}
+
+// Layers a translucent overlay on a base image, through GetPixelColor and
+// SetPixel per pixel and through Composite. Reported as blended MB/s
+void BenchBlend(uint32_t size) {
+  BMP::Bitmap base("bench_output.bmp", size, size, true);
+  BMP::Bitmap overlay("bench_output.bmp", size, size, true);
+  for (uint32_t y = 0; y < size; y++)
+    for (uint32_t x = 0; x < size; x++)
+      overlay.SetPixelUnchecked(
+          x, y, BMP::Color{(uint8_t)x, (uint8_t)y, 50, (uint8_t)(x ^ y)});
+  base.Fill(BMP::Color{10, 20, 30});
+  const double bytes = 4.0 * size * size;
+  char name[64];
+
+  auto t0 = Clock::now();
+  for (uint32_t y = 0; y < size; y++)
+    for (uint32_t x = 0; x < size; x++)
+      base.SetPixel(x, y,
+                    BMP::Blend(overlay.GetPixelColor(x, y),
+                               base.GetPixelColor(x, y),
+                               BMP::BLEND_MODE::SOURCE_OVER));
+  std::snprintf(name, sizeof(name), "blend/%ux%u/per_pixel", size, size);
+  Report(name, SecondsSince(t0), bytes);
+
+  const int reps = 10;
+  for (BMP::BLEND_MODE mode :
+       {BMP::BLEND_MODE::SOURCE_OVER, BMP::BLEND_MODE::MULTIPLY}) {
+    t0 = Clock::now();
+    for (int i = 0; i < reps; i++)
+      base.Composite(overlay, 0, 0, mode);
+    std::snprintf(name, sizeof(name), "blend/%ux%u/composite_%s", size, size,
+                  mode == BMP::BLEND_MODE::SOURCE_OVER ? "over" : "multiply");
+    Report(name, SecondsSince(t0) / reps, bytes);
+  }
+
+  base.SetBlendMode(BMP::BLEND_MODE::SOURCE_OVER);
+  t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    base.FillRect(0, 0, size, size, BMP::Color{200, 100, 0, 100});
+  std::snprintf(name, sizeof(name), "blend/%ux%u/fill_rect_over", size, size);
+  Report(name, SecondsSince(t0) / reps, bytes);
+}
+
+// Plain scalar separable convolution with repeated edge pixels, the baseline
+// for the filters
+void ScalarConvolve(BMP::Bitmap &image, const std::vector<float> &kernel) {
+  const int w = (int)image.Width(), h = (int)image.Height();
+  const int ch = (int)image.Channels();
+  const int c = (int)kernel.size() / 2;
+  BMP::Bitmap tmp = image;
+  for (int pass = 0; pass < 2; pass++) {
+    BMP::Bitmap &src = pass == 0 ? image : tmp;
+    BMP::Bitmap &dst = pass == 0 ? tmp : image;
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++)
+        for (int k = 0; k < ch; k++) {
+          float acc = 0;
+          for (int j = 0; j < (int)kernel.size(); j++) {
+            int sx = pass == 0 ? std::clamp(x + j - c, 0, w - 1) : x;
+            int sy = pass == 1 ? std::clamp(y + j - c, 0, h - 1) : y;
+            acc += kernel[j] * src.Row(sy)[sx * ch + k];
+          }
+          dst.Row(y)[x * ch + k] =
+              (uint8_t)std::lrint(std::clamp(acc, 0.0f, 255.0f));
+        }
+  }
+}
+
+// Box and Gaussian blurs against the scalar convolution with the same
+// footprint, reported as pixels per second
+void BenchFilters(uint32_t size, bool alpha) {
+  BMP::Bitmap image("bench_output.bmp", size, size, alpha);
+  for (uint32_t y = 0; y < size; y++)
+    for (uint32_t x = 0; x < size; x++)
+      image.SetPixelUnchecked(x, y, BMP::Color{(uint8_t)(x * y), (uint8_t)y,
+                                               (uint8_t)x, (uint8_t)(x ^ y)});
+  const double pixels = (double)size * size;
+  const int bd = alpha ? 32 : 24;
+  char name[64];
+
+  for (int radius : {2, 8, 32}) {
+    std::vector<float> box(2 * radius + 1, 1.0f / (2 * radius + 1));
+    BMP::Bitmap copy = image;
+    auto t0 = Clock::now();
+    ScalarConvolve(copy, box);
+    std::snprintf(name, sizeof(name), "box/r%d/%d/scalar", radius, bd);
+    ReportPixels(name, SecondsSince(t0), pixels);
+
+    t0 = Clock::now();
+    copy.Convolve(box, box);
+    std::snprintf(name, sizeof(name), "box/r%d/%d/convolve", radius, bd);
+    ReportPixels(name, SecondsSince(t0), pixels);
+
+    t0 = Clock::now();
+    copy.BoxBlur(radius);
+    std::snprintf(name, sizeof(name), "box/r%d/%d/box_blur", radius, bd);
+    ReportPixels(name, SecondsSince(t0), pixels);
+  }
+
+  auto t0 = Clock::now();
+  image.GaussianBlur(10.0);
+  std::snprintf(name, sizeof(name), "gaussian/s10/%d", bd);
+  ReportPixels(name, SecondsSince(t0), pixels);
+}
+
+// Sprites copied from an atlas to random positions, reported as pixels
+// copied per second. GetPixelColor + SetPixel per pixel is the baseline.
+void BenchBlit(uint32_t size, int sprite, int n, bool alpha) {
+  BMP::Bitmap atlas("bench_output.bmp", 1024, 1024, true);
+  for (uint32_t y = 0; y < atlas.Height(); y++)
+    for (uint32_t x = 0; x < atlas.Width(); x++)
+      atlas.SetPixel(x, y, BMP::Color{(uint8_t)x, (uint8_t)y, 7});
+  BMP::Bitmap image("bench_output.bmp", size, size, alpha);
+  std::mt19937 rng(18);
+  std::vector<BMP::Rect> sources;
+  std::vector<BMP::Vertex> targets;
+  for (int i = 0; i < n; i++) {
+    sources.push_back(BMP::Rect{(int)(rng() % (1024 - sprite)),
+                                (int)(rng() % (1024 - sprite)), sprite,
+                                sprite});
+    targets.push_back(BMP::Vertex{(int)(rng() % size) - sprite / 2,
+                                  (int)(rng() % size) - sprite / 2});
+  }
+  const double pixels = (double)sprite * sprite * n;
+  char name[64];
+
+  auto t0 = Clock::now();
+  for (int i = 0; i < n; i++)
+    for (int y = 0; y < sprite; y++)
+      for (int x = 0; x < sprite; x++)
+        image.SetPixel(targets[i].x + x, targets[i].y + y,
+                       atlas.GetPixelColor(sources[i].x + x,
+                                           sources[i].y + y));
+  double s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "blit/%d/32-%d/scalar", sprite,
+                alpha ? 32 : 24);
+  ReportPixels(name, s, pixels);
+
+  t0 = Clock::now();
+  for (int i = 0; i < n; i++)
+    image.Blit(atlas, sources[i], targets[i]);
+  s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "blit/%d/32-%d/blit", sprite,
+                alpha ? 32 : 24);
+  ReportPixels(name, s, pixels);
+}
+
+// Naive bilinear resize through GetPixelColor and SetPixel, the baseline. It
+// samples 2x2 pixels per output pixel, so unlike Resize it aliases when
+// shrinking.
+BMP::Bitmap ScalarResize(const BMP::Bitmap &src, uint32_t w, uint32_t h) {
+  BMP::Bitmap out("bench_output.bmp", w, h, src.GetBitDepth() ==
+                                                BMP::BIT_DEPTH::BD_32);
+  const double sx = (double)src.Width() / w, sy = (double)src.Height() / h;
+  for (uint32_t y = 0; y < h; y++)
+    for (uint32_t x = 0; x < w; x++) {
+      double fx = std::max((x + 0.5) * sx - 0.5, 0.0);
+      double fy = std::max((y + 0.5) * sy - 0.5, 0.0);
+      int x0 = (int)fx, y0 = (int)fy;
+      int x1 = std::min(x0 + 1, (int)src.Width() - 1);
+      int y1 = std::min(y0 + 1, (int)src.Height() - 1);
+      double ax = fx - x0, ay = fy - y0;
+      BMP::Color c[4] = {src.GetPixelColor(x0, y0), src.GetPixelColor(x1, y0),
+                         src.GetPixelColor(x0, y1), src.GetPixelColor(x1, y1)};
+      auto mix = [&](auto channel) {
+        double top = (1 - ax) * channel(c[0]) + ax * channel(c[1]);
+        double bottom = (1 - ax) * channel(c[2]) + ax * channel(c[3]);
+        return (uint8_t)std::lround((1 - ay) * top + ay * bottom);
+      };
+      out.SetPixel(x, y,
+                   BMP::Color{mix([](BMP::Color k) { return k.red; }),
+                              mix([](BMP::Color k) { return k.green; }),
+                              mix([](BMP::Color k) { return k.blue; }),
+                              mix([](BMP::Color k) { return k.alpha; })});
+    }
+  return out;
+}
+
+// Shrinking to a thumbnail and enlarging, reported as pixels per second of
+// the larger of the two images
+void BenchResize(uint32_t size, uint32_t small, bool alpha) {
+  BMP::Bitmap image("bench_output.bmp", size, size, alpha);
+  for (uint32_t y = 0; y < size; y++)
+    for (uint32_t x = 0; x < size; x++)
+      image.SetPixelUnchecked(x, y, BMP::Color{(uint8_t)(x * y), (uint8_t)y,
+                                               (uint8_t)x, (uint8_t)(x ^ y)});
+  BMP::Bitmap thumbnail = image.Resize(small, small);
+  const double pixels = (double)size * size;
+  const int bd = alpha ? 32 : 24;
+  char name[64];
+
+  auto t0 = Clock::now();
+  ScalarResize(image, small, small);
+  std::snprintf(name, sizeof(name), "resize/down%u/%d/scalar", size / small,
+                bd);
+  ReportPixels(name, SecondsSince(t0), pixels);
+  t0 = Clock::now();
+  ScalarResize(thumbnail, size, size);
+  std::snprintf(name, sizeof(name), "resize/up%u/%d/scalar", size / small, bd);
+  ReportPixels(name, SecondsSince(t0), pixels);
+
+  for (auto [filter, filter_name] :
+       {std::pair{BMP::RESIZE_FILTER::NEAREST, "nearest"},
+        {BMP::RESIZE_FILTER::BILINEAR, "bilinear"},
+        {BMP::RESIZE_FILTER::LANCZOS3, "lanczos3"}}) {
+    t0 = Clock::now();
+    image.Resize(small, small, filter);
+    std::snprintf(name, sizeof(name), "resize/down%u/%d/%s", size / small, bd,
+                  filter_name);
+    ReportPixels(name, SecondsSince(t0), pixels);
+    t0 = Clock::now();
+    thumbnail.Resize(size, size, filter);
+    std::snprintf(name, sizeof(name), "resize/up%u/%d/%s", size / small, bd,
+                  filter_name);
+    ReportPixels(name, SecondsSince(t0), pixels);
+  }
+}
+
+// Large filled shapes, reported as covered pixels per second
+void BenchShapes(uint32_t size, bool alpha) {
+  BMP::Bitmap image("bench_output.bmp", size, size, alpha);
+  const int reps = 10;
+  int r = (int)size / 2;
+  auto t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    image.FillCircle(r, r, r, BMP::Color{(uint8_t)i, 20, 30});
+  double s = SecondsSince(t0) / reps;
+  char name[64];
+  std::snprintf(name, sizeof(name), "fill_circle/r%d/%d", r, alpha ? 32 : 24);
+  Report(name, s, 3.14159 * r * r * image.Channels());
+
+  int n = (int)size - 1;
+  t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    image.FillTriangle(0, 0, n / 2, n, n, i, BMP::Color{(uint8_t)i, 20, 30});
+  s = SecondsSince(t0) / reps;
+  std::snprintf(name, sizeof(name), "fill_triangle/%d/%d", n, alpha ? 32 : 24);
+  Report(name, s, 0.5 * n * n * image.Channels());
+}
+
+// SetPixel and GetPixelColor over every pixel, in row order and in a shuffled
+// order that defeats the caches and the prefetcher
+void BenchPixelAccess(uint32_t size, bool alpha) {
+  BMP::Bitmap image("bench_output.bmp", size, size, alpha);
+  std::vector<BMP::Vertex> order;
+  order.reserve((size_t)size * size);
+  for (int y = 0; y < (int)size; y++)
+    for (int x = 0; x < (int)size; x++)
+      order.push_back({x, y});
+  const double pixels = (double)order.size();
+  const int bd = alpha ? 32 : 24;
+  char name[64];
+  uint64_t checksum = 0;
+
+  for (const char *kind : {"sequential", "random"}) {
+    if (kind[0] == 'r')
+      std::shuffle(order.begin(), order.end(), std::mt19937(7));
+    auto t0 = Clock::now();
+    for (const BMP::Vertex &v : order)
+      image.SetPixel(v.x, v.y, BMP::Color{(uint8_t)v.x, (uint8_t)v.y, 30});
+    double s = SecondsSince(t0);
+    std::snprintf(name, sizeof(name), "set_pixel/%s/%d", kind, bd);
+    ReportPixels(name, s, pixels);
+
+    t0 = Clock::now();
+    for (const BMP::Vertex &v : order)
+      checksum += image.GetPixelColor(v.x, v.y).green;
+    s = SecondsSince(t0);
+    std::snprintf(name, sizeof(name), "get_pixel/%s/%d", kind, bd);
+    ReportPixels(name, s, pixels);
+  }
+  if (checksum == 1)
+    std::printf("\n");
+}
+
+// Full-length lines at slopes from horizontal to vertical, and circle
+// outlines, reported as plotted pixels per second
+void BenchLines(uint32_t size, bool alpha) {
+  BMP::Bitmap image("bench_output.bmp", size, size, alpha);
+  const int n = (int)size - 1;
+  const int reps = 1000;
+  const int bd = alpha ? 32 : 24;
+  char name[64];
+  for (auto [dx, dy, slope] : {std::tuple{n, 0, "0"},
+                               {n, n / 4, "0.25"},
+                               {n, n, "1"},
+                               {n / 4, n, "4"},
+                               {0, n, "inf"}}) {
+    auto t0 = Clock::now();
+    for (int i = 0; i < reps; i++) {
+      int x = i * 7 % (size - dx), y = i * 13 % (size - dy);
+      image.DrawLine(x, y, x + dx, y + dy, BMP::Color{(uint8_t)i, 20, 30});
+    }
+    double s = SecondsSince(t0) / reps;
+    std::snprintf(name, sizeof(name), "draw_line/slope%s/%d", slope, bd);
+    ReportPixels(name, s, std::max(dx, dy) + 1);
+  }
+
+  int r = (int)size / 4;
+  auto t0 = Clock::now();
+  for (int i = 0; i < reps; i++)
+    image.DrawCircle(2 * r, 2 * r, r - i % 16, BMP::Color{(uint8_t)i, 20, 30});
+  double s = SecondsSince(t0) / reps;
+  std::snprintf(name, sizeof(name), "draw_circle/r%d/%d", r, bd);
+  // An outline of radius r has about 4 sqrt(2) r pixels
+  ReportPixels(name, s, 5.657 * r);
+}
+
+// A grid mesh of cell x cell quads, two triangles each, drawn one by one with
+// FillTriangle and as a batch with FillTriangles
+void BenchMesh(uint32_t size, int cell) {
+  BMP::Bitmap image("bench_output.bmp", size, size, true);
+  std::vector<BMP::Triangle> mesh;
+  for (int y = 0; y + cell <= (int)size; y += cell)
+    for (int x = 0; x + cell <= (int)size; x += cell) {
+      BMP::Color c{(uint8_t)x, (uint8_t)y, 128};
+      mesh.push_back({{x, y}, {x + cell, y}, {x + cell, y + cell}, c});
+      mesh.push_back({{x, y}, {x + cell, y + cell}, {x, y + cell}, c});
+    }
+  char name[64];
+  auto t0 = Clock::now();
+  for (const BMP::Triangle &t : mesh)
+    image.FillTriangle(t.v1, t.v2, t.v3, t.color);
+  double s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "mesh_fill_triangle/%zu", mesh.size());
+  Report(name, s, (double)image.vec_pixels.size());
+
+  t0 = Clock::now();
+  image.FillTriangles(mesh);
+  s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "mesh_fill_triangles/%zu", mesh.size());
+  Report(name, s, (double)image.vec_pixels.size());
+}
+
+// Plot-like geometry reaching far outside a small image, only the visible
+// part should cost anything
+void BenchClipping(uint32_t size, int extent) {
+  BMP::Bitmap image("bench_output.bmp", size, size, false);
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> coord(-extent, extent);
+  const int n = 1000;
+  char name[64];
+  auto t0 = Clock::now();
+  for (int i = 0; i < n; i++)
+    image.DrawLine(coord(rng), coord(rng), coord(rng), coord(rng),
+                   BMP::Color{(uint8_t)i, 20, 30});
+  double s = SecondsSince(t0) / n;
+  std::snprintf(name, sizeof(name), "clipped_line/%d", extent);
+  Report(name, s, (double)size * image.Channels());
+
+  int c = (int)size / 2;
+  t0 = Clock::now();
+  for (int i = 0; i < n; i++)
+    image.DrawCircle(c, c + extent, extent + i % 8, BMP::Color{40, 20, 30});
+  s = SecondsSince(t0) / n;
+  std::snprintf(name, sizeof(name), "clipped_circle/r%d", extent);
+  Report(name, s, (double)size * image.Channels());
+}
+
+// A chart-like scene of many small primitives, drawn directly and through a
+// DisplayList rendered on 1 and on all hardware threads
+void BenchDisplayList(uint32_t size, int n) {
+  auto record = [&](auto &target) {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> coord(0, (int)size - 1);
+    std::uniform_int_distribution<int> offset(-20, 20);
+    for (int i = 0; i < n; i++) {
+      int x = coord(rng), y = coord(rng);
+      BMP::Color c{(uint8_t)i, (uint8_t)(i >> 8), 30};
+      switch (i % 4) {
+      case 0:
+        target.DrawLine(x, y, x + offset(rng), y + offset(rng), c);
+        break;
+      case 1:
+        target.FillRect(x, y, 4 + offset(rng) / 4, 4 + offset(rng) / 4, c);
+        break;
+      case 2:
+        target.FillCircle(x, y, 3, c);
+        break;
+      case 3:
+        target.FillTriangle(x, y, x + offset(rng), y + offset(rng),
+                            x + offset(rng), y + offset(rng), c);
+        break;
+      }
+    }
+  };
+  char name[64];
+  BMP::Bitmap image("bench_output.bmp", size, size, true);
+  auto t0 = Clock::now();
+  record(image);
+  double s = SecondsSince(t0);
+  std::snprintf(name, sizeof(name), "immediate/%d", n);
+  Report(name, s, (double)image.vec_pixels.size());
+
+  BMP::DisplayList list;
+  record(list);
+  for (unsigned threads : {1u, std::thread::hardware_concurrency()}) {
+    BMP::ThreadPool pool(threads);
+    t0 = Clock::now();
+    list.Render(image, pool);
+    s = SecondsSince(t0);
+    std::snprintf(name, sizeof(name), "display_list/%d/t%u", n, threads);
+    Report(name, s, (double)image.vec_pixels.size());
+  }
+}
+
+// Row band kernels on pools of 1 to N threads. The fill is bound by memory
+// bandwidth, the escape-time kernel by computation.
+void BenchScaling(uint32_t size) {
+  BMP::BasicBitmap<BMP::BGRA32> image("bench_output.bmp", size, size);
+  char name[64];
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned threads = 1; threads <= max_threads; threads++) {
+    BMP::ThreadPool pool(threads);
+    auto t0 = Clock::now();
+    const int reps = 10;
+    for (int i = 0; i < reps; i++)
+      image.ForEachRow(
+          [&](uint32_t y0, uint32_t y1) {
+            BMP::FillPixels<BMP::BGRA32>(image.Row(y0),
+                                         (size_t)size * (y1 - y0),
+                                         BMP::Color{(uint8_t)i, 2, 3});
+          },
+          pool);
+    double s = SecondsSince(t0) / reps;
+    std::snprintf(name, sizeof(name), "scaling_fill/t%u", threads);
+    Report(name, s, (double)image.vec_pixels.size());
+
+    t0 = Clock::now();
+    image.ForEachRow(
+        [&](uint32_t y0, uint32_t y1) {
+          for (uint32_t y = y0; y < y1; y++)
+            for (uint32_t x = 0; x < size; x++) {
+              double a = -2.0 + 3.0 * x / size, b = -1.5 + 3.0 * y / size;
+              double re = 0, im = 0;
+              int n = 0;
+              for (; n < 64 && re * re + im * im < 4; n++) {
+                double t = re * re - im * im + a;
+                im = 2 * re * im + b;
+                re = t;
+              }
+              image.SetPixelUnchecked(x, y, BMP::Color{(uint8_t)(n * 4), 0, 0});
+            }
+        },
+        pool);
+    s = SecondsSince(t0);
+    std::snprintf(name, sizeof(name), "scaling_escape_time/t%u", threads);
+    Report(name, s, (double)image.vec_pixels.size());
+  }
+}
+
+// A named group of measurements, selected on the command line by substring
+struct Case {
+  const char *name;
+  std::function<void()> run;
+};
+
+int main(int argc, char **argv) {
+  const char *json = nullptr;
+  bool large = false;
+  std::vector<const char *> filters;
+  for (int i = 1; i < argc; i++) {
+    if (!std::strcmp(argv[i], "--json") && i + 1 < argc)
+      json = argv[++i];
+    else if (!std::strcmp(argv[i], "--large"))
+      large = true;
+    else if (argv[i][0] == '-') {
+      std::printf("Usage: %s [--json file] [--large] [case...]\n", argv[0]);
+      return 1;
+    } else
+      filters.push_back(argv[i]);
+  }
+
+  std::vector<Case> cases = {
+      {"reader",
+       [] {
+         CreateInput();
+         BenchReaderRows(64 << 10);
+         BenchReaderRows(1 << 20);
+         BenchReaderRows(16 << 20);
+         BenchReaderTiles(64, 2000);
+         BenchReaderTiles(256, 500);
+         BenchReaderTiles(2048, 20);
+         std::remove(BENCH_FILE);
+       }},
+      {"read_write",
+       [large] {
+         for (uint32_t size : {100u, 1000u, 4096u, 16384u})
+           if (size < 16384 || large)
+             for (bool alpha : {false, true})
+               BenchReadWrite(size, alpha);
+       }},
+      {"rle", [] { BenchRLE(4096); }},
+      {"quantize", [] { BenchQuantize(2048); }},
+      {"bitfields", [] { BenchBitfields(4096); }},
+      {"batch_io",
+       [] {
+         BenchBatchIO(256, 256);
+         BenchBatchIO(16, 2048);
+       }},
+      {"pixel_access",
+       [] {
+         BenchPixelAccess(2048, false);
+         BenchPixelAccess(2048, true);
+       }},
+      {"fill",
+       [] {
+         BenchFill(4096, false);
+         BenchFill(4096, true);
+       }},
+      {"frames",
+       [] {
+         BenchFrames(1920, 1080);
+         BenchFrames(3840, 2160);
+       }},
+      {"copy", [] { BenchCopy(4096); }},
+      {"convert", [] { BenchConvert(4096); }},
+      {"blend", [] { BenchBlend(4096); }},
+      {"filters",
+       [] {
+         BenchFilters(1024, false);
+         BenchFilters(1024, true);
+       }},
+      {"resize",
+       [] {
+         BenchResize(4096, 256, false);
+         BenchResize(2048, 1024, true);
+       }},
+      {"blit",
+       [] {
+         BenchBlit(4096, 64, 5000, true);
+         BenchBlit(4096, 64, 5000, false);
+         BenchBlit(4096, 512, 100, true);
+       }},
+      {"lines",
+       [] {
+         BenchLines(4096, false);
+         BenchLines(4096, true);
+       }},
+      {"shapes",
+       [] {
+         BenchShapes(4096, false);
+         BenchShapes(4096, true);
+       }},
+      {"mesh",
+       [] {
+         BenchMesh(4096, 32);
+         BenchMesh(4096, 8);
+       }},
+      {"clipping",
+       [] {
+         BenchClipping(1024, 1000000);
+         BenchClipping(1024, 100000000);
+       }},
+      {"display_list", [] { BenchDisplayList(4096, 200000); }},
+      {"scaling", [] { BenchScaling(4096); }},
+  };
+
+  for (const Case &c : cases)
+    if (filters.empty() ||
+        std::any_of(filters.begin(), filters.end(), [&](const char *f) {
+          return std::strstr(c.name, f) != nullptr;
+        }))
+      c.run();
+  if (json && !WriteJson(json))
+    return 1;
+}
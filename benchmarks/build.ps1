@@ -0,0 +1 @@
+g++ -O2 -Wall -Werror -std=c++23 -o bench bench.cpp -lstdc++exp
@@ -1,17 +1,83 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cfloat>
+#include <chrono>
 #include <cmath>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <span>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#if __has_include(<mdspan>)
+#include <mdspan>
+#endif
+
+// SIMD kernels are selected at compile time, build with -mavx2 (or
+// /arch:AVX2) to enable the AVX2 paths. SSE2 is part of every x86-64 target.
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BMP_SSE2
+#include <immintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define BMP_SSSE3
+#endif
+#if defined(__AVX2__)
+#define BMP_AVX2
+#endif
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
 namespace BMP {
 struct Vertex {
   int x;
   int y;
 };
 
+// Rectangle of w x h pixels with its corner at (x, y)
+struct Rect {
+  int x;
+  int y;
+  int w;
+  int h;
+};
+
 struct Color {
   uint8_t red{0};
   uint8_t green{0};
@@ -30,6 +96,13 @@ struct Pixel {
   Color color;
 };
 
+struct Triangle {
+  Vertex v1;
+  Vertex v2;
+  Vertex v3;
+  Color color;
+};
+
 struct FileHeader {
   uint16_t signature{0x4D42}; // 2 bytes, "BM" in ascii
   uint32_t file_size{};
@@ -69,68 +142,1138 @@ struct Infoheader {
   uint32_t colors_important{0};
 };
 
+// Channel masks of 16 and 32-bit pixels, stored after the info header of
+// BI_BITFIELDS files. Uncompressed 16-bit files are RGB555.
+struct BitMasks {
+  uint32_t red{};
+  uint32_t green{};
+  uint32_t blue{};
+  uint32_t alpha{};
+};
+
+constexpr BitMasks MASKS_RGB555{0x7C00, 0x03E0, 0x001F, 0};
+constexpr BitMasks MASKS_RGB565{0xF800, 0x07E0, 0x001F, 0};
+
 namespace UTILS {
-uint32_t bytes_to_uint32(uint8_t *data);
+uint32_t bytes_to_uint32(const uint8_t *data);
 
-uint16_t bytes_to_uint16(uint8_t *data);
+uint16_t bytes_to_uint16(const uint8_t *data);
 
+// Return new[] allocated arrays, the caller is responsible for delete[]
 uint8_t *uint32_to_bytes(uint32_t data);
 
 uint8_t *uint16_to_bytes(uint16_t data);
+
+// Non-allocating versions, storing the little-endian bytes at dst
+void uint32_to_bytes(uint32_t data, uint8_t *dst);
+
+void uint16_to_bytes(uint16_t data, uint8_t *dst);
+
+// Parses the 54 byte file + info header at the start of data
+void read_headers(const uint8_t *data, FileHeader &file_header,
+                  Infoheader &info_header);
+
+// Serializes the file + info header into the first 54 bytes of data
+void write_headers(uint8_t *data, const FileHeader &file_header,
+                   const Infoheader &info_header);
+
+// Creates/truncates the file fn and writes header followed by data to it in a
+// single gathered write where the platform supports it
+bool write_file(const char *fn, const uint8_t *header, size_t header_size,
+                const uint8_t *data, size_t data_size);
+
+// Writes a bitmap file with the given headers and pixel array. The headers
+// are normalized to a plain 54 byte BITMAPINFOHEADER followed by the pixels.
+bool write_bitmap(const char *fn, const FileHeader &file_header,
+                  const Infoheader &info_header, const uint8_t *pixels,
+                  size_t size);
+
+// Size in bytes of one pixel row, including the padding to a 4 byte boundary
+uint32_t row_stride(uint32_t width, uint16_t bits_per_pixel);
+
+// Closed form of the Bresenham circle walk used by DrawCircle and FillCircle,
+// valid for radii up to 2^28. After plotting step x the walk is at
+// (x, circle_y(r, x)) with decision value circle_d(r, x, y), so any step can
+// be reached without walking there. circle_y is exact as long as the result
+// is at least x + 2, which covers all but the last few steps of an octant.
+int64_t circle_d(int64_t r, int64_t x, int64_t y);
+
+int64_t circle_y(int64_t r, int64_t x);
+
+// x / 255 rounded to nearest, exact for x up to 255 * 255
+uint8_t div255(uint32_t x);
 } // namespace UTILS
 
 enum class BIT_DEPTH { BD_24, BD_32 };
 
+// Compression of a bitmap file, with the values of the header field. RLE8
+// and RLE4 run-length encode rows of 8 and 4-bit palette indices, BITFIELDS
+// places the channels of 16 or 32-bit pixels at the bits of BitMasks.
+enum class COMPRESSION { RGB = 0, RLE8 = 1, RLE4 = 2, BITFIELDS = 3 };
+
+// How drawn pixels are combined with the image. The source alpha is the
+// opacity of the drawn color: 0 leaves the image as it is, 255 gives the full
+// result of the mode. Colors without alpha (24-bit) count as opaque.
+// REPLACE:     writes the color as is, including its alpha
+// SOURCE_OVER: Porter-Duff source over, the color is laid on top
+// ADD:         adds the color, saturating at 255
+// MULTIPLY:    multiplies the channels, darkens
+// SCREEN:      inverse of multiplying the inverted channels, lightens
+// The color blends as c = (b * a + d * (255 - a)) / 255, where b is the
+// mode's result for the source c and destination d, and the alpha blends as
+// a + d * (255 - a) / 255 (ADD: a + d). Both are rounded to nearest, which is
+// the exact Porter-Duff result for opaque images.
+enum class BLEND_MODE { REPLACE, SOURCE_OVER, ADD, MULTIPLY, SCREEN };
+
+// Resampling filters of Resize. NEAREST picks the source pixel under the
+// center of each output pixel, BILINEAR weighs with a triangle and LANCZOS3
+// with a Lanczos window of three lobes. When shrinking, the filters are
+// stretched over all source pixels of an output pixel.
+enum class RESIZE_FILTER { NEAREST, BILINEAR, LANCZOS3 };
+
+// Dithering when an image is reduced to a palette. FLOYD_STEINBERG spreads
+// the error of every pixel over its unvisited neighbours, which trades
+// banding for noise.
+enum class DITHER { NONE, FLOYD_STEINBERG };
+
+// Pixel formats describe the memory layout of a pixel at compile time. A
+// format provides its bit depth, the byte offset of every channel (alpha < 0
+// when there is none) and Store/Load to convert to and from Color.
+struct BGR24 {
+  static constexpr BIT_DEPTH bit_depth = BIT_DEPTH::BD_24;
+  static constexpr uint16_t bits_per_pixel = 24;
+  static constexpr int channels = 3;
+  static constexpr int blue = 0;
+  static constexpr int green = 1;
+  static constexpr int red = 2;
+  static constexpr int alpha = -1;
+
+  static void Store(uint8_t *p, const Color &c) {
+    p[blue] = c.blue;
+    p[green] = c.green;
+    p[red] = c.red;
+  }
+  static Color Load(const uint8_t *p) { return Color{p[red], p[green], p[blue]}; }
+};
+
+struct BGRA32 {
+  static constexpr BIT_DEPTH bit_depth = BIT_DEPTH::BD_32;
+  static constexpr uint16_t bits_per_pixel = 32;
+  static constexpr int channels = 4;
+  static constexpr int blue = 0;
+  static constexpr int green = 1;
+  static constexpr int red = 2;
+  static constexpr int alpha = 3;
+
+  static void Store(uint8_t *p, const Color &c) {
+    p[blue] = c.blue;
+    p[green] = c.green;
+    p[red] = c.red;
+    p[alpha] = c.alpha;
+  }
+  static Color Load(const uint8_t *p) {
+    return Color{p[red], p[green], p[blue], p[alpha]};
+  }
+};
+
+// Size in bytes of one pixel row of the format, including the padding
+template <class PixelFormat> constexpr uint32_t RowStride(uint32_t width) {
+  return (uint32_t)((((uint64_t)width * PixelFormat::bits_per_pixel + 31) / 32) *
+                    4);
+}
+
+// Calls f with a value of the pixel format matching bd. Lets runtime code
+// switch on the bit depth once and run a kernel compiled for that format.
+template <class F> decltype(auto) VisitPixelFormat(BIT_DEPTH bd, F &&f) {
+  switch (bd) {
+  case BIT_DEPTH::BD_24:
+    return f(BGR24{});
+  case BIT_DEPTH::BD_32:
+    break;
+  }
+  return f(BGRA32{});
+}
+
+#if defined(__cpp_lib_mdspan)
+// Multidimensional views of a pixel buffer indexed as [y][x][channel]. The
+// channel extent is static when the pixel format is known at compile time.
+template <class PixelFormat, class T = uint8_t>
+using PixelMdspan =
+    std::mdspan<T,
+                std::extents<size_t, std::dynamic_extent, std::dynamic_extent,
+                             PixelFormat::channels>,
+                std::layout_stride>;
+template <class T = uint8_t>
+using DynamicPixelMdspan =
+    std::mdspan<T, std::dextents<size_t, 3>, std::layout_stride>;
+#endif
+
+// Writes n pixels of color starting at dst. 32-bit pixels are a broadcast
+// store; 24-bit pixels repeat every 3 bytes, so a 48 byte (16 pixel) pattern
+// is prepared once and stored as three vectors per iteration.
+template <class PixelFormat>
+void FillPixels(uint8_t *dst, size_t n, const Color &color) {
+  if constexpr (std::is_same_v<PixelFormat, BGRA32>) {
+    uint8_t bytes[4];
+    BGRA32::Store(bytes, color);
+    uint32_t value;
+    memcpy(&value, bytes, 4);
+    size_t x = 0;
+#if defined(BMP_AVX2)
+    const __m256i v8 = _mm256_set1_epi32((int)value);
+    for (; x + 8 <= n; x += 8)
+      _mm256_storeu_si256((__m256i *)(dst + 4 * x), v8);
+#endif
+#if defined(BMP_SSE2)
+    const __m128i v4 = _mm_set1_epi32((int)value);
+    for (; x + 4 <= n; x += 4)
+      _mm_storeu_si128((__m128i *)(dst + 4 * x), v4);
+#endif
+    for (; x < n; x++)
+      memcpy(dst + 4 * x, &value, 4);
+  } else if constexpr (std::is_same_v<PixelFormat, BGR24>) {
+    if (n < 16) {
+      // Too short to be worth preparing the pattern
+      for (size_t x = 0; x < n; x++)
+        BGR24::Store(dst + 3 * x, color);
+      return;
+    }
+    alignas(32) uint8_t pattern[96];
+    for (int i = 0; i < 32; i++)
+      BGR24::Store(pattern + 3 * i, color);
+    size_t x = 0;
+#if defined(BMP_AVX2)
+    const __m256i a32 = _mm256_load_si256((const __m256i *)pattern);
+    const __m256i b32 = _mm256_load_si256((const __m256i *)(pattern + 32));
+    const __m256i c32 = _mm256_load_si256((const __m256i *)(pattern + 64));
+    for (; x + 32 <= n; x += 32) {
+      uint8_t *p = dst + 3 * x;
+      _mm256_storeu_si256((__m256i *)p, a32);
+      _mm256_storeu_si256((__m256i *)(p + 32), b32);
+      _mm256_storeu_si256((__m256i *)(p + 64), c32);
+    }
+#endif
+#if defined(BMP_SSE2)
+    const __m128i a16 = _mm_load_si128((const __m128i *)pattern);
+    const __m128i b16 = _mm_load_si128((const __m128i *)(pattern + 16));
+    const __m128i c16 = _mm_load_si128((const __m128i *)(pattern + 32));
+    for (; x + 16 <= n; x += 16) {
+      uint8_t *p = dst + 3 * x;
+      _mm_storeu_si128((__m128i *)p, a16);
+      _mm_storeu_si128((__m128i *)(p + 16), b16);
+      _mm_storeu_si128((__m128i *)(p + 32), c16);
+    }
+#else
+    for (; x + 16 <= n; x += 16)
+      memcpy(dst + 3 * x, pattern, 48);
+#endif
+    for (; x < n; x++)
+      BGR24::Store(dst + 3 * x, color);
+  } else {
+    for (size_t x = 0; x < n; x++)
+      PixelFormat::Store(dst + x * PixelFormat::channels, color);
+  }
+}
+
+// Converts w pixels from one format to another, pixels without alpha get
+// the given alpha. Between 24 and 32-bit the channels are moved with byte
+// shuffles, 16 pixels per step with SSSE3 (-mssse3) and 8 with AVX2.
+template <class SrcFormat, class DstFormat>
+void ConvertPixels(const uint8_t *src, uint8_t *dst, uint32_t w,
+                   uint8_t alpha = 255) {
+  uint32_t x = 0;
+  if constexpr (std::is_same_v<SrcFormat, DstFormat>) {
+    memcpy(dst, src, (size_t)w * SrcFormat::channels);
+  } else if constexpr (std::is_same_v<SrcFormat, BGR24> &&
+                       std::is_same_v<DstFormat, BGRA32>) {
+#if defined(BMP_AVX2)
+    // Each 128-bit lane gets the 12 bytes of 4 pixels, then every pixel is
+    // widened to 4 bytes. The 32 byte load reads 8 bytes past the 8 pixels.
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i widen = _mm256_setr_epi8(
+        0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128, 0, 1, 2,
+        -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128);
+    const __m256i alpha8 = _mm256_set1_epi32((int)((uint32_t)alpha << 24));
+    for (; x + 11 <= w; x += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(src + 3 * x));
+      v = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, spread), widen);
+      _mm256_storeu_si256((__m256i *)(dst + 4 * x), _mm256_or_si256(v, alpha8));
+    }
+#endif
+#if defined(BMP_SSSE3)
+    const __m128i widen4 = _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8,
+                                         -128, 9, 10, 11, -128);
+    const __m128i alpha4 = _mm_set1_epi32((int)((uint32_t)alpha << 24));
+    for (; x + 16 <= w; x += 16) {
+      const uint8_t *s = src + 3 * x;
+      uint8_t *d = dst + 4 * x;
+      __m128i a = _mm_loadu_si128((const __m128i *)s);
+      __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+      __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+      // Line the 12 bytes of every 4 pixels up at the start of a register
+      __m128i p[4] = {a, _mm_alignr_epi8(b, a, 12), _mm_alignr_epi8(c, b, 8),
+                      _mm_srli_si128(c, 4)};
+      for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i *)(d + 16 * i),
+                         _mm_or_si128(_mm_shuffle_epi8(p[i], widen4), alpha4));
+    }
+#endif
+    for (; x < w; x++) {
+      memcpy(dst + 4 * x, src + 3 * x, 3);
+      dst[4 * x + 3] = alpha;
+    }
+  } else if constexpr (std::is_same_v<SrcFormat, BGRA32> &&
+                       std::is_same_v<DstFormat, BGR24>) {
+#if defined(BMP_AVX2)
+    // Drop alpha within each lane, then join the two 12 byte halves
+    const __m256i narrow = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128, 0, 1,
+        2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    for (; x + 8 <= w; x += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * x));
+      v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, narrow), join);
+      _mm_storeu_si128((__m128i *)(dst + 3 * x), _mm256_castsi256_si128(v));
+      _mm_storel_epi64((__m128i *)(dst + 3 * x + 16),
+                       _mm256_extracti128_si256(v, 1));
+    }
+#endif
+#if defined(BMP_SSSE3)
+    const __m128i narrow4 = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13,
+                                          14, -128, -128, -128, -128);
+    for (; x + 16 <= w; x += 16) {
+      const uint8_t *s = src + 4 * x;
+      uint8_t *d = dst + 3 * x;
+      __m128i p[4];
+      for (int i = 0; i < 4; i++)
+        p[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + 16 * i)),
+                                narrow4);
+      // Each register holds 12 bytes, pack the four into three
+      _mm_storeu_si128((__m128i *)d,
+                       _mm_or_si128(p[0], _mm_slli_si128(p[1], 12)));
+      _mm_storeu_si128(
+          (__m128i *)(d + 16),
+          _mm_or_si128(_mm_srli_si128(p[1], 4), _mm_slli_si128(p[2], 8)));
+      _mm_storeu_si128(
+          (__m128i *)(d + 32),
+          _mm_or_si128(_mm_srli_si128(p[2], 8), _mm_slli_si128(p[3], 4)));
+    }
+#endif
+    for (; x < w; x++)
+      memcpy(dst + 3 * x, src + 4 * x, 3);
+  } else {
+    for (; x < w; x++) {
+      Color c = SrcFormat::Load(src + (size_t)x * SrcFormat::channels);
+      if constexpr (SrcFormat::alpha < 0)
+        c.alpha = alpha;
+      DstFormat::Store(dst + (size_t)x * DstFormat::channels, c);
+    }
+  }
+}
+
+// Blends one BGRA32 pixel s onto d, the reference for the SIMD kernels. The
+// alpha channel is blended like a color channel whose source value is 255.
+template <BLEND_MODE Mode> void BlendPixel(uint8_t *d, const uint8_t *s) {
+  if constexpr (Mode == BLEND_MODE::REPLACE) {
+    memcpy(d, s, 4);
+    return;
+  }
+  const uint32_t a = s[BGRA32::alpha];
+  for (int c = 0; c < 4; c++) {
+    const uint32_t sc = c == BGRA32::alpha ? 255 : s[c];
+    const uint32_t dc = d[c];
+    uint32_t b = sc;
+    if constexpr (Mode == BLEND_MODE::ADD) {
+      d[c] = (uint8_t)std::min<uint32_t>(255, dc + UTILS::div255(sc * a));
+      continue;
+    } else if constexpr (Mode == BLEND_MODE::MULTIPLY) {
+      b = c == BGRA32::alpha ? 255 : UTILS::div255(sc * dc);
+    } else if constexpr (Mode == BLEND_MODE::SCREEN) {
+      b = sc + dc - UTILS::div255(sc * dc);
+    }
+    d[c] = UTILS::div255(b * a + dc * (255 - a));
+  }
+}
+
+// Blends n BGRA32 pixels of src onto dst. The pixels are widened to 16 bits
+// per channel, 4 pixels per step with SSE2 and 8 with AVX2, and rounded the
+// same way as BlendPixel.
+template <BLEND_MODE Mode>
+void BlendPixels(uint8_t *dst, const uint8_t *src, size_t n) {
+  size_t x = 0;
+  if constexpr (Mode == BLEND_MODE::REPLACE) {
+    memcpy(dst, src, 4 * n);
+    return;
+  }
+#if defined(BMP_AVX2)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c128 = _mm256_set1_epi16(128);
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i opaque8 = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i opaque16 = _mm256_set1_epi64x(0x00FF000000000000);
+    auto div255 = [&](__m256i v) {
+      v = _mm256_add_epi16(v, c128);
+      return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)),
+                               8);
+    };
+    auto blend = [&](__m256i s, __m256i d, __m256i a) {
+      if constexpr (Mode == BLEND_MODE::ADD) {
+        return _mm256_min_epi16(
+            _mm256_add_epi16(d, div255(_mm256_mullo_epi16(s, a))), c255);
+      } else {
+        __m256i b = s;
+        if constexpr (Mode == BLEND_MODE::MULTIPLY)
+          b = _mm256_max_epi16(div255(_mm256_mullo_epi16(s, d)), opaque16);
+        else if constexpr (Mode == BLEND_MODE::SCREEN)
+          b = _mm256_sub_epi16(_mm256_add_epi16(s, d),
+                               div255(_mm256_mullo_epi16(s, d)));
+        return div255(
+            _mm256_add_epi16(_mm256_mullo_epi16(b, a),
+                             _mm256_mullo_epi16(d, _mm256_sub_epi16(c255, a))));
+      }
+    };
+    for (; x + 8 <= n; x += 8) {
+      const __m256i s8 = _mm256_loadu_si256((const __m256i *)(src + 4 * x));
+      const __m256i d8 = _mm256_loadu_si256((const __m256i *)(dst + 4 * x));
+      // Source channels with alpha replaced by 255, alpha broadcast to all
+      // four channels of its pixel
+      const __m256i so8 = _mm256_or_si256(s8, opaque8);
+      __m256i a_lo = _mm256_unpacklo_epi8(s8, zero);
+      __m256i a_hi = _mm256_unpackhi_epi8(s8, zero);
+      a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(a_lo, 0xFF), 0xFF);
+      a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(a_hi, 0xFF), 0xFF);
+      __m256i lo = blend(_mm256_unpacklo_epi8(so8, zero),
+                         _mm256_unpacklo_epi8(d8, zero), a_lo);
+      __m256i hi = blend(_mm256_unpackhi_epi8(so8, zero),
+                         _mm256_unpackhi_epi8(d8, zero), a_hi);
+      _mm256_storeu_si256((__m256i *)(dst + 4 * x),
+                          _mm256_packus_epi16(lo, hi));
+    }
+  }
+#endif
+#if defined(BMP_SSE2)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i opaque8 = _mm_set1_epi32((int)0xFF000000);
+    const __m128i opaque16 = _mm_set1_epi64x(0x00FF000000000000);
+    auto div255 = [&](__m128i v) {
+      v = _mm_add_epi16(v, c128);
+      return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+    };
+    auto blend = [&](__m128i s, __m128i d, __m128i a) {
+      if constexpr (Mode == BLEND_MODE::ADD) {
+        return _mm_min_epi16(_mm_add_epi16(d, div255(_mm_mullo_epi16(s, a))),
+                             c255);
+      } else {
+        __m128i b = s;
+        if constexpr (Mode == BLEND_MODE::MULTIPLY)
+          b = _mm_max_epi16(div255(_mm_mullo_epi16(s, d)), opaque16);
+        else if constexpr (Mode == BLEND_MODE::SCREEN)
+          b = _mm_sub_epi16(_mm_add_epi16(s, d), div255(_mm_mullo_epi16(s, d)));
+        return div255(_mm_add_epi16(_mm_mullo_epi16(b, a),
+                                    _mm_mullo_epi16(d, _mm_sub_epi16(c255, a))));
+      }
+    };
+    for (; x + 4 <= n; x += 4) {
+      const __m128i s8 = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+      const __m128i d8 = _mm_loadu_si128((const __m128i *)(dst + 4 * x));
+      const __m128i so8 = _mm_or_si128(s8, opaque8);
+      __m128i a_lo = _mm_unpacklo_epi8(s8, zero);
+      __m128i a_hi = _mm_unpackhi_epi8(s8, zero);
+      a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a_lo, 0xFF), 0xFF);
+      a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a_hi, 0xFF), 0xFF);
+      __m128i lo = blend(_mm_unpacklo_epi8(so8, zero),
+                         _mm_unpacklo_epi8(d8, zero), a_lo);
+      __m128i hi = blend(_mm_unpackhi_epi8(so8, zero),
+                         _mm_unpackhi_epi8(d8, zero), a_hi);
+      _mm_storeu_si128((__m128i *)(dst + 4 * x), _mm_packus_epi16(lo, hi));
+    }
+  }
+#endif
+  for (; x < n; x++)
+    BlendPixel<Mode>(dst + 4 * x, src + 4 * x);
+}
+
+// Blends n BGRA32 pixels of src onto dst with the given mode
+void BlendPixels(uint8_t *dst, const uint8_t *src, size_t n, BLEND_MODE mode);
+
+// Blends the color src onto dst, see BLEND_MODE
+Color Blend(const Color &src, const Color &dst, BLEND_MODE mode);
+
+// Blends color onto n pixels starting at dst. 24-bit pixels are widened to
+// 32-bit in short chunks, so every format goes through the BGRA32 kernel.
+template <class PixelFormat>
+void BlendColor(uint8_t *dst, size_t n, const Color &color, BLEND_MODE mode) {
+  constexpr size_t chunk = 64;
+  uint8_t src[4 * chunk];
+  for (size_t i = 0; i < std::min(n, chunk); i++)
+    BGRA32::Store(src + 4 * i, color);
+  for (size_t x = 0; x < n; x += chunk) {
+    const size_t m = std::min(chunk, n - x);
+    uint8_t *p = dst + x * PixelFormat::channels;
+    if constexpr (std::is_same_v<PixelFormat, BGRA32>) {
+      BlendPixels(p, src, m, mode);
+    } else {
+      uint8_t wide[4 * chunk];
+      ConvertPixels<PixelFormat, BGRA32>(p, wide, (uint32_t)m);
+      BlendPixels(wide, src, m, mode);
+      ConvertPixels<BGRA32, PixelFormat>(wide, p, (uint32_t)m);
+    }
+  }
+}
+
+// Run-length kernels of the RLE8 and RLE4 codecs
+
+// Number of leading bytes a and b have in common, at most n, compared 32
+// (AVX2) or 16 (SSE2) at a time. Comparing a row with itself one pixel
+// further on gives the length of the run of equal pixels at its start.
+size_t CommonPrefix(const uint8_t *a, const uint8_t *b, size_t n);
+
+// Appends the w palette indices of a row, one byte each, encoded as BI_RLE8
+// (bits 8) or BI_RLE4 (bits 4), without the end of line marker. Runs of two
+// or more equal indices become runs, everything between them absolute
+// stretches.
+void EncodeRLERow(const uint8_t *indices, uint32_t w, uint16_t bits,
+                  std::vector<uint8_t> &out);
+
+// Decodes BI_RLE8 or BI_RLE4 data into h rows of w indices, one byte each,
+// stride bytes apart (w if 0). Pixels the data skips or never reaches are
+// left as they are, and malformed data is decoded as far as it goes.
+void DecodeRLE(const uint8_t *data, size_t size, uint16_t bits, uint32_t w,
+               uint32_t h, uint8_t *indices, size_t stride = 0);
+
+// Palette indices packed at 1, 4 or 8 bits per pixel as in bitmap files, the
+// leftmost pixel in the highest bits of a byte.
+
+// Unpacks the first w indices of a packed row, one byte each. 4-bit rows
+// are split 32 (SSE2) indices at a time.
+void UnpackIndices(const uint8_t *row, uint16_t bits, uint32_t w,
+                   uint8_t *indices);
+
+// Packs w indices, one byte each, into the (w * bits + 7) / 8 bytes of row.
+// Unused low bits of the last byte are zeroed, the row padding is not
+// touched.
+void PackIndices(const uint8_t *indices, uint16_t bits, uint32_t w,
+                 uint8_t *row);
+
+// Unpacks n pixels of 16 or 32 bits with the channels at masks into BGRA32.
+// Channels of up to 8 bits are widened by repeating their bits (abcde
+// becomes abcdeabc), wider ones keep their highest 8 bits, and without an
+// alpha mask the pixels are opaque. SSE2 unpacks 8 (16-bit) or 4 (32-bit)
+// pixels per step.
+void UnpackBitfields(const uint8_t *src, uint16_t bits, const BitMasks &masks,
+                     uint8_t *dst, size_t n);
+
+// Packs n BGRA32 pixels into 16 or 32 bits with the channels at masks, each
+// rounded to the nearest value its bits can hold. With SSE2, 16-bit pixels
+// of channels up to 8 bits are packed 8 at a time.
+void PackBitfields(const uint8_t *src, uint16_t bits, const BitMasks &masks,
+                   uint8_t *dst, size_t n);
+
+// Row kernels of the filters. They run across the bytes of a row, so every
+// channel is filtered on its own and all pixel formats share them.
+
+// dst[i] = sum[i] / d rounded to nearest for n bytes, d odd. Up to d = 4095
+// the quotient is taken with a float reciprocal, which is exact there since
+// an odd d never gives a tie.
+void DivideSums(const uint32_t *sum, uint8_t *dst, size_t n, uint32_t d);
+
+// Sums of d consecutive pixels of Channels channels along a row: for the w
+// pixels x, sums[x * Channels + c] is ext[x * Channels + c] + ... +
+// ext[(x + d - 1) * Channels + c]. The window slides one pixel per step,
+// with SSE2 all channels of a pixel move as one vector. 24-bit pixels are
+// handled as 4 bytes, so ext and sums need one element past their ends.
+template <size_t Channels>
+void WindowSums(const uint8_t *ext, uint32_t *sums, size_t w, size_t d) {
+  static_assert(Channels <= 4);
+#if defined(BMP_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  auto load = [&](const uint8_t *p) {
+    int32_t v;
+    memcpy(&v, p, 4);
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero),
+                              zero);
+  };
+  __m128i window = zero;
+  for (size_t p = 0; p < d; p++)
+    window = _mm_add_epi32(window, load(ext + p * Channels));
+  for (size_t x = 0;; x++) {
+    _mm_storeu_si128((__m128i *)(sums + x * Channels), window);
+    if (x + 1 == w)
+      break;
+    window = _mm_add_epi32(window, _mm_sub_epi32(load(ext + (x + d) * Channels),
+                                                 load(ext + x * Channels)));
+  }
+#else
+  uint32_t window[Channels] = {};
+  for (size_t p = 0; p < d; p++)
+    for (size_t c = 0; c < Channels; c++)
+      window[c] += ext[p * Channels + c];
+  for (size_t x = 0;; x++) {
+    for (size_t c = 0; c < Channels; c++)
+      sums[x * Channels + c] = window[c];
+    if (x + 1 == w)
+      break;
+    for (size_t c = 0; c < Channels; c++)
+      window[c] = window[c] + ext[(x + d) * Channels + c] -
+                  ext[x * Channels + c];
+  }
+#endif
+}
+
+// sum[i] += add[i] - sub[i] for n bytes
+void SlideSums(uint32_t *sum, const uint8_t *add, const uint8_t *sub,
+               size_t n);
+
+// dst[i] = kernel[0] * taps[0][i] + ... + kernel[len - 1] * taps[len - 1][i]
+// for n bytes, rounded to nearest and saturated to 0..255
+void ConvolveTaps(const float *const *taps, const float *kernel, size_t len,
+                  uint8_t *dst, size_t n);
+
+// Weights of one direction of a resampling filter. Output i is the weighted
+// sum of the taps inputs from first[i] on, weighed by weights[i * taps + j].
+// All outputs have the same number of taps: windows cut by the image edge
+// are moved inside it and padded with zero weights.
+struct ResampleWeights {
+  uint32_t taps{};
+  std::vector<uint32_t> first;
+  std::vector<float> weights;
+};
+
+// Weights resampling in inputs to out outputs, normalized to sum to 1
+ResampleWeights MakeResampleWeights(uint32_t in, uint32_t out,
+                                    RESIZE_FILTER filter);
+
+// Resamples a row of pixels of Channels channels horizontally into floats.
+// With SSE2 the channels of a pixel are one vector, so for 24-bit pixels dst
+// needs one float past its end.
+template <size_t Channels>
+void ResampleRow(const uint8_t *src, float *dst, const ResampleWeights &rw) {
+  static_assert(Channels == 3 || Channels == 4);
+  for (size_t x = 0; x < rw.first.size(); x++) {
+    const uint8_t *s = src + (size_t)rw.first[x] * Channels;
+    const float *w = &rw.weights[x * rw.taps];
+#if defined(BMP_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc = _mm_setzero_ps();
+    for (uint32_t j = 0; j < rw.taps; j++) {
+      const uint8_t *p = s + j * Channels;
+      // Built in a register, a partial copy to memory would stall the load
+      int32_t v = p[0] | p[1] << 8 | p[2] << 16;
+      if constexpr (Channels == 4)
+        v |= p[3] << 24;
+      __m128i px =
+          _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[j]), _mm_cvtepi32_ps(px)));
+    }
+    _mm_storeu_ps(dst + x * Channels, acc);
+#else
+    float acc[Channels] = {};
+    for (uint32_t j = 0; j < rw.taps; j++)
+      for (size_t c = 0; c < Channels; c++)
+        acc[c] += w[j] * s[j * Channels + c];
+    for (size_t c = 0; c < Channels; c++)
+      dst[x * Channels + c] = acc[c];
+#endif
+  }
+}
+
+// Work-stealing thread pool used by the library's parallel kernels. Every
+// worker has its own task queue; tasks submitted from a worker go to its own
+// queue and idle workers steal from the others.
+//
+// Concurrent writes: a Bitmap has no internal locking. Threads may write
+// disjoint pixels of the same image at the same time (SetPixel,
+// SetPixelUnchecked, FillSpan or the raw rows) once Unshare has been called,
+// since the first write after a copy reallocates the pixels, and as long as
+// no thread changes the image's size, bit depth, blend mode or buffer
+// meanwhile, e.g. with Read, SetBitDepth or SetBlendMode. Draw routines whose
+// pixels overlap must not run concurrently.
+// Pixels never share bytes, but neighbouring pixels share cache lines, so
+// parallel loops should split the image with ForEachRow, whose bands are
+// multiples of 64 bytes apart.
+class ThreadPool {
+public:
+  // threads is the number of threads a ParallelFor runs on, the calling
+  // thread included, so threads - 1 workers are started. 0 uses one thread
+  // per hardware thread.
+  ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+public:
+  unsigned Concurrency() const { return (unsigned)workers.size() + 1; }
+  // Queues task to run on a worker, without workers it runs right away. The
+  // first exception a queued task throws is kept for Wait.
+  void Submit(std::function<void()> task);
+  // Runs queued tasks on the calling thread until all submitted tasks are
+  // finished, then rethrows the first exception one of them threw
+  void Wait();
+  // Calls f(begin, end) for consecutive chunks of grain iterations covering
+  // [0, n) and returns when all have finished. The chunks start at multiples
+  // of grain. The calling thread takes part, so this may also be called from
+  // inside a task. If f throws, no further chunks are started and the first
+  // exception is rethrown once the running ones have finished.
+  template <class F> void ParallelFor(size_t n, size_t grain, F &&f);
+
+  // Shared pool used by the library's own kernels
+  static ThreadPool &Global();
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+  struct Local {
+    const ThreadPool *pool{};
+    size_t index{};
+  };
+  // Worker the calling thread is, if any
+  static Local &CurrentWorker();
+  size_t HomeQueue() const;
+  // Runs one task, from the back of queue home or else stolen from the front
+  // of another queue. Returns false if all queues are empty. An exception
+  // of the task is kept in error if it is the first.
+  bool RunOne(size_t home);
+  void WorkerLoop(size_t index);
+
+private:
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  std::atomic<size_t> queued{0};
+  std::atomic<size_t> unfinished{0};
+  std::atomic<size_t> next_queue{0};
+  bool stopping{false};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+};
+
+template <class F> void ThreadPool::ParallelFor(size_t n, size_t grain, F &&f) {
+  if (n == 0)
+    return;
+  grain = std::max<size_t>(grain, 1);
+  const size_t chunks = (n + grain - 1) / grain;
+  if (chunks == 1 || workers.empty()) {
+    for (size_t begin = 0; begin < n; begin += grain)
+      f(begin, std::min(n, begin + grain));
+    return;
+  }
+
+  // Helpers that start after the last chunk was claimed return without
+  // touching f, so the state they share is kept alive separately
+  struct State {
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::atomic_flag failed;
+    std::exception_ptr error;
+  };
+  auto state = std::make_shared<State>();
+  auto run = [state, chunks, grain, n, &f]() {
+    for (size_t c; (c = state->next++) < chunks;) {
+      try {
+        f(c * grain, std::min(n, (c + 1) * grain));
+      } catch (...) {
+        // Keep the first exception and count the chunks nobody claimed yet
+        // as done, so they are never started and the caller sees all finish
+        if (!state->failed.test_and_set())
+          state->error = std::current_exception();
+        size_t claimed = state->next.exchange(chunks);
+        if (claimed < chunks)
+          state->done += chunks - claimed;
+      }
+      state->done++;
+    }
+  };
+  size_t helpers = std::min<size_t>(workers.size(), chunks - 1);
+  for (size_t i = 0; i < helpers; i++)
+    Submit(run);
+  run();
+  // Help out with other tasks instead of blocking while chunks are running.
+  // Their exceptions are kept for Wait, not thrown here.
+  size_t home = HomeQueue();
+  while (state->done.load() < chunks)
+    if (!RunOne(home))
+      std::this_thread::yield();
+  if (state->error)
+    std::rethrow_exception(state->error);
+}
+
+// Calls f(begin, end) for chunks of [0, n) on the shared pool
+template <class F> void ParallelFor(size_t n, size_t grain, F &&f) {
+  ThreadPool::Global().ParallelFor(n, grain, std::forward<F>(f));
+}
+
+// Calls f(y_begin, y_end) for bands of rows of an image with the given height
+// and stride, in parallel on pool. Bands start at multiples of 64 bytes from
+// the first row, so with a 64 byte aligned buffer no cache line is written by
+// two bands. Bands are at least 64 KB, smaller images run as one band on the
+// calling thread.
+template <class F>
+void ForEachRowBand(uint32_t height, uint32_t stride, F &&f,
+                    ThreadPool &pool = ThreadPool::Global()) {
+  if (height == 0)
+    return;
+  // Rows per band must be a multiple of align for the bands to start on a
+  // multiple of 64 bytes
+  const size_t align = 64 / std::gcd<size_t>(stride, 64);
+  size_t rows = std::max<size_t>((64 << 10) / std::max<uint32_t>(stride, 1),
+                                 height / (4 * pool.Concurrency()));
+  rows = std::max<size_t>((rows + align - 1) / align * align, 1);
+  pool.ParallelFor(height, rows, [&](size_t begin, size_t end) {
+    f((uint32_t)begin, (uint32_t)end);
+  });
+}
+
+// Calls f(x_begin, x_end) for strips of the bytes [0, row_bytes) of every row,
+// in parallel on pool. Filters walking down the columns keep about
+// column_bytes bytes per byte of a strip in cache, so strips are narrow
+// enough for that to stay within 256 KB, and every thread gets a few.
+template <class F>
+void ForEachColumnStrip(size_t row_bytes, size_t column_bytes, F &&f,
+                        ThreadPool &pool = ThreadPool::Global()) {
+  if (row_bytes == 0)
+    return;
+  size_t strip = (256 << 10) / std::max<size_t>(column_bytes, 1);
+  strip = std::min(strip, (row_bytes + 4 * pool.Concurrency() - 1) /
+                              (4 * pool.Concurrency()));
+  strip = std::max<size_t>(strip / 64 * 64, 64);
+  pool.ParallelFor(row_bytes, strip, std::forward<F>(f));
+}
+
+// Opt-in instrumentation. Building with BMP_ENABLE_INSTRUMENTATION defined
+// makes the library count pixels, file bytes and allocations in
+// GetCounters(), and time file I/O, conversions, filters and draw calls as
+// spans that WriteTrace exports as Chrome trace JSON (chrome://tracing or
+// ui.perfetto.dev). Without it the BMP_TRACE, BMP_DRAW and BMP_COUNT macros
+// expand to nothing, the counters stay zero and the trace stays empty.
+#if defined(BMP_ENABLE_INSTRUMENTATION)
+#define BMP_CONCAT_(a, b) a##b
+#define BMP_CONCAT(a, b) BMP_CONCAT_(a, b)
+#define BMP_TRACE(name) ::BMP::TraceSpan BMP_CONCAT(bmp_trace_, __LINE__)(name)
+#define BMP_DRAW(primitive, name)                                              \
+  ::BMP::DrawScope BMP_CONCAT(bmp_draw_, __LINE__)(                            \
+      ::BMP::PRIMITIVE::primitive, name)
+#define BMP_COUNT(counter, n)                                                  \
+  ::BMP::GetCounters().counter.fetch_add((uint64_t)(n),                        \
+                                         std::memory_order_relaxed)
+#define BMP_COUNT_PIXELS(primitive, written, clipped)                          \
+  ::BMP::CountPixels(::BMP::PRIMITIVE::primitive, (uint64_t)(written),         \
+                     (uint64_t)(clipped))
+#else
+#define BMP_TRACE(name) ((void)0)
+#define BMP_DRAW(primitive, name) ((void)0)
+#define BMP_COUNT(counter, n) ((void)sizeof(n))
+#define BMP_COUNT_PIXELS(primitive, written, clipped)                          \
+  ((void)sizeof((written) + (clipped)))
+#endif
+
+enum class PRIMITIVE {
+  PIXEL, // SetPixel
+  SPAN,
+  LINE,
+  RECT,
+  CIRCLE,
+  TRIANGLE,
+  FILL,
+  BLIT, // Blit and Composite
+  COUNT
+};
+
+struct PrimitiveCounters {
+  std::atomic<uint64_t> calls{};
+  std::atomic<uint64_t> pixels_written{};
+  // Pixels cut off by the clip rectangle where spans and lines are clipped.
+  // Shapes outside it altogether only count as a call, and so do the rows a
+  // large circle skips.
+  std::atomic<uint64_t> pixels_clipped{};
+};
+
+// Draw calls count their pixels under their own primitive, also those they
+// draw through other routines, e.g. the spans of FillCircle. Commands of a
+// DisplayList run once per tile they touch, clipped to the tile, and are
+// counted that way.
+struct Counters {
+  PrimitiveCounters primitives[(size_t)PRIMITIVE::COUNT];
+  std::atomic<uint64_t> bytes_read{};
+  std::atomic<uint64_t> bytes_written{};
+  // Pixel buffers allocated from the system, not served by a pool's cache
+  std::atomic<uint64_t> allocations{};
+  std::atomic<uint64_t> allocated_bytes{};
+
+  PrimitiveCounters &operator[](PRIMITIVE p) { return primitives[(size_t)p]; }
+};
+
+Counters &GetCounters();
+void ResetCounters();
+// Writes the spans recorded so far, at most 1 << 20, later ones are dropped
+bool WriteTrace(const char *fn);
+void ClearTrace();
+// Adds pixels to the primitive of the innermost draw call on this thread, or
+// to primitive outside of draw calls
+void CountPixels(PRIMITIVE primitive, uint64_t written, uint64_t clipped);
+
+// Records its lifetime as a span on the calling thread. name must outlive
+// the trace, e.g. a string literal.
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name);
+  ~TraceSpan();
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Scope of a draw call. Only the outermost one on a thread counts a call and
+// takes the pixels, and it is traced unless it runs inside another span, so
+// DisplayList::Render shows up as its tiles rather than every command.
+class DrawScope {
+public:
+  DrawScope(PRIMITIVE primitive, const char *name);
+  ~DrawScope();
+  DrawScope(const DrawScope &) = delete;
+  DrawScope &operator=(const DrawScope &) = delete;
+
+private:
+  const char *name{};
+  std::chrono::steady_clock::time_point start;
+  bool outer{};
+};
+
+// Tag selecting the constructors and resizes that leave pixel memory
+// uninitialized, for images whose pixels are all written right after
+struct Uninitialized {};
+inline constexpr Uninitialized uninitialized{};
+
+// Recycles pixel storage. Buffers allocated from a pool give their memory
+// back to it when they are freed or reallocated, and later allocations reuse
+// the smallest cached block that fits, so a loop creating and dropping images
+// of the same sizes stops allocating after its first iteration. Thread-safe;
+// the pool must outlive the buffers allocated from it.
+class BitmapPool {
+public:
+  // Freed blocks that would take the cache past max_cached bytes are returned
+  // to the system instead
+  explicit BitmapPool(size_t max_cached = SIZE_MAX) : max_cached(max_cached) {}
+  ~BitmapPool();
+
+  BitmapPool(const BitmapPool &) = delete;
+  BitmapPool &operator=(const BitmapPool &) = delete;
+
+public:
+  // Returns a 64 byte aligned block of at least n bytes and stores its size in
+  // capacity. A cached block is reused if at most twice as large as needed.
+  uint8_t *Allocate(size_t n, size_t &capacity);
+  void Deallocate(uint8_t *p, size_t capacity);
+  // Returns all cached blocks to the system
+  void Trim();
+  size_t CachedBytes() const;
+  // Number of allocations that could not be served from the cache
+  size_t Misses() const;
+
+private:
+  // Cached blocks are linked through their first bytes
+  struct FreeBlock {
+    FreeBlock *next;
+    size_t capacity;
+  };
+  mutable std::mutex mutex;
+  FreeBlock *free_blocks{};
+  size_t cached{};
+  size_t misses{};
+  size_t max_cached;
+};
+
+// Pixel storage of the bitmaps. A byte array with the interface of
+// std::vector<uint8_t>, but 64 byte aligned, optionally allocated from a
+// BitmapPool and able to grow without initializing the new bytes.
+//
+// Copies share the bytes, reference counted, until one of them is modified:
+// the non-const accessors first give the buffer bytes of its own if they are
+// shared (copy-on-write), so copying is O(1) and only the first write after
+// it pays for the copy. Pointers taken from a buffer must therefore not be
+// written through once it has been copied, unless the buffer is pinned (see
+// Pin). Sharing is thread-safe, but the first write after a copy must not
+// race with other accesses to the same buffer; the library's parallel
+// kernels make it before splitting the work.
+class PixelBuffer {
+public:
+  // Keeps the bytes of a buffer alive for pointers into them, those of the
+  // views of a Bitmap. The bytes of a pinned buffer are never shared: copies
+  // of it copy them, so writes through the pointers reach the buffer alone.
+  class Pin {
+  public:
+    Pin() {}
+    // Unshares the bytes of buffer first
+    explicit Pin(PixelBuffer &buffer);
+    Pin(const Pin &other) noexcept;
+    Pin(Pin &&other) noexcept : bytes(std::exchange(other.bytes, nullptr)) {}
+    Pin &operator=(Pin other) noexcept {
+      std::swap(bytes, other.bytes);
+      return *this;
+    }
+    ~Pin();
+
+  private:
+    uint8_t *bytes{};
+  };
+
+public:
+  PixelBuffer() {}
+  explicit PixelBuffer(BitmapPool *pool) : pool(pool) {}
+  // Copies of a pinned buffer allocate, the others only share the bytes
+  PixelBuffer(const PixelBuffer &other);
+  PixelBuffer(PixelBuffer &&other) noexcept;
+  PixelBuffer &operator=(const PixelBuffer &other);
+  PixelBuffer &operator=(PixelBuffer &&other) noexcept;
+  ~PixelBuffer() { Release(); }
+
+public:
+  uint8_t *data() {
+    MakeUnique();
+    return bytes;
+  }
+  const uint8_t *data() const { return bytes; }
+  size_t size() const { return count; }
+  size_t capacity() const { return bytes ? Header()->capacity : 0; }
+  bool empty() const { return count == 0; }
+  uint8_t *begin() { return data(); }
+  const uint8_t *begin() const { return bytes; }
+  uint8_t *end() { return data() + count; }
+  const uint8_t *end() const { return bytes + count; }
+  uint8_t &operator[](size_t i) { return data()[i]; }
+  const uint8_t &operator[](size_t i) const { return bytes[i]; }
+
+  // Keeps the memory unless it is shared, like std::vector
+  void clear();
+  void reserve(size_t n);
+  void resize(size_t n, uint8_t value = 0);
+  // Resizes leaving the bytes past the old size uninitialized
+  void resize(size_t n, Uninitialized);
+  void assign(size_t n, uint8_t value);
+  void assign(const uint8_t *first, const uint8_t *last);
+  // Pool new bytes are allocated from, copies use the same one
+  BitmapPool *GetPool() const { return pool; }
+  // Whether the bytes are shared with a copy
+  bool IsShared() const {
+    return bytes &&
+           (Header()->refs.load(std::memory_order_acquire) & buffer_refs) > 1;
+  }
+  // Whether pins keep pointers into the bytes
+  bool IsPinned() const {
+    return bytes &&
+           Header()->refs.load(std::memory_order_acquire) > buffer_refs;
+  }
+
+  friend bool operator==(const PixelBuffer &a, const PixelBuffer &b) {
+    return a.count == b.count && std::equal(a.begin(), a.end(), b.begin());
+  }
+
+private:
+  // Stored in front of the bytes of every allocation, which start 64 bytes
+  // later to keep their alignment. The low 32 bits of refs count the buffers
+  // sharing the bytes, the high 32 the pins; the bytes are freed when both
+  // are gone.
+  struct Shared {
+    std::atomic<uint64_t> refs;
+    size_t capacity;
+    BitmapPool *pool;
+  };
+  static constexpr size_t header_size = 64;
+  static constexpr uint64_t buffer_refs = 0xFFFFFFFF;
+  static constexpr uint64_t pin_ref = (uint64_t)1 << 32;
+  Shared *Header() const {
+    return reinterpret_cast<Shared *>(bytes - header_size);
+  }
+  static Shared *Header(uint8_t *bytes) {
+    return reinterpret_cast<Shared *>(bytes - header_size);
+  }
+  void MakeUnique() {
+    if (IsShared())
+      Reallocate(count, count);
+  }
+  // Moves to a new unshared allocation of at least n bytes, keeping the
+  // first keep bytes
+  void Reallocate(size_t n, size_t keep);
+  // Drops this buffer's reference, freeing the bytes with the last one
+  void Release();
+  // Drops n from the count of bytes, freeing them when it reaches zero
+  static void Unreference(uint8_t *bytes, uint64_t n);
+
+private:
+  uint8_t *bytes{};
+  size_t count{};
+  BitmapPool *pool{};
+};
+
+// Image in memory. Copies share the pixels until either of them is written
+// (see PixelBuffer), so copying one or passing it by value only copies the
+// headers. Moves are noexcept.
 class Bitmap {
 public: // change to protected later
   FileHeader file_header{};
   Infoheader info_header{};
-  std::vector<uint8_t> vec_pixels{};
-  const char *filename{};
+  PixelBuffer vec_pixels{};
+  std::string filename{};
   BIT_DEPTH bit_depth{};
 
 public:
   Bitmap(){};
   Bitmap(const char *fn) {
-    filename = fn;
+    filename = fn ? fn : "";
     Read(fn);
   }
+  // A w x h image with all pixels zero, its storage allocated from pool if
+  // one is given
   Bitmap(const char *fn, const uint32_t &w, const uint32_t &h,
-         bool alpha = true) {
-    filename = fn;
-    info_header.width = w;
-    info_header.height = h;
-    int channels;
-    int padding;
-    if (alpha) {
-      channels = 4;
-      padding = 0;
-      SetBitDepth(BIT_DEPTH::BD_32);
-    } else {
-      channels = 3;
-      padding = w % 4;
-      SetBitDepth(BIT_DEPTH::BD_24);
-    }
-    vec_pixels.clear();
-    vec_pixels.resize((channels * w + padding) * h, 0);
-    file_header.file_size =
-        file_header.offset_data + (uint32_t)vec_pixels.size();
+         bool alpha = true, BitmapPool *pool = nullptr)
+      : Bitmap(fn, w, h, alpha, uninitialized, pool) {
+    std::fill(vec_pixels.begin(), vec_pixels.end(), 0);
   }
+  // Same, but leaves the pixels uninitialized; only the row padding is
+  // zeroed. For images that are filled or drawn over entirely right away.
+  Bitmap(const char *fn, const uint32_t &w, const uint32_t &h, bool alpha,
+         Uninitialized, BitmapPool *pool = nullptr);
 
 public:
+  // Reads uncompressed 24 and 32-bit files, and palette files (1, 4 and
+  // 8-bit, RLE8 and RLE4), whose pixels are expanded to 24 bits. 16-bit
+  // files and BITFIELDS files are unpacked to 24 bits, or 32 if they have
+  // an alpha mask.
   bool Read(const char *fn);
-  bool Write(const char *fn) const;
-  bool Save() const { return Write(filename); }
+  // RLE8 and RLE4 store the image with a palette of its colors, which fails
+  // if it has more than 256 or 16 of them (see IndexedBitmap to reduce the
+  // colors). BITFIELDS stores it as 16-bit RGB565. Alpha is not stored then.
+  bool Write(const char *fn,
+             COMPRESSION compression = COMPRESSION::RGB) const;
+  bool Save() const { return Write(filename.c_str()); }
 
 public:
   // Setters
   void SetPixel(int x, int y, const Color &color);
-  void SetBitDepth(const BIT_DEPTH &bd);
-  void SetFileName(const char *fn) { filename = fn; }
+  void SetBitDepth(const BIT_DEPTH &bd); // Converts existing pixels
+  void SetFileName(const char *fn) { filename = fn ? fn : ""; }
+  // Repacks the pixels into the bit depth bd. Converting to 32-bit sets all
+  // alpha values to alpha, converting to 24-bit drops them.
+  void ConvertTo(const BIT_DEPTH &bd, uint8_t alpha = 255);
+  // Blend mode of the draw routines, REPLACE by default. Outlines whose
+  // segments meet (DrawCircle, DrawTriangle) blend the shared pixels twice.
+  void SetBlendMode(BLEND_MODE mode) { blend_mode = mode; }
 
 public:
   // Drawing routines
   void Fill(const Color &color);
+  // Fills the pixels x0 to x1 (inclusive, in any order) on row y
+  void FillSpan(int x0, int x1, int y, const Color &color);
   // Implements Bresenham's line algorithm
   // (https://en.wikipedia.org/wiki/Bresenham%27s_line_algorithm)
   void DrawLine(int sx, int sy, int ex, int ey, Color color);
@@ -162,80 +1305,4093 @@ public:
                     const Color &color);
   void FillTriangle(Vertex v1, Vertex v2, Vertex v3, const Color &color);
 
+  // Fills a batch of triangles in order with a half-space (edge function)
+  // rasterizer. A pixel is covered when its center lies inside the triangle;
+  // centers exactly on an edge follow the top-left rule, so triangles sharing
+  // an edge never both cover a pixel of it and leave no gaps. Coverage is
+  // evaluated 8 pixels per SIMD step in 8x8 blocks, fully covered blocks are
+  // filled without per-pixel tests and empty blocks are skipped. Vertices are
+  // expected within +-2^29, larger triangles fall back to FillTriangle.
+  void FillTriangles(std::span<const Triangle> triangles);
+
+  // Blends src onto the image with its pixel (0, 0) at (x, y), clipped to
+  // the image. Rows are blended in parallel; src must not be this image.
+  void Composite(const Bitmap &src, int x, int y,
+                 BLEND_MODE mode = BLEND_MODE::SOURCE_OVER);
+  // Copies the pixels of src inside src_rect to this image, with the corner
+  // of src_rect at dst_pos, clipped to both images. Pixels are copied as is
+  // whatever the blend mode: rows with memcpy, or with the SIMD repacking
+  // kernels when the bit depths differ. src may be this image or a view
+  // overlapping it.
+  void Blit(const Bitmap &src, const Rect &src_rect, const Vertex &dst_pos);
+
+public:
+  // Views. A view is a Bitmap sharing the pixels and stride of another, so
+  // every routine drawing into it or filtering it changes the pixels of the
+  // parent. A view keeps those pixels alive, and while it exists copies of
+  // the parent copy the pixels rather than share them, so writing a view
+  // never changes a copy. Copies of a view are views as well. Their bit
+  // depth can not be changed.
+
+  // The w x h pixels from (x, y) on, clipped to the image
+  Bitmap SubView(int x, int y, int w, int h);
+  bool IsView() const { return view != nullptr; }
+
+public:
+  // Filters. Every channel, alpha included, is filtered on its own and the
+  // pixels beyond the edges repeat the edge pixels. Rows are filtered in
+  // parallel bands, columns in parallel strips a few rows of which fit in
+  // cache.
+
+  // Convolves the rows with kernel_x and then the columns with kernel_y, an
+  // empty kernel skips its direction. Tap j of a kernel of n taps weighs the
+  // pixel at offset j - n / 2.
+  void Convolve(std::span<const float> kernel_x,
+                std::span<const float> kernel_y);
+  // Mean over the (2 radius + 1) x (2 radius + 1) square around each pixel,
+  // repeated passes times. Running sums make it O(1) per pixel for any radius
+  // below 2^23, the results are rounded to nearest.
+  void BoxBlur(int radius, int passes = 1);
+  // Approximates a Gaussian blur with three box blurs whose variances add up
+  // to sigma^2 (http://blog.ivank.net/fastest-gaussian-blur.html)
+  void GaussianBlur(double sigma);
+
+public:
+  // Returns the image resampled to w x h pixels, in the same bit depth.
+  // Rows are resampled horizontally through precomputed weight tables and
+  // then combined vertically, in parallel bands of output rows.
+  Bitmap Resize(uint32_t w, uint32_t h,
+                RESIZE_FILTER filter = RESIZE_FILTER::BILINEAR) const;
+
 public:
   // Getters
   Color GetPixelColor(const int &x, const int &y) const;
   uint32_t Width() const { return info_header.width; }
   uint32_t Height() const { return info_header.height; }
   uint32_t GetFileSize() const { return file_header.file_size; }
+  const std::string &GetFileName() const { return filename; }
   BIT_DEPTH GetBitDepth() const { return bit_depth; }
+  BLEND_MODE GetBlendMode() const { return blend_mode; }
 
 public:
-  void LoadFromByteArray(uint8_t *data, int n);
-};
+  // Raw pixel access. Rows are stored bottom-up, Stride() bytes apart, with
+  // the channels of a pixel in BGR(A) order. The unchecked accessors skip the
+  // bounds check and are meant for kernels that already clipped.
+  uint8_t *Data() { return view ? view : vec_pixels.data(); }
+  const uint8_t *Data() const { return view ? view : vec_pixels.data(); }
+  uint8_t *Row(const uint32_t &y) { return Data() + (size_t)y * Stride(); }
+  const uint8_t *Row(const uint32_t &y) const {
+    return Data() + (size_t)y * Stride();
+  }
+  uint32_t Stride() const {
+    return view ? view_stride
+                : UTILS::row_stride(info_header.width,
+                                    info_header.bits_per_pixel);
+  }
+  uint32_t Channels() const { return info_header.bits_per_pixel / 8; }
+  void SetPixelUnchecked(int x, int y, const Color &color);
+  Color GetPixelUnchecked(int x, int y) const;
+  // Calls f(y_begin, y_end) for bands of rows in parallel, see ForEachRowBand.
+  // Pixels shared with a copy are unshared first, so f may write them.
+  template <class F>
+  void ForEachRow(F &&f, ThreadPool &pool = ThreadPool::Global()) {
+    Unshare();
+    ForEachRowBand(Height(), Stride(), std::forward<F>(f), pool);
+  }
+#if defined(__cpp_lib_mdspan)
+  DynamicPixelMdspan<uint8_t> Mdspan() {
+    return MakeMdspan<DynamicPixelMdspan<uint8_t>>(Data());
+  }
+  DynamicPixelMdspan<const uint8_t> Mdspan() const {
+    return MakeMdspan<DynamicPixelMdspan<const uint8_t>>(Data());
+  }
+#endif
 
-uint32_t UTILS::bytes_to_uint32(uint8_t *data) {
-  uint32_t result = 0;
-  for (int i = 0; i < 4; i++)
-    result += data[i] * (1 << (8 * i));
-  return result;
-}
+public:
+  void LoadFromByteArray(uint8_t *data, int n);
 
-uint16_t UTILS::bytes_to_uint16(uint8_t *data) {
-  uint16_t result = 0;
-  for (int i = 0; i < 2; i++)
-    result += data[i] * (1 << (8 * i));
-  return result;
-}
+private:
+  friend class DisplayList;
+  friend class IndexedBitmap;
 
-uint8_t *UTILS::uint32_to_bytes(uint32_t data) {
-  uint8_t *result = new uint8_t[4];
-  result[0] = (data & 0x000000FF) >> 0;
-  result[1] = (data & 0x0000FF00) >> 8;
-  result[2] = (data & 0x00FF0000) >> 16;
-  result[3] = (data & 0xFF000000) >> 24;
-  return result;
-}
+  BLEND_MODE blend_mode{BLEND_MODE::REPLACE};
+  // First pixel and stride of the parent's pixels if this is a view, which
+  // keeps them alive and unshared through view_pin
+  uint8_t *view{};
+  uint32_t view_stride{};
+  PixelBuffer::Pin view_pin{};
 
-uint8_t *UTILS::uint16_to_bytes(uint16_t data) {
-  uint8_t *result = new uint8_t[2];
-  result[0] = (data & 0x00FF) >> 0;
-  result[1] = (data & 0xFF00) >> 8;
-  return result;
-}
+  bool HasPixels() const { return view || !vec_pixels.empty(); }
+  // Maps every pixel to the index of its color in palette, rows of Width()
+  // indices one after another. Alpha is ignored. False if the image has more
+  // than max_colors colors.
+  bool Palettize(size_t max_colors, std::vector<Color> &palette,
+                 std::vector<uint8_t> &indices) const;
+  // Reads 1, 4 and 8-bit files through IndexedBitmap, expanded to 24 bits
+  bool ReadIndexed(const char *fn);
+  bool WriteRLE(const char *fn, COMPRESSION compression) const;
+  // 16-bit and BITFIELDS files, unpacked to 24 or 32 bits
+  bool ReadBitfields(std::ifstream &infile, const char *fn);
+  bool WriteBitfields(const char *fn) const;
+  // Gives the image pixels of its own if they are shared with a copy. Called
+  // before writing them from several threads, which must not each do it.
+  void Unshare() {
+    if (!view)
+      vec_pixels.data();
+  }
 
-bool Bitmap::Read(const char *fn) {
-  // Open file with name fn
-  std::ifstream infile(fn, std::ios::binary);
-  if (!infile.is_open()) {
-    std::cout << "Failed to read " << fn << "\n";
-    return false;
+  // Writes n pixels of color at dst, or a single pixel at (x, y), with the
+  // current blend mode
+  template <class PixelFormat>
+  void PutPixels(uint8_t *dst, size_t n, const Color &color) {
+    if (blend_mode == BLEND_MODE::REPLACE)
+      FillPixels<PixelFormat>(dst, n, color);
+    else
+      BlendColor<PixelFormat>(dst, n, color, blend_mode);
   }
+  void Plot(int x, int y, const Color &color);
 
-  // Create buffer to import data later passed onto Bitmap object
-  std::vector<uint8_t> buffer{std::istreambuf_iterator<char>(infile),
-                              std::istreambuf_iterator<char>()};
-  // Load into file header struct
-  file_header.signature = UTILS::bytes_to_uint16(&buffer[0x0000]);
-  file_header.file_size = UTILS::bytes_to_uint32(&buffer[0x0002]);
-  file_header.reserved1 = UTILS::bytes_to_uint16(&buffer[0x0006]);
-  file_header.reserved2 = UTILS::bytes_to_uint16(&buffer[0x0008]);
-  file_header.offset_data = UTILS::bytes_to_uint32(&buffer[0x000A]);
+  // One direction of the filters
+  void BoxBlurRows(int radius);
+  void BoxBlurColumns(int radius);
+  void ConvolveRows(std::span<const float> kernel);
+  void ConvolveColumns(std::span<const float> kernel);
 
-  // Load into info header struct
-  info_header.header_size = UTILS::bytes_to_uint32(&buffer[0x000E]);
-  info_header.width = UTILS::bytes_to_uint32(&buffer[0x0012]);
-  info_header.height = UTILS::bytes_to_uint32(&buffer[0x0016]);
-  info_header.planes = UTILS::bytes_to_uint16(&buffer[0x001A]);
-  info_header.bits_per_pixel = UTILS::bytes_to_uint16(&buffer[0x001C]);
-  info_header.compression = UTILS::bytes_to_uint32(&buffer[0x001E]);
-  info_header.image_size = UTILS::bytes_to_uint32(&buffer[0x0022]);
-  info_header.x_res = UTILS::bytes_to_uint32(&buffer[0x0026]);
-  info_header.y_res = UTILS::bytes_to_uint32(&buffer[0x002A]);
-  info_header.colors_used = UTILS::bytes_to_uint32(&buffer[0x002E]);
-  info_header.colors_important = UTILS::bytes_to_uint32(&buffer[0x0032]);
+  // The draw routines clipped to clip, which has to lie inside the image.
+  // The public routines clip to Bounds(), DisplayList to its tiles.
+  Rect Bounds() const { return Rect{0, 0, (int)Width(), (int)Height()}; }
+  void FillSpan(int x0, int x1, int y, const Color &color, const Rect &clip);
+  void DrawLine(int sx, int sy, int ex, int ey, const Color &color,
+                const Rect &clip);
+  void DrawRect(const int &x, const int &y, const int &w, const int &h,
+                const Color &color, const Rect &clip);
+  void FillRect(const int &x, const int &y, const int &w, const int &h,
+                const Color &color, const Rect &clip);
+  void DrawCircle(const int &xc, const int &yc, const int &r,
+                  const Color &color, const Rect &clip);
+  void FillCircle(const int &xc, const int &yc, const int &r,
+                  const Color &color, const Rect &clip);
+  // FillCircle for radii larger than the clip rectangle, filling the visible
+  // rows only. Beyond 2^28, where the walk's closed form is no longer exact,
+  // the rows of the disk x^2 + y^2 <= r^2 are filled instead.
+  void FillLargeCircle(const int &xc, const int &yc, const int &r,
+                       const Color &color, const Rect &clip);
+  void DrawTriangle(const int &x1, const int &y1, const int &x2, const int &y2,
+                    const int &x3, const int &y3, const Color &color,
+                    const Rect &clip);
+  void FillTriangle(Vertex v1, Vertex v2, Vertex v3, const Color &color,
+                    const Rect &clip);
+  template <class PixelFormat> void RasterizeTriangle(const Triangle &tri);
+#if defined(__cpp_lib_mdspan)
+  template <class Span> Span MakeMdspan(typename Span::data_handle_type p) const {
+    using Mapping = typename Span::mapping_type;
+    std::array<size_t, 3> strides{Stride(), Channels(), 1};
+    return Span(p, Mapping(typename Span::extents_type(Height(), Width(),
+                                                       Channels()),
+                           strides));
+  }
+#endif
+};
 
-  // Set color depth
+// Only moves are noexcept: copies copy the file name and the pixels of a
+// pinned buffer, which may throw std::bad_alloc
+static_assert(std::is_nothrow_move_constructible_v<Bitmap> &&
+              std::is_nothrow_move_assignable_v<Bitmap>);
+
+// Bitmap with its pixel format fixed at compile time. Stride, channel count
+// and channel order are constants, so the per-pixel routines compile to plain
+// loads and stores without switching on the bit depth. Bitmap is the runtime
+// counterpart, converting between the two moves or converts the pixels.
+template <class PixelFormat> class BasicBitmap {
+public: // change to protected later
+  FileHeader file_header{};
+  Infoheader info_header{};
+  PixelBuffer vec_pixels{};
+  std::string filename{};
+
+public:
+  using Format = PixelFormat;
+  static constexpr BIT_DEPTH bit_depth = PixelFormat::bit_depth;
+
+public:
+  BasicBitmap() { info_header.bits_per_pixel = PixelFormat::bits_per_pixel; }
+  BasicBitmap(const char *fn) : BasicBitmap() {
+    filename = fn ? fn : "";
+    Read(fn);
+  }
+  BasicBitmap(const char *fn, const uint32_t &w, const uint32_t &h,
+              BitmapPool *pool = nullptr);
+  // Leaves the pixels uninitialized, see Bitmap
+  BasicBitmap(const char *fn, const uint32_t &w, const uint32_t &h,
+              Uninitialized, BitmapPool *pool = nullptr);
+  explicit BasicBitmap(const Bitmap &bmp);
+  explicit BasicBitmap(Bitmap &&bmp);
+
+public:
+  bool Read(const char *fn);
+  bool Write(const char *fn) const;
+  bool Save() const { return Write(filename.c_str()); }
+  Bitmap ToBitmap() const;
+
+public:
+  // Setters
+  void SetPixel(int x, int y, const Color &color) {
+    if (x < 0 || y < 0 || x >= (int)Width() || y >= (int)Height())
+      return;
+    SetPixelUnchecked(x, y, color);
+  }
+  void SetPixelUnchecked(int x, int y, const Color &color) {
+    PixelFormat::Store(Data() + Index(x, y), color);
+  }
+  void SetFileName(const char *fn) { filename = fn ? fn : ""; }
+
+public:
+  // Drawing routines
+  void Fill(const Color &color);
+
+public:
+  // Getters
+  Color GetPixelColor(const int &x, const int &y) const;
+  uint32_t Width() const { return info_header.width; }
+  uint32_t Height() const { return info_header.height; }
+  uint32_t GetFileSize() const { return file_header.file_size; }
+  BIT_DEPTH GetBitDepth() const { return bit_depth; }
+
+public:
+  // Raw pixel access, see Bitmap
+  uint8_t *Data() { return vec_pixels.data(); }
+  const uint8_t *Data() const { return vec_pixels.data(); }
+  uint8_t *Row(const uint32_t &y) { return Data() + (size_t)y * stride; }
+  const uint8_t *Row(const uint32_t &y) const {
+    return Data() + (size_t)y * stride;
+  }
+  uint32_t Stride() const { return stride; }
+  static constexpr uint32_t Channels() { return PixelFormat::channels; }
+  Color GetPixelUnchecked(int x, int y) const {
+    return PixelFormat::Load(Data() + Index(x, y));
+  }
+  template <class F>
+  void ForEachRow(F &&f, ThreadPool &pool = ThreadPool::Global()) {
+    vec_pixels.data(); // Unshares the pixels, see Bitmap::ForEachRow
+    ForEachRowBand(Height(), Stride(), std::forward<F>(f), pool);
+  }
+#if defined(__cpp_lib_mdspan)
+  PixelMdspan<PixelFormat> Mdspan() {
+    return MakeMdspan<PixelMdspan<PixelFormat>>(Data());
+  }
+  PixelMdspan<PixelFormat, const uint8_t> Mdspan() const {
+    return MakeMdspan<PixelMdspan<PixelFormat, const uint8_t>>(Data());
+  }
+#endif
+
+private:
+#if defined(__cpp_lib_mdspan)
+  template <class Span> Span MakeMdspan(typename Span::data_handle_type p) const {
+    using Mapping = typename Span::mapping_type;
+    std::array<size_t, 3> strides{stride, PixelFormat::channels, 1};
+    return Span(p, Mapping(typename Span::extents_type(Height(), Width()),
+                           strides));
+  }
+#endif
+  size_t Index(int x, int y) const {
+    return (size_t)y * stride + (size_t)x * PixelFormat::channels;
+  }
+  void Assign(const Bitmap &bmp);
+
+private:
+  uint32_t stride{};
+};
+
+// An image of palette indices at 1, 4 or 8 bits per pixel with at most 2,
+// 16 or 256 colors, a fraction of the memory and file size of a 24-bit
+// image. The pixels are kept packed as in the file, rows bottom-up and
+// Stride() bytes apart.
+class IndexedBitmap {
+public: // change to protected later
+  FileHeader file_header{};
+  Infoheader info_header{};
+  PixelBuffer vec_pixels{};
+  std::string filename{};
+
+public:
+  IndexedBitmap() {}
+  IndexedBitmap(const char *fn) {
+    filename = fn ? fn : "";
+    Read(fn);
+  }
+  // A w x h image of index 0. Bits is 1, 4 or 8 and the palette has at most
+  // 2^bits colors, indices past its end are black.
+  IndexedBitmap(const char *fn, const uint32_t &w, const uint32_t &h,
+                uint16_t bits, std::vector<Color> palette = {},
+                BitmapPool *pool = nullptr);
+  // Reduces bmp to 2^bits colors. Images with that few colors keep them
+  // exactly, others get a palette from k-means clustering of a histogram of
+  // their colors at 5 bits per channel, sampled from at most about a million
+  // pixels. Alpha is dropped.
+  IndexedBitmap(const Bitmap &bmp, uint16_t bits,
+                DITHER dither = DITHER::NONE);
+
+public:
+  // Reads uncompressed 1, 4 and 8-bit files and RLE8 and RLE4 files
+  bool Read(const char *fn);
+  // RLE8 needs 8 and RLE4 4 bits per pixel
+  bool Write(const char *fn,
+             COMPRESSION compression = COMPRESSION::RGB) const;
+  bool Save() const { return Write(filename.c_str()); }
+  // The image in 24 or 32 bits per pixel
+  Bitmap ToBitmap(BIT_DEPTH bd = BIT_DEPTH::BD_24,
+                  BitmapPool *pool = nullptr) const;
+
+public:
+  // Setters, indices are taken modulo 2^bits
+  void SetIndex(int x, int y, uint8_t index);
+  void SetPalette(std::vector<Color> palette);
+  void SetFileName(const char *fn) { filename = fn ? fn : ""; }
+  // Sets row y from Width() indices, one byte each
+  void SetRow(uint32_t y, const uint8_t *indices);
+
+public:
+  // Getters, GetIndex is 0 outside of the image
+  uint8_t GetIndex(int x, int y) const;
+  Color GetPixelColor(const int &x, const int &y) const;
+  const std::vector<Color> &GetPalette() const { return palette; }
+  // Unpacks row y into Width() indices, one byte each
+  void GetRow(uint32_t y, uint8_t *indices) const;
+  uint32_t Width() const { return info_header.width; }
+  uint32_t Height() const { return info_header.height; }
+  uint16_t BitsPerPixel() const { return info_header.bits_per_pixel; }
+  uint32_t GetFileSize() const { return file_header.file_size; }
+  const std::string &GetFileName() const { return filename; }
+
+public:
+  // Raw access to the packed rows, see Bitmap
+  uint8_t *Data() { return vec_pixels.data(); }
+  const uint8_t *Data() const { return vec_pixels.data(); }
+  uint8_t *Row(const uint32_t &y) { return Data() + (size_t)y * Stride(); }
+  const uint8_t *Row(const uint32_t &y) const {
+    return Data() + (size_t)y * Stride();
+  }
+  uint32_t Stride() const {
+    return UTILS::row_stride(Width(), BitsPerPixel());
+  }
+
+private:
+  friend class Bitmap;
+
+  std::vector<Color> palette{};
+
+  // Sets up a w x h image of index 0
+  void Create(uint32_t w, uint32_t h, uint16_t bits, BitmapPool *pool);
+  // Fits the headers of an uncompressed file to the size and palette
+  void UpdateHeaders();
+  // Writes the file without reporting, false on failure
+  bool WriteFile(const char *fn, COMPRESSION compression) const;
+  // Nearest of a set of colors by squared distance. The colors are sorted by
+  // red, so a search starts at the red of the query and stops where the red
+  // difference alone exceeds the best distance found.
+  class ColorSearch {
+  public:
+    explicit ColorSearch(const std::vector<std::array<float, 3>> &colors);
+    uint32_t Nearest(const float *color) const;
+
+  private:
+    std::vector<std::array<float, 3>> sorted;
+    std::vector<uint32_t> order;
+  };
+
+  // Up to max_colors colors of bmp by k-means clustering
+  static std::vector<Color> Quantize(const Bitmap &bmp, size_t max_colors);
+  // Bin of a color in the histogram of Quantize, 5 bits per channel
+  static uint32_t Bin(int red, int green, int blue) {
+    return (uint32_t)(red >> 3) << 10 | (uint32_t)(green >> 3) << 5 |
+           (uint32_t)(blue >> 3);
+  }
+};
+
+enum class ROW_ORDER { BOTTOM_UP, TOP_DOWN };
+
+// Writes a bitmap file one row, or one band of rows, at a time so an image
+// never has to be held in memory as a whole. The headers are written when the
+// file is opened. Rows are passed unpadded (Width() * channels bytes) in the
+// pixel layout of the file, BGR or BGRA. With ROW_ORDER::BOTTOM_UP the first
+// row passed is y = 0 (the first row in the file, like Bitmap::vec_pixels),
+// with ROW_ORDER::TOP_DOWN it is y = Height() - 1.
+class BitmapWriter {
+public:
+  BitmapWriter(){};
+  BitmapWriter(const char *fn, const uint32_t &w, const uint32_t &h,
+               bool alpha = true, ROW_ORDER order = ROW_ORDER::BOTTOM_UP) {
+    Open(fn, w, h, alpha, order);
+  }
+  ~BitmapWriter() { Close(); }
+
+  BitmapWriter(const BitmapWriter &) = delete;
+  BitmapWriter &operator=(const BitmapWriter &) = delete;
+
+public:
+  bool Open(const char *fn, const uint32_t &w, const uint32_t &h,
+            bool alpha = true, ROW_ORDER order = ROW_ORDER::BOTTOM_UP);
+  // Writes the next row
+  bool WriteRow(const uint8_t *row) { return WriteRows(row, 1, 0); }
+  // Writes the next n rows, band_stride bytes apart in the band
+  bool WriteRows(const uint8_t *band, const uint32_t &n,
+                 const uint32_t &band_stride);
+  // Returns false if any write failed or not all rows were written
+  bool Close();
+  bool IsOpen() const { return outfile.is_open(); }
+
+public:
+  // Getters
+  uint32_t Width() const { return info_header.width; }
+  uint32_t Height() const { return info_header.height; }
+  uint32_t RowsWritten() const { return rows_written; }
+  BIT_DEPTH GetBitDepth() const { return bit_depth; }
+
+private:
+  std::ofstream outfile{};
+  FileHeader file_header{};
+  Infoheader info_header{};
+  BIT_DEPTH bit_depth{};
+  ROW_ORDER row_order{};
+  uint32_t stride{};
+  uint32_t rows_written{};
+  bool failed{};
+};
+
+// Reads a bitmap file on demand instead of loading it into memory. The
+// headers are parsed once when opening, after which single rows or
+// rectangular tiles are read from the file as needed. Rows are read through a
+// read-ahead buffer of (at least one row and) at most read_ahead bytes, so
+// memory use is bounded regardless of the image size. Rows are numbered
+// bottom-up like in Bitmap::vec_pixels and returned without padding.
+class BitmapReader {
+public:
+  FileHeader file_header{};
+  Infoheader info_header{};
+  BIT_DEPTH bit_depth{};
+
+public:
+  BitmapReader(){};
+  BitmapReader(const char *fn, size_t read_ahead = 1 << 20) {
+    Open(fn, read_ahead);
+  }
+  ~BitmapReader() { Close(); }
+
+  BitmapReader(const BitmapReader &) = delete;
+  BitmapReader &operator=(const BitmapReader &) = delete;
+
+public:
+  bool Open(const char *fn, size_t read_ahead = 1 << 20);
+  void Close();
+  bool IsOpen() const;
+  // Resizes the read-ahead buffer, dropping its contents
+  void SetReadAhead(size_t read_ahead);
+
+public:
+  // Pointer to row y inside the read-ahead buffer, valid until the next read.
+  // Returns nullptr if y is out of bounds or the read failed.
+  const uint8_t *Row(const uint32_t &y);
+  // Copies row y (Width() * channels bytes) into dst
+  bool ReadRow(const uint32_t &y, uint8_t *dst);
+  // Copies the w x h tile with its lower left corner at (x, y) into dst, with
+  // the tile rows dst_stride bytes apart
+  bool ReadTile(const uint32_t &x, const uint32_t &y, const uint32_t &w,
+                const uint32_t &h, uint8_t *dst, const uint32_t &dst_stride);
+
+public:
+  // Getters
+  uint32_t Width() const { return info_header.width; }
+  uint32_t Height() const { return info_header.height; }
+  uint32_t Stride() const { return stride; }
+  uint32_t Channels() const { return info_header.bits_per_pixel / 8; }
+  BIT_DEPTH GetBitDepth() const { return bit_depth; }
+
+private:
+  bool ReadAt(uint64_t offset, uint8_t *dst, size_t n);
+  bool FillBuffer(const uint32_t &y);
+
+private:
+  std::vector<uint8_t> buffer{};
+  uint32_t buffer_first{};
+  uint32_t buffer_rows{};
+  uint32_t buffer_capacity{};
+  size_t read_ahead_size{};
+  uint32_t stride{};
+#if defined(_WIN32)
+  HANDLE file_handle{INVALID_HANDLE_VALUE};
+#else
+  int fd{-1};
+#endif
+};
+
+// Read-only view of a bitmap file that is memory mapped instead of read.
+// Opening only parses the headers, so it takes the same time regardless of
+// the image size, and the pixel rows are served directly from the mapping.
+// Rows are stored bottom-up like in Bitmap::vec_pixels, i.e. Row(0) is the
+// first row in the file.
+class BitmapView {
+public:
+  FileHeader file_header{};
+  Infoheader info_header{};
+  BIT_DEPTH bit_depth{};
+
+public:
+  BitmapView(){};
+  BitmapView(const char *fn) { Open(fn); }
+  ~BitmapView() { Close(); }
+
+  BitmapView(const BitmapView &) = delete;
+  BitmapView &operator=(const BitmapView &) = delete;
+  BitmapView(BitmapView &&other) noexcept { *this = std::move(other); }
+  BitmapView &operator=(BitmapView &&other) noexcept;
+
+public:
+  bool Open(const char *fn) { return Map(fn, false); }
+  void Close();
+  bool IsOpen() const { return mapping != nullptr; }
+
+public:
+  // Getters
+  Color GetPixelColor(const int &x, const int &y) const;
+  const uint8_t *Data() const { return pixels; }
+  const uint8_t *Row(const uint32_t &y) const {
+    return pixels + (size_t)y * stride;
+  }
+  uint32_t Stride() const { return stride; }
+  uint32_t Width() const { return info_header.width; }
+  uint32_t Height() const { return info_header.height; }
+  uint32_t GetFileSize() const { return file_header.file_size; }
+  BIT_DEPTH GetBitDepth() const { return bit_depth; }
+
+protected:
+  bool Map(const char *fn, bool writable);
+
+protected:
+  uint8_t *mapping{};
+  size_t mapping_size{};
+  uint8_t *pixels{};
+  uint32_t stride{};
+#if defined(_WIN32)
+  HANDLE file_handle{INVALID_HANDLE_VALUE};
+  HANDLE map_handle{};
+#endif
+};
+
+// Writable variant of BitmapView. Pixels are modified in place in the file,
+// the headers (and thereby the dimensions) are fixed.
+class MutableBitmapView : public BitmapView {
+public:
+  MutableBitmapView(){};
+  MutableBitmapView(const char *fn) { Open(fn); }
+
+public:
+  bool Open(const char *fn) { return Map(fn, true); }
+  // Writes modified pages back to the file
+  bool Flush();
+
+public:
+  using BitmapView::Data;
+  using BitmapView::Row;
+  void SetPixel(int x, int y, const Color &color);
+  uint8_t *Data() { return pixels; }
+  uint8_t *Row(const uint32_t &y) { return pixels + (size_t)y * stride; }
+};
+
+// Records draw commands to render them into a Bitmap later. Rendering splits
+// the image into square tiles, bins every command into the tiles its bounding
+// box touches and renders the tiles in parallel, each clipped to its tile.
+// Every pixel belongs to one tile and a tile runs its commands in recording
+// order, so the result is the same as calling the Bitmap draw routines in
+// that order, regardless of the number of threads.
+class DisplayList {
+public:
+  DisplayList(){};
+  DisplayList(const uint32_t &tile_size) : tile_size(tile_size) {}
+
+public:
+  // Recording, the arguments are the same as for the Bitmap draw routines
+  void DrawLine(int sx, int sy, int ex, int ey, const Color &color);
+  void DrawRect(const int &x, const int &y, const int &w, const int &h,
+                const Color &color);
+  void FillRect(const int &x, const int &y, const int &w, const int &h,
+                const Color &color);
+  void DrawCircle(const int &xc, const int &yc, const int &r,
+                  const Color &color);
+  void FillCircle(const int &xc, const int &yc, const int &r,
+                  const Color &color);
+  void DrawTriangle(const int &x1, const int &y1, const int &x2, const int &y2,
+                    const int &x3, const int &y3, const Color &color);
+  void FillTriangle(const int &x1, const int &y1, const int &x2, const int &y2,
+                    const int &x3, const int &y3, const Color &color);
+  void Clear() { commands.clear(); }
+  size_t Size() const { return commands.size(); }
+
+public:
+  // Renders the recorded commands into image, the tiles run in parallel on
+  // pool. The commands are kept, so the list can be rendered again.
+  void Render(Bitmap &image, ThreadPool &pool = ThreadPool::Global()) const;
+
+private:
+  enum class COMMAND {
+    LINE,
+    RECT,
+    FILL_RECT,
+    CIRCLE,
+    FILL_CIRCLE,
+    TRIANGLE,
+    FILL_TRIANGLE
+  };
+  struct Command {
+    COMMAND type;
+    int args[6];
+    Color color;
+  };
+
+  // Inclusive bounding box of the pixels a command may draw, false if it
+  // draws none
+  static bool BoundingBox(const Command &command, int64_t box[4]);
+  static void Execute(Bitmap &image, const Command &command, const Rect &clip);
+
+private:
+  std::vector<Command> commands;
+  uint32_t tile_size{128};
+};
+
+// Whether successful saves are reported on std::cout, false by default so
+// batches of saves stay quiet. Errors are reported either way.
+void SetVerbose(bool verbose);
+bool Verbose();
+
+// Asynchronous and batched file I/O. Every file is read (or written),
+// parsed and converted by one task of an I/O thread pool, so with many files
+// in flight the disk latency of some overlaps with the processing of others.
+
+// Outcome of loading one file
+struct LoadResult {
+  std::string filename;
+  Bitmap bitmap;
+  bool ok{};
+};
+
+// Pool the asynchronous I/O runs on by default. It has more threads than
+// cores, as they spend most of their time blocked on the disk, and keeps
+// them apart from the compute kernels on ThreadPool::Global().
+ThreadPool &IoPool();
+
+// Loads the file fn, with its name set as the bitmap's file name
+LoadResult Load(const std::string &fn);
+// Load and Bitmap::Write as tasks on pool. The bitmap is taken by value,
+// which shares its pixels until they are written (see PixelBuffer), so the
+// caller may go on drawing into its own copy while it is saved.
+std::future<LoadResult> LoadAsync(std::string fn,
+                                  ThreadPool &pool = IoPool());
+std::future<bool> SaveAsync(Bitmap bmp, std::string fn,
+                            ThreadPool &pool = IoPool());
+// Loads all files concurrently and calls on_loaded(index, result) on the
+// I/O thread as soon as each is loaded, e.g. to convert or resize it while
+// the remaining files load. Returns when all files are done.
+void LoadBatch(std::span<const std::string> files,
+               const std::function<void(size_t, LoadResult &)> &on_loaded,
+               ThreadPool &pool = IoPool());
+std::vector<LoadResult> LoadBatch(std::span<const std::string> files,
+                                  ThreadPool &pool = IoPool());
+// Saves bitmaps[i] as files[i] concurrently and returns the number of files
+// saved
+size_t SaveBatch(std::span<const Bitmap> bitmaps,
+                 std::span<const std::string> files,
+                 ThreadPool &pool = IoPool());
+
+uint32_t UTILS::bytes_to_uint32(const uint8_t *data) {
+  uint32_t result = 0;
+  for (int i = 0; i < 4; i++)
+    result += data[i] * (1 << (8 * i));
+  return result;
+}
+
+uint16_t UTILS::bytes_to_uint16(const uint8_t *data) {
+  uint16_t result = 0;
+  for (int i = 0; i < 2; i++)
+    result += data[i] * (1 << (8 * i));
+  return result;
+}
+
+uint8_t *UTILS::uint32_to_bytes(uint32_t data) {
+  uint8_t *result = new uint8_t[4];
+  result[0] = (data & 0x000000FF) >> 0;
+  result[1] = (data & 0x0000FF00) >> 8;
+  result[2] = (data & 0x00FF0000) >> 16;
+  result[3] = (data & 0xFF000000) >> 24;
+  return result;
+}
+
+uint8_t *UTILS::uint16_to_bytes(uint16_t data) {
+  uint8_t *result = new uint8_t[2];
+  result[0] = (data & 0x00FF) >> 0;
+  result[1] = (data & 0xFF00) >> 8;
+  return result;
+}
+
+void UTILS::uint32_to_bytes(uint32_t data, uint8_t *dst) {
+  dst[0] = (data & 0x000000FF) >> 0;
+  dst[1] = (data & 0x0000FF00) >> 8;
+  dst[2] = (data & 0x00FF0000) >> 16;
+  dst[3] = (data & 0xFF000000) >> 24;
+}
+
+void UTILS::uint16_to_bytes(uint16_t data, uint8_t *dst) {
+  dst[0] = (data & 0x00FF) >> 0;
+  dst[1] = (data & 0xFF00) >> 8;
+}
+
+void UTILS::read_headers(const uint8_t *data, FileHeader &file_header,
+                         Infoheader &info_header) {
+  // Load into file header struct
+  file_header.signature = bytes_to_uint16(&data[0x0000]);
+  file_header.file_size = bytes_to_uint32(&data[0x0002]);
+  file_header.reserved1 = bytes_to_uint16(&data[0x0006]);
+  file_header.reserved2 = bytes_to_uint16(&data[0x0008]);
+  file_header.offset_data = bytes_to_uint32(&data[0x000A]);
+
+  // Load into info header struct
+  info_header.header_size = bytes_to_uint32(&data[0x000E]);
+  info_header.width = bytes_to_uint32(&data[0x0012]);
+  info_header.height = bytes_to_uint32(&data[0x0016]);
+  info_header.planes = bytes_to_uint16(&data[0x001A]);
+  info_header.bits_per_pixel = bytes_to_uint16(&data[0x001C]);
+  info_header.compression = bytes_to_uint32(&data[0x001E]);
+  info_header.image_size = bytes_to_uint32(&data[0x0022]);
+  info_header.x_res = bytes_to_uint32(&data[0x0026]);
+  info_header.y_res = bytes_to_uint32(&data[0x002A]);
+  info_header.colors_used = bytes_to_uint32(&data[0x002E]);
+  info_header.colors_important = bytes_to_uint32(&data[0x0032]);
+}
+
+void UTILS::write_headers(uint8_t *data, const FileHeader &file_header,
+                          const Infoheader &info_header) {
+  // Write file header data
+  uint16_to_bytes(file_header.signature, &data[0x0000]);
+  uint32_to_bytes(file_header.file_size, &data[0x0002]);
+  uint16_to_bytes(file_header.reserved1, &data[0x0006]);
+  uint16_to_bytes(file_header.reserved2, &data[0x0008]);
+  uint32_to_bytes(file_header.offset_data, &data[0x000A]);
+
+  // Write header info data
+  uint32_to_bytes(info_header.header_size, &data[0x000E]);
+  uint32_to_bytes(info_header.width, &data[0x0012]);
+  uint32_to_bytes(info_header.height, &data[0x0016]);
+  uint16_to_bytes(info_header.planes, &data[0x001A]);
+  uint16_to_bytes(info_header.bits_per_pixel, &data[0x001C]);
+  uint32_to_bytes(info_header.compression, &data[0x001E]);
+  uint32_to_bytes(info_header.image_size, &data[0x0022]);
+  uint32_to_bytes(info_header.x_res, &data[0x0026]);
+  uint32_to_bytes(info_header.y_res, &data[0x002A]);
+  uint32_to_bytes(info_header.colors_used, &data[0x002E]);
+  uint32_to_bytes(info_header.colors_important, &data[0x0032]);
+}
+
+bool UTILS::write_file(const char *fn, const uint8_t *header,
+                       size_t header_size, const uint8_t *data,
+                       size_t data_size) {
+#if defined(_WIN32)
+  std::ofstream outfile(fn, std::ios::binary);
+  if (!outfile.is_open())
+    return false;
+  outfile.write((const char *)header, header_size);
+  outfile.write((const char *)data, data_size);
+  return outfile.good();
+#else
+  int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  iovec iov[2] = {{(void *)header, header_size}, {(void *)data, data_size}};
+  iovec *next = iov;
+  int count = 2;
+  bool ok = true;
+  while (count > 0) {
+    ssize_t written = writev(fd, next, count);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0) {
+      ok = false;
+      break;
+    }
+    // Skip past what was written, partial writes resume mid-buffer
+    size_t n = (size_t)written;
+    while (count > 0 && n >= next->iov_len) {
+      n -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (uint8_t *)next->iov_base + n;
+      next->iov_len -= n;
+    }
+  }
+  if (close(fd) != 0)
+    ok = false;
+  return ok;
+#endif
+}
+
+bool UTILS::write_bitmap(const char *fn, const FileHeader &file_header,
+                         const Infoheader &info_header, const uint8_t *pixels,
+                         size_t size) {
+  FileHeader fh = file_header;
+  Infoheader ih = info_header;
+  fh.offset_data = 54;
+  fh.file_size = fh.offset_data + (uint32_t)size;
+  ih.header_size = 40;
+  ih.compression = 0;
+
+  uint8_t header[54];
+  write_headers(header, fh, ih);
+
+  // Header and pixels are handed to the OS together, without staging a copy
+  if (!write_file(fn, header, sizeof(header), pixels, size))
+    return false;
+  BMP_COUNT(bytes_written, sizeof(header) + size);
+  return true;
+}
+
+uint32_t UTILS::row_stride(uint32_t width, uint16_t bits_per_pixel) {
+  return (uint32_t)((((uint64_t)width * bits_per_pixel + 31) / 32) * 4);
+}
+
+int64_t UTILS::circle_d(int64_t r, int64_t x, int64_t y) {
+  return 2 * x * x + 8 * x + 2 * y * y - 6 * y + 3 + 4 * r - 2 * r * r;
+}
+
+int64_t UTILS::circle_y(int64_t r, int64_t x) {
+  if (x == 0)
+    return r;
+  // Largest y <= r with circle_d(r, x - 1, y) <= 0, i.e. the upper root of a
+  // quadratic in y. The floating point estimate is corrected exactly.
+  double disc = 36.0 - 8.0 * (double)circle_d(r, x - 1, 0);
+  if (disc < 0)
+    return -1;
+  int64_t y = std::min(r, (int64_t)((6.0 + std::sqrt(disc)) / 4.0));
+  while (y >= 0 && circle_d(r, x - 1, y) > 0)
+    y--;
+  while (y < r && circle_d(r, x - 1, y + 1) <= 0)
+    y++;
+  return y;
+}
+
+uint8_t UTILS::div255(uint32_t x) {
+  x += 128;
+  return (uint8_t)((x + (x >> 8)) >> 8);
+}
+
+void BlendPixels(uint8_t *dst, const uint8_t *src, size_t n,
+                 BLEND_MODE mode) {
+  switch (mode) {
+  case BLEND_MODE::REPLACE:
+    return BlendPixels<BLEND_MODE::REPLACE>(dst, src, n);
+  case BLEND_MODE::SOURCE_OVER:
+    return BlendPixels<BLEND_MODE::SOURCE_OVER>(dst, src, n);
+  case BLEND_MODE::ADD:
+    return BlendPixels<BLEND_MODE::ADD>(dst, src, n);
+  case BLEND_MODE::MULTIPLY:
+    return BlendPixels<BLEND_MODE::MULTIPLY>(dst, src, n);
+  case BLEND_MODE::SCREEN:
+    return BlendPixels<BLEND_MODE::SCREEN>(dst, src, n);
+  }
+}
+
+Color Blend(const Color &src, const Color &dst, BLEND_MODE mode) {
+  uint8_t s[4], d[4];
+  BGRA32::Store(s, src);
+  BGRA32::Store(d, dst);
+  BlendPixels(d, s, 1, mode);
+  return BGRA32::Load(d);
+}
+
+size_t CommonPrefix(const uint8_t *a, const uint8_t *b, size_t n) {
+  size_t i = 0;
+#if defined(BMP_AVX2)
+  for (; i + 32 <= n; i += 32) {
+    uint32_t equal = (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                          _mm256_loadu_si256((const __m256i *)(b + i))));
+    if (equal != 0xFFFFFFFF)
+      return i + std::countr_one(equal);
+  }
+#endif
+#if defined(BMP_SSE2)
+  for (; i + 16 <= n; i += 16) {
+    uint32_t equal = (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                       _mm_loadu_si128((const __m128i *)(b + i))));
+    if (equal != 0xFFFF)
+      return i + std::countr_one(equal);
+  }
+#endif
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+void EncodeRLERow(const uint8_t *indices, uint32_t w, uint16_t bits,
+                  std::vector<uint8_t> &out) {
+  // Length of the run of equal indices at x, at most 255
+  auto run = [&](size_t x) {
+    const size_t n = std::min<size_t>(w - x, 255);
+    return 1 + CommonPrefix(indices + x, indices + x + 1, n - 1);
+  };
+  // The byte of a run, RLE4 repeats both of its nibbles
+  auto value = [bits](uint8_t i) {
+    return bits == 4 ? (uint8_t)(i << 4 | i) : i;
+  };
+  size_t x = 0;
+  while (x < w) {
+    size_t n = run(x);
+    if (n >= 2) {
+      out.push_back((uint8_t)n);
+      out.push_back(value(indices[x]));
+      x += n;
+      continue;
+    }
+    // Absolute stretch up to the next run of three or more
+    size_t end = x + 1;
+    while (end < w && end - x < 255 && run(end) < 3)
+      end++;
+    n = end - x;
+    if (n < 3) {
+      // Absolute mode needs at least three pixels
+      for (; x < end; x++) {
+        out.push_back(1);
+        out.push_back(value(indices[x]));
+      }
+      continue;
+    }
+    out.push_back(0);
+    out.push_back((uint8_t)n);
+    const size_t start = out.size();
+    if (bits == 8)
+      out.insert(out.end(), indices + x, indices + end);
+    else
+      for (size_t i = x; i < end; i += 2)
+        out.push_back(
+            (uint8_t)(indices[i] << 4 | (i + 1 < end ? indices[i + 1] : 0)));
+    // Stretches are padded to 16 bits
+    if ((out.size() - start) % 2)
+      out.push_back(0);
+    x = end;
+  }
+}
+
+void DecodeRLE(const uint8_t *data, size_t size, uint16_t bits, uint32_t w,
+               uint32_t h, uint8_t *indices, size_t stride) {
+  if (stride == 0)
+    stride = w;
+  uint64_t x = 0, y = 0;
+  size_t p = 0;
+  while (p + 1 < size && y < h) {
+    const uint8_t n = data[p], v = data[p + 1];
+    p += 2;
+    uint8_t *row = indices + y * stride;
+    if (n > 0) {
+      // Run of n pixels, RLE4 alternates between the two nibbles of v
+      const uint64_t end = std::min<uint64_t>(x + n, w);
+      if (bits == 8 || v >> 4 == (v & 15)) {
+        if (x < end)
+          memset(row + x, bits == 8 ? v : v & 15, end - x);
+      } else {
+        for (uint64_t i = x; i < end; i++)
+          row[i] = (i - x) % 2 ? v & 15 : v >> 4;
+      }
+      x += n;
+    } else if (v == 0) { // End of line
+      x = 0;
+      y++;
+    } else if (v == 1) { // End of bitmap
+      break;
+    } else if (v == 2) { // Delta, moves right and up
+      if (p + 1 >= size)
+        break;
+      x += data[p];
+      y += data[p + 1];
+      p += 2;
+    } else { // Absolute stretch of v pixels, padded to 16 bits
+      const size_t bytes = bits == 8 ? v : (v + 1) / 2;
+      if (p + bytes > size)
+        break;
+      for (size_t i = 0; i < v && x + i < w; i++)
+        row[x + i] = bits == 8 ? data[p + i]
+                     : i % 2 ? data[p + i / 2] & 15
+                             : data[p + i / 2] >> 4;
+      x += v;
+      p += (bytes + 1) & ~(size_t)1;
+    }
+  }
+}
+
+void UnpackIndices(const uint8_t *row, uint16_t bits, uint32_t w,
+                   uint8_t *indices) {
+  size_t x = 0;
+  switch (bits) {
+  case 8:
+    memcpy(indices, row, w);
+    break;
+  case 4:
+#if defined(BMP_SSE2)
+    for (; x + 32 <= w; x += 32) {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(row + x / 2));
+      const __m128i mask = _mm_set1_epi8(15);
+      const __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+      const __m128i low = _mm_and_si128(v, mask);
+      _mm_storeu_si128((__m128i *)(indices + x),
+                       _mm_unpacklo_epi8(high, low));
+      _mm_storeu_si128((__m128i *)(indices + x + 16),
+                       _mm_unpackhi_epi8(high, low));
+    }
+#endif
+    for (; x < w; x++)
+      indices[x] = x % 2 ? row[x / 2] & 15 : row[x / 2] >> 4;
+    break;
+  case 1:
+    for (; x < w; x++)
+      indices[x] = (row[x / 8] >> (7 - x % 8)) & 1;
+    break;
+  }
+}
+
+void PackIndices(const uint8_t *indices, uint16_t bits, uint32_t w,
+                 uint8_t *row) {
+  switch (bits) {
+  case 8:
+    memcpy(row, indices, w);
+    break;
+  case 4:
+    for (size_t x = 0; x < w; x += 2)
+      row[x / 2] = (uint8_t)((indices[x] & 15) << 4 |
+                             (x + 1 < w ? indices[x + 1] & 15 : 0));
+    break;
+  case 1:
+    for (size_t x = 0; x < w; x += 8) {
+      uint8_t byte = 0;
+      for (size_t i = 0; i < 8 && x + i < w; i++)
+        byte |= (uint8_t)((indices[x + i] & 1) << (7 - i));
+      row[x / 8] = byte;
+    }
+    break;
+  }
+}
+
+// Position of a channel mask: its lowest bit, the number of bits up to its
+// highest and the largest value
+struct BitField {
+  int shift{};
+  int width{};
+  uint32_t max{};
+
+  BitField(uint32_t mask) {
+    if (mask) {
+      shift = std::countr_zero(mask);
+      width = std::bit_width(mask >> shift);
+      max = mask >> shift;
+    }
+  }
+  // A channel without bits is 0
+  uint8_t Widen(uint32_t pixel) const {
+    if (width == 0)
+      return 0;
+    uint32_t x = (pixel >> shift) & max;
+    if (width > 8)
+      return (uint8_t)(x >> (width - 8));
+    x <<= 8 - width;
+    for (int k = width; k < 8; k *= 2)
+      x |= x >> k;
+    return (uint8_t)x;
+  }
+  uint32_t Narrow(uint8_t value) const {
+    if (width <= 8)
+      return (uint32_t)UTILS::div255(value * max) << shift;
+    return (uint32_t)(((uint64_t)value * max + 127) / 255) << shift;
+  }
+#if defined(BMP_SSE2)
+  // Widen on 8 lanes of 16 or 4 lanes of 32 bits
+  template <int lane> __m128i Widen(__m128i v) const {
+    if (width == 0)
+      return _mm_setzero_si128();
+    auto srl = [](__m128i a, int n) {
+      return lane == 16 ? _mm_srl_epi16(a, _mm_cvtsi32_si128(n))
+                        : _mm_srl_epi32(a, _mm_cvtsi32_si128(n));
+    };
+    const __m128i mask = lane == 16 ? _mm_set1_epi16((short)max)
+                                    : _mm_set1_epi32((int)max);
+    __m128i x = _mm_and_si128(srl(v, shift), mask);
+    if (width > 8)
+      return srl(x, width - 8);
+    x = lane == 16 ? _mm_sll_epi16(x, _mm_cvtsi32_si128(8 - width))
+                   : _mm_sll_epi32(x, _mm_cvtsi32_si128(8 - width));
+    for (int k = width; k < 8; k *= 2)
+      x = _mm_or_si128(x, srl(x, k));
+    return x;
+  }
+#endif
+};
+
+void UnpackBitfields(const uint8_t *src, uint16_t bits, const BitMasks &masks,
+                     uint8_t *dst, size_t n) {
+  // Bits past the pixel do not belong to any channel
+  const uint32_t used = bits == 16 ? 0xFFFF : 0xFFFFFFFF;
+  const BitField blue(masks.blue & used), green(masks.green & used),
+      red(masks.red & used), alpha(masks.alpha & used);
+  const bool opaque = alpha.width == 0;
+  size_t i = 0;
+#if defined(BMP_SSE2)
+  if (bits == 16) {
+    for (; i + 8 <= n; i += 8) {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+      const __m128i a = opaque ? _mm_set1_epi16(255) : alpha.Widen<16>(v);
+      // Blue and green, red and alpha are paired in 16 bits, then the pairs
+      // are interleaved into pixels
+      const __m128i bg = _mm_or_si128(blue.Widen<16>(v),
+                                      _mm_slli_epi16(green.Widen<16>(v), 8));
+      const __m128i ra = _mm_or_si128(red.Widen<16>(v), _mm_slli_epi16(a, 8));
+      _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_unpacklo_epi16(bg, ra));
+      _mm_storeu_si128((__m128i *)(dst + 4 * i + 16),
+                       _mm_unpackhi_epi16(bg, ra));
+    }
+  } else {
+    for (; i + 4 <= n; i += 4) {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+      const __m128i a = opaque ? _mm_set1_epi32(255) : alpha.Widen<32>(v);
+      __m128i p = _mm_or_si128(blue.Widen<32>(v),
+                               _mm_slli_epi32(green.Widen<32>(v), 8));
+      p = _mm_or_si128(p, _mm_slli_epi32(red.Widen<32>(v), 16));
+      p = _mm_or_si128(p, _mm_slli_epi32(a, 24));
+      _mm_storeu_si128((__m128i *)(dst + 4 * i), p);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    const uint32_t v = bits == 16 ? UTILS::bytes_to_uint16(src + 2 * i)
+                                  : UTILS::bytes_to_uint32(src + 4 * i);
+    dst[4 * i] = blue.Widen(v);
+    dst[4 * i + 1] = green.Widen(v);
+    dst[4 * i + 2] = red.Widen(v);
+    dst[4 * i + 3] = opaque ? 255 : alpha.Widen(v);
+  }
+}
+
+void PackBitfields(const uint8_t *src, uint16_t bits, const BitMasks &masks,
+                   uint8_t *dst, size_t n) {
+  const BitField blue(masks.blue), green(masks.green), red(masks.red),
+      alpha(masks.alpha);
+  size_t i = 0;
+#if defined(BMP_SSE2)
+  if (bits == 16 &&
+      std::max({blue.width, green.width, red.width, alpha.width}) <= 8) {
+    // 8 pixels per step, every channel narrowed on 16-bit lanes as
+    // div255(value * max) and moved to its bits
+    auto narrow = [](__m128i p0, __m128i p1, int offset, const BitField &f) {
+      const __m128i byte = _mm_set1_epi32(255);
+      const __m128i count = _mm_cvtsi32_si128(offset);
+      __m128i v = _mm_packs_epi32(
+          _mm_and_si128(_mm_srl_epi32(p0, count), byte),
+          _mm_and_si128(_mm_srl_epi32(p1, count), byte));
+      v = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16((short)f.max)),
+                        _mm_set1_epi16(128));
+      v = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+      return _mm_sll_epi16(v, _mm_cvtsi32_si128(f.shift));
+    };
+    for (; i + 8 <= n; i += 8) {
+      const __m128i p0 = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+      const __m128i p1 = _mm_loadu_si128((const __m128i *)(src + 4 * i + 16));
+      const __m128i v =
+          _mm_or_si128(_mm_or_si128(narrow(p0, p1, 0, blue),
+                                    narrow(p0, p1, 8, green)),
+                       _mm_or_si128(narrow(p0, p1, 16, red),
+                                    narrow(p0, p1, 24, alpha)));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i), v);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    const uint8_t *p = src + 4 * i;
+    const uint32_t v = blue.Narrow(p[0]) | green.Narrow(p[1]) |
+                       red.Narrow(p[2]) | alpha.Narrow(p[3]);
+    if (bits == 16)
+      UTILS::uint16_to_bytes((uint16_t)v, dst + 2 * i);
+    else
+      UTILS::uint32_to_bytes(v, dst + 4 * i);
+  }
+}
+
+void DivideSums(const uint32_t *sum, uint8_t *dst, size_t n, uint32_t d) {
+  size_t i = 0;
+  if (d > 4095) {
+    for (; i < n; i++)
+      dst[i] = (uint8_t)((2 * (uint64_t)sum[i] + d) / (2 * (uint64_t)d));
+    return;
+  }
+  const float recip = 1.0f / (float)d;
+#if defined(BMP_AVX2)
+  const __m256 recip8 = _mm256_set1_ps(recip);
+  for (; i + 16 <= n; i += 16) {
+    __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(
+        _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(sum + i))),
+        recip8));
+    __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(
+        _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(sum + i + 8))),
+        recip8));
+    // The packs work within lanes, the permute puts a before b again
+    __m256i p16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(_mm256_castsi256_si128(p16),
+                                      _mm256_extracti128_si256(p16, 1)));
+  }
+#endif
+#if defined(BMP_SSE2)
+  const __m128 recip4 = _mm_set1_ps(recip);
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_cvtps_epi32(_mm_mul_ps(
+        _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(sum + i))), recip4));
+    __m128i b = _mm_cvtps_epi32(_mm_mul_ps(
+        _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(sum + i + 4))),
+        recip4));
+    __m128i p16 = _mm_packs_epi32(a, b);
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(p16, p16));
+  }
+#endif
+  for (; i < n; i++)
+    dst[i] = (uint8_t)std::lrint((float)sum[i] * recip);
+}
+
+void SlideSums(uint32_t *sum, const uint8_t *add, const uint8_t *sub,
+               size_t n) {
+  size_t i = 0;
+#if defined(BMP_AVX2)
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(add + i)));
+    __m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(sub + i)));
+    __m256i v = _mm256_loadu_si256((const __m256i *)(sum + i));
+    _mm256_storeu_si256((__m256i *)(sum + i),
+                        _mm256_add_epi32(v, _mm256_sub_epi32(a, b)));
+  }
+#endif
+#if defined(BMP_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    // add - sub as 16-bit, then sign extended to 32-bit
+    __m128i diff = _mm_sub_epi16(
+        _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(add + i)), zero),
+        _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(sub + i)), zero));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(diff, diff), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(diff, diff), 16);
+    __m128i *p = (__m128i *)(sum + i);
+    _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), lo));
+    _mm_storeu_si128(p + 1, _mm_add_epi32(_mm_loadu_si128(p + 1), hi));
+  }
+#endif
+  for (; i < n; i++)
+    sum[i] = sum[i] + add[i] - sub[i];
+}
+
+void ConvolveTaps(const float *const *taps, const float *kernel, size_t len,
+                  uint8_t *dst, size_t n) {
+  size_t i = 0;
+#if defined(BMP_AVX2)
+  for (; i + 8 <= n; i += 8) {
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t j = 0; j < len; j++)
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(kernel[j]),
+                                             _mm256_loadu_ps(taps[j] + i)));
+    acc = _mm256_min_ps(_mm256_max_ps(acc, _mm256_setzero_ps()),
+                        _mm256_set1_ps(255.0f));
+    __m256i v = _mm256_cvtps_epi32(acc);
+    __m128i p16 = _mm_packs_epi32(_mm256_castsi256_si128(v),
+                                  _mm256_extracti128_si256(v, 1));
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(p16, p16));
+  }
+#endif
+#if defined(BMP_SSE2)
+  for (; i + 4 <= n; i += 4) {
+    __m128 acc = _mm_setzero_ps();
+    for (size_t j = 0; j < len; j++)
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(kernel[j]),
+                                       _mm_loadu_ps(taps[j] + i)));
+    acc = _mm_min_ps(_mm_max_ps(acc, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    __m128i v = _mm_cvtps_epi32(acc);
+    __m128i p16 = _mm_packs_epi32(v, v);
+    int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(p16, p16));
+    memcpy(dst + i, &bytes, 4);
+  }
+#endif
+  for (; i < n; i++) {
+    float acc = 0;
+    for (size_t j = 0; j < len; j++)
+      acc += kernel[j] * taps[j][i];
+    dst[i] = (uint8_t)std::lrint(std::clamp(acc, 0.0f, 255.0f));
+  }
+}
+
+ResampleWeights MakeResampleWeights(uint32_t in, uint32_t out,
+                                    RESIZE_FILTER filter) {
+  ResampleWeights rw;
+  rw.first.resize(out);
+  const double scale = (double)in / out;
+  if (filter == RESIZE_FILTER::NEAREST) {
+    rw.taps = 1;
+    rw.weights.assign(out, 1.0f);
+    for (uint32_t i = 0; i < out; i++)
+      rw.first[i] = (uint32_t)std::min<double>(std::floor((i + 0.5) * scale),
+                                               in - 1);
+    return rw;
+  }
+
+  const double pi = 3.14159265358979323846;
+  auto kernel = [&](double x) {
+    x = std::abs(x);
+    if (filter == RESIZE_FILTER::BILINEAR)
+      return x < 1 ? 1 - x : 0.0;
+    if (x >= 3)
+      return 0.0;
+    if (x < 1e-9)
+      return 1.0;
+    return 3 * std::sin(pi * x) * std::sin(pi * x / 3) / (pi * pi * x * x);
+  };
+  const double stretch = std::max(scale, 1.0);
+  const double support =
+      (filter == RESIZE_FILTER::BILINEAR ? 1.0 : 3.0) * stretch;
+  rw.taps = (uint32_t)std::min<double>(2 * std::ceil(support) + 1, in);
+  rw.weights.assign((size_t)out * rw.taps, 0.0f);
+  for (uint32_t i = 0; i < out; i++) {
+    // Inputs whose centers lie within support of the output's center
+    const double center = (i + 0.5) * scale;
+    const int64_t lo = std::max<int64_t>((int64_t)(center - support + 0.5), 0);
+    const int64_t hi = std::min<int64_t>((int64_t)(center + support + 0.5), in);
+    const int64_t first = std::min<int64_t>(lo, in - rw.taps);
+    double total = 0;
+    for (int64_t x = lo; x < hi; x++)
+      total += kernel((x + 0.5 - center) / stretch);
+    for (int64_t x = lo; x < hi; x++)
+      rw.weights[(size_t)i * rw.taps + (x - first)] =
+          (float)(kernel((x + 0.5 - center) / stretch) / total);
+    rw.first[i] = (uint32_t)first;
+  }
+  return rw;
+}
+
+ThreadPool::ThreadPool(unsigned threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 1; i < threads; i++)
+    queues.push_back(std::make_unique<Queue>());
+  for (size_t i = 0; i < queues.size(); i++)
+    workers.emplace_back([this, i]() { WorkerLoop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  Wait();
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+ThreadPool &ThreadPool::Global() {
+  static ThreadPool pool;
+  return pool;
+}
+
+ThreadPool::Local &ThreadPool::CurrentWorker() {
+  thread_local Local local;
+  return local;
+}
+
+size_t ThreadPool::HomeQueue() const {
+  const Local &local = CurrentWorker();
+  return local.pool == this ? local.index : 0;
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  if (workers.empty()) {
+    task();
+    return;
+  }
+  const Local &local = CurrentWorker();
+  size_t q = local.pool == this ? local.index : next_queue++ % queues.size();
+  unfinished++;
+  {
+    // Counted under the sleep mutex so a worker about to sleep can't miss
+    // it, and before the push so the count never drops below zero
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    queued++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues[q]->mutex);
+    queues[q]->tasks.push_back(std::move(task));
+  }
+  wake.notify_one();
+}
+
+void ThreadPool::Wait() {
+  size_t home = HomeQueue();
+  while (unfinished.load() > 0)
+    if (!RunOne(home))
+      std::this_thread::yield();
+  std::exception_ptr first;
+  {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    first = std::exchange(error, nullptr);
+  }
+  if (first)
+    std::rethrow_exception(first);
+}
+
+bool ThreadPool::RunOne(size_t home) {
+  std::function<void()> task;
+  for (size_t i = 0; i < queues.size() && !task; i++) {
+    Queue &queue = *queues[(home + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      continue;
+    if (i == 0) {
+      // Own queue, newest first while its data is still in cache
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+  }
+  if (!task)
+    return false;
+  queued--;
+  try {
+    task();
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error)
+      error = std::current_exception();
+  }
+  unfinished--;
+  return true;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+  CurrentWorker() = Local{this, index};
+  while (true) {
+    if (RunOne(index))
+      continue;
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    wake.wait(lock, [&]() { return stopping || queued.load() > 0; });
+    if (stopping && queued.load() == 0)
+      return;
+  }
+}
+
+BitmapPool::~BitmapPool() { Trim(); }
+
+uint8_t *BitmapPool::Allocate(size_t n, size_t &capacity) {
+  n = (std::max<size_t>(n, 1) + 63) / 64 * 64;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    FreeBlock **best = nullptr;
+    for (FreeBlock **b = &free_blocks; *b; b = &(*b)->next)
+      if ((*b)->capacity >= n && (*b)->capacity / 2 <= n &&
+          (!best || (*b)->capacity < (*best)->capacity))
+        best = b;
+    if (best) {
+      FreeBlock *block = *best;
+      *best = block->next;
+      cached -= block->capacity;
+      capacity = block->capacity;
+      return reinterpret_cast<uint8_t *>(block);
+    }
+    misses++;
+  }
+  capacity = n;
+  BMP_COUNT(allocations, 1);
+  BMP_COUNT(allocated_bytes, n);
+  return static_cast<uint8_t *>(::operator new(n, std::align_val_t{64}));
+}
+
+void BitmapPool::Deallocate(uint8_t *p, size_t capacity) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (capacity <= max_cached - cached) {
+      free_blocks = new (p) FreeBlock{free_blocks, capacity};
+      cached += capacity;
+      return;
+    }
+  }
+  ::operator delete(p, std::align_val_t{64});
+}
+
+void BitmapPool::Trim() {
+  FreeBlock *blocks;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks = std::exchange(free_blocks, nullptr);
+    cached = 0;
+  }
+  while (blocks)
+    ::operator delete(std::exchange(blocks, blocks->next),
+                      std::align_val_t{64});
+}
+
+size_t BitmapPool::CachedBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return cached;
+}
+
+size_t BitmapPool::Misses() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return misses;
+}
+
+PixelBuffer::Pin::Pin(PixelBuffer &buffer) : bytes(buffer.data()) {
+  if (bytes)
+    Header(bytes)->refs.fetch_add(pin_ref, std::memory_order_relaxed);
+}
+
+PixelBuffer::Pin::Pin(const Pin &other) noexcept : bytes(other.bytes) {
+  if (bytes)
+    Header(bytes)->refs.fetch_add(pin_ref, std::memory_order_relaxed);
+}
+
+PixelBuffer::Pin::~Pin() { Unreference(bytes, pin_ref); }
+
+PixelBuffer::PixelBuffer(const PixelBuffer &other)
+    : bytes(other.bytes), count(other.count), pool(other.pool) {
+  if (other.IsPinned()) {
+    bytes = nullptr;
+    count = 0;
+    assign(other.begin(), other.end());
+  } else if (bytes) {
+    Header()->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+PixelBuffer::PixelBuffer(PixelBuffer &&other) noexcept
+    : bytes(std::exchange(other.bytes, nullptr)),
+      count(std::exchange(other.count, 0)), pool(other.pool) {}
+
+PixelBuffer &PixelBuffer::operator=(const PixelBuffer &other) {
+  if (other.IsPinned()) {
+    if (this != &other) {
+      pool = other.pool;
+      assign(other.begin(), other.end());
+    }
+    return *this;
+  }
+  if (bytes != other.bytes) {
+    if (other.bytes)
+      other.Header()->refs.fetch_add(1, std::memory_order_relaxed);
+    Release();
+    bytes = other.bytes;
+  }
+  count = other.count;
+  pool = other.pool;
+  return *this;
+}
+
+PixelBuffer &PixelBuffer::operator=(PixelBuffer &&other) noexcept {
+  if (this != &other) {
+    Release();
+    bytes = std::exchange(other.bytes, nullptr);
+    count = std::exchange(other.count, 0);
+    pool = other.pool;
+  }
+  return *this;
+}
+
+void PixelBuffer::Release() {
+  Unreference(bytes, 1);
+  bytes = nullptr;
+  count = 0;
+}
+
+void PixelBuffer::Unreference(uint8_t *bytes, uint64_t n) {
+  if (bytes &&
+      Header(bytes)->refs.fetch_sub(n, std::memory_order_acq_rel) == n) {
+    Shared *shared = Header(bytes);
+    const size_t allocated = header_size + shared->capacity;
+    BitmapPool *owner = shared->pool;
+    shared->~Shared();
+    if (owner)
+      owner->Deallocate(reinterpret_cast<uint8_t *>(shared), allocated);
+    else
+      ::operator delete(shared, std::align_val_t{64});
+  }
+}
+
+void PixelBuffer::Reallocate(size_t n, size_t keep) {
+  size_t allocated = (header_size + n + 63) / 64 * 64;
+  if (!pool) {
+    BMP_COUNT(allocations, 1);
+    BMP_COUNT(allocated_bytes, allocated);
+  }
+  uint8_t *block =
+      pool ? pool->Allocate(header_size + n, allocated)
+           : static_cast<uint8_t *>(
+                 ::operator new(allocated, std::align_val_t{64}));
+  new (block) Shared{{1}, allocated - header_size, pool};
+  if (keep)
+    memcpy(block + header_size, bytes, keep);
+  Release();
+  bytes = block + header_size;
+  count = keep;
+}
+
+void PixelBuffer::clear() {
+  if (IsShared())
+    Release();
+  count = 0;
+}
+
+void PixelBuffer::reserve(size_t n) {
+  if (n > capacity() || IsShared())
+    Reallocate(std::max(n, count), count);
+}
+
+void PixelBuffer::resize(size_t n, Uninitialized) {
+  if (n > capacity() || IsShared())
+    Reallocate(n, std::min(n, count));
+  count = n;
+}
+
+void PixelBuffer::resize(size_t n, uint8_t value) {
+  const size_t old = count;
+  resize(n, uninitialized);
+  if (n > old)
+    memset(bytes + old, value, n - old);
+}
+
+void PixelBuffer::assign(size_t n, uint8_t value) {
+  clear();
+  resize(n, value);
+}
+
+void PixelBuffer::assign(const uint8_t *first, const uint8_t *last) {
+  const size_t n = (size_t)(last - first);
+  clear();
+  resize(n, uninitialized);
+  if (n)
+    memmove(bytes, first, n);
+}
+
+Bitmap::Bitmap(const char *fn, const uint32_t &w, const uint32_t &h,
+               bool alpha, Uninitialized, BitmapPool *pool)
+    : vec_pixels(pool) {
+  filename = fn ? fn : "";
+  info_header.width = w;
+  info_header.height = h;
+  SetBitDepth(alpha ? BIT_DEPTH::BD_32 : BIT_DEPTH::BD_24);
+  const uint32_t stride = Stride();
+  vec_pixels.resize((size_t)stride * h, uninitialized);
+  // Padding is written to files as is, so it is kept zero
+  const size_t used = (size_t)w * Channels();
+  if (used < stride)
+    for (uint32_t y = 0; y < h; y++)
+      memset(Row(y) + used, 0, stride - used);
+  file_header.file_size = file_header.offset_data + (uint32_t)vec_pixels.size();
+}
+
+bool Bitmap::Read(const char *fn) {
+  BMP_TRACE("Bitmap::Read");
+  // Open file with name fn
+  std::ifstream infile(fn, std::ios::binary);
+  if (!infile.is_open()) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+
+  // Load into file and info header structs
+  uint8_t header[54];
+  if (!infile.read((char *)header, sizeof(header))) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  UTILS::read_headers(header, file_header, info_header);
+  if (info_header.bits_per_pixel <= 8 ||
+      info_header.compression == (uint32_t)COMPRESSION::RLE8 ||
+      info_header.compression == (uint32_t)COMPRESSION::RLE4)
+    return ReadIndexed(fn);
+  if (info_header.bits_per_pixel == 16 ||
+      info_header.compression == (uint32_t)COMPRESSION::BITFIELDS)
+    return ReadBitfields(infile, fn);
+
+  // Set color depth
+  switch (info_header.bits_per_pixel) {
+  case 24:
+    bit_depth = BIT_DEPTH::BD_24;
+    break;
+  case 32:
+    bit_depth = BIT_DEPTH::BD_32;
+    break;
+  default:
+    std::cout << "Unsupported bit depth: " << info_header.bits_per_pixel
+              << "\n";
+    return false;
+  }
+
+  // The pixels are read straight into the pixel buffer, which always holds
+  // every row; a short file leaves the rest zero
+  infile.seekg(0, std::ios::end);
+  const uint64_t length = (uint64_t)infile.tellg();
+  const uint64_t offset = file_header.offset_data;
+  view = nullptr;
+  view_stride = 0;
+  view_pin = {};
+  const size_t size = (size_t)Stride() * Height();
+  const size_t n = (size_t)std::min<uint64_t>(
+      size, length > offset ? length - offset : 0);
+  vec_pixels.clear();
+  vec_pixels.resize(size, uninitialized);
+  infile.seekg((std::streamoff)offset);
+  if (!infile.read((char *)vec_pixels.data(), (std::streamsize)n)) {
+    vec_pixels.clear();
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  if (n < size)
+    memset(vec_pixels.data() + n, 0, size - n);
+  BMP_COUNT(bytes_read, sizeof(header) + n);
+  return true;
+}
+
+bool Bitmap::Write(const char *fn, COMPRESSION compression) const {
+  BMP_TRACE("Bitmap::Write");
+  bool written;
+  if (compression == COMPRESSION::BITFIELDS) {
+    written = WriteBitfields(fn);
+  } else if (compression != COMPRESSION::RGB) {
+    written = WriteRLE(fn, compression);
+  } else if (view) {
+    // The rows of a view are not contiguous, they are written one at a time
+    BitmapWriter writer(fn, Width(), Height(), bit_depth == BIT_DEPTH::BD_32);
+    for (uint32_t y = 0; y < Height(); y++)
+      writer.WriteRow(Row(y));
+    written = writer.Close();
+  } else {
+    written = UTILS::write_bitmap(fn, file_header, info_header,
+                                  vec_pixels.data(), vec_pixels.size());
+  }
+  if (written) {
+    if (Verbose())
+      std::cout << "Bitmap saved to " << fn << "\n";
+    return true;
+  } else {
+    std::cout << "Failed to save " << fn << "\n";
+    return false;
+  }
+}
+
+bool Bitmap::ReadIndexed(const char *fn) {
+  IndexedBitmap indexed;
+  if (!indexed.Read(fn))
+    return false;
+  Bitmap bmp = indexed.ToBitmap(BIT_DEPTH::BD_24, vec_pixels.GetPool());
+  file_header = bmp.file_header;
+  info_header = bmp.info_header;
+  bit_depth = bmp.bit_depth;
+  view = nullptr;
+  view_stride = 0;
+  view_pin = {};
+  vec_pixels = std::move(bmp.vec_pixels);
+  return true;
+}
+
+bool Bitmap::Palettize(size_t max_colors, std::vector<Color> &palette,
+                       std::vector<uint8_t> &indices) const {
+  const uint32_t w = Width();
+  const uint32_t h = Height();
+  palette.clear();
+  indices.resize((size_t)w * h);
+  std::unordered_map<uint32_t, uint8_t> lookup;
+  bool fits = true;
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    for (uint32_t y = 0; y < h && fits; y++) {
+      const uint8_t *row = Row(y);
+      uint8_t *dst = indices.data() + (size_t)y * w;
+      for (uint32_t x = 0; x < w;) {
+        // Runs of equal pixels are looked up once
+        const uint8_t *p = row + (size_t)x * PF::channels;
+        const size_t n =
+            1 + CommonPrefix(p, p + PF::channels,
+                             (size_t)(w - x - 1) * PF::channels) /
+                    PF::channels;
+        const Color c = PF::Load(p);
+        auto [it, added] =
+            lookup.try_emplace(c.red << 16 | c.green << 8 | c.blue,
+                               (uint8_t)palette.size());
+        if (added) {
+          if (palette.size() == max_colors) {
+            fits = false;
+            return;
+          }
+          palette.push_back(Color{c.red, c.green, c.blue});
+        }
+        memset(dst + x, it->second, n);
+        x += (uint32_t)n;
+      }
+    }
+  });
+  return fits;
+}
+
+bool Bitmap::WriteRLE(const char *fn, COMPRESSION compression) const {
+  const uint16_t bits = compression == COMPRESSION::RLE8 ? 8 : 4;
+  if (!HasPixels() && Width() > 0 && Height() > 0)
+    return false;
+  std::vector<Color> palette;
+  std::vector<uint8_t> indices;
+  if (!Palettize((size_t)1 << bits, palette, indices)) {
+    std::cout << "Error: RLE" << bits << " holds at most " << (1 << bits)
+              << " colors.\n";
+    return false;
+  }
+  IndexedBitmap indexed(filename.c_str(), Width(), Height(), bits,
+                        std::move(palette));
+  for (uint32_t y = 0; y < Height(); y++)
+    indexed.SetRow(y, indices.data() + (size_t)y * Width());
+  return indexed.WriteFile(fn, compression);
+}
+
+bool Bitmap::ReadBitfields(std::ifstream &infile, const char *fn) {
+  const uint16_t bits = info_header.bits_per_pixel;
+  if (bits != 16 && bits != 32) {
+    std::cout << "Unsupported bit depth: " << bits << "\n";
+    return false;
+  }
+  BitMasks masks = MASKS_RGB555;
+  if (info_header.compression == (uint32_t)COMPRESSION::BITFIELDS) {
+    // The masks follow a 40-byte info header, or are its next fields in the
+    // longer headers, which add the alpha mask
+    uint8_t fields[16] = {};
+    const std::streamsize size = info_header.header_size >= 56 ? 16 : 12;
+    infile.seekg(54);
+    if (!infile.read((char *)fields, size)) {
+      std::cout << "Failed to read " << fn << "\n";
+      return false;
+    }
+    masks.red = UTILS::bytes_to_uint32(fields);
+    masks.green = UTILS::bytes_to_uint32(fields + 4);
+    masks.blue = UTILS::bytes_to_uint32(fields + 8);
+    masks.alpha = size == 16 ? UTILS::bytes_to_uint32(fields + 12) : 0;
+    // Every mask is one run of bits, and no two share a bit
+    const uint32_t all[4] = {masks.red, masks.green, masks.blue, masks.alpha};
+    bool valid = true;
+    uint32_t taken = 0;
+    for (uint32_t m : all) {
+      const uint32_t run = m ? m >> std::countr_zero(m) : 0;
+      valid = valid && (run & (run + 1)) == 0 && (taken & m) == 0;
+      taken |= m;
+    }
+    if (!valid) {
+      std::cout << "Error: Invalid bit masks in " << fn << "\n";
+      return false;
+    }
+  } else if (info_header.compression != (uint32_t)COMPRESSION::RGB) {
+    std::cout << "Unsupported compression: " << info_header.compression
+              << "\n";
+    return false;
+  }
+
+  // The packed rows are read first, a short file leaves the rest zero
+  const uint32_t w = info_header.width;
+  const uint32_t h = info_header.height;
+  const uint32_t src_stride = UTILS::row_stride(w, bits);
+  std::vector<uint8_t> data((size_t)src_stride * h, 0);
+  infile.seekg(0, std::ios::end);
+  const uint64_t length = (uint64_t)infile.tellg();
+  const uint64_t offset = file_header.offset_data;
+  const size_t n = (size_t)std::min<uint64_t>(
+      data.size(), length > offset ? length - offset : 0);
+  infile.seekg((std::streamoff)offset);
+  if (!infile.read((char *)data.data(), (std::streamsize)n)) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  BMP_COUNT(bytes_read, 54 + n);
+
+  file_header.offset_data = 54;
+  info_header.header_size = 40;
+  info_header.compression = 0;
+  info_header.colors_used = 0;
+  info_header.colors_important = 0;
+  view = nullptr;
+  view_stride = 0;
+  view_pin = {};
+  vec_pixels.clear();
+  bit_depth = masks.alpha ? BIT_DEPTH::BD_32 : BIT_DEPTH::BD_24;
+  info_header.bits_per_pixel = masks.alpha ? 32 : 24;
+  const uint32_t stride = Stride();
+  info_header.image_size = stride * h;
+  file_header.file_size = file_header.offset_data + info_header.image_size;
+  vec_pixels.resize((size_t)stride * h, uninitialized);
+  if (vec_pixels.empty())
+    return true;
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    ForEachRowBand(h, stride, [&](uint32_t y0, uint32_t y1) {
+      constexpr size_t chunk = 64;
+      uint8_t wide[4 * chunk];
+      for (uint32_t y = y0; y < y1; y++) {
+        const uint8_t *src = data.data() + (size_t)y * src_stride;
+        uint8_t *row = vec_pixels.data() + (size_t)y * stride;
+        if constexpr (std::is_same_v<PF, BGRA32>) {
+          UnpackBitfields(src, bits, masks, row, w);
+        } else {
+          // 24-bit rows are unpacked to 32 bits in short chunks
+          for (size_t x = 0; x < w; x += chunk) {
+            const size_t m = std::min<size_t>(chunk, w - x);
+            UnpackBitfields(src + x * bits / 8, bits, masks, wide, m);
+            ConvertPixels<BGRA32, PF>(wide, row + x * PF::channels,
+                                      (uint32_t)m);
+          }
+        }
+        memset(row + (size_t)w * PF::channels, 0,
+               stride - (size_t)w * PF::channels);
+      }
+    });
+  });
+  return true;
+}
+
+bool Bitmap::WriteBitfields(const char *fn) const {
+  if (!HasPixels() && Width() > 0 && Height() > 0)
+    return false;
+  const uint32_t w = Width();
+  const uint32_t h = Height();
+  const uint32_t stride = UTILS::row_stride(w, 16);
+  std::vector<uint8_t> data((size_t)stride * h, 0);
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    ForEachRowBand(h, stride, [&](uint32_t y0, uint32_t y1) {
+      constexpr size_t chunk = 64;
+      uint8_t wide[4 * chunk];
+      for (uint32_t y = y0; y < y1; y++)
+        for (size_t x = 0; x < w; x += chunk) {
+          const size_t m = std::min<size_t>(chunk, w - x);
+          ConvertPixels<PF, BGRA32>(Row(y) + x * PF::channels, wide,
+                                    (uint32_t)m);
+          PackBitfields(wide, 16, MASKS_RGB565,
+                        data.data() + (size_t)y * stride + 2 * x, m);
+        }
+    });
+  });
+
+  FileHeader fh = file_header;
+  Infoheader ih = info_header;
+  ih.header_size = 40;
+  ih.bits_per_pixel = 16;
+  ih.compression = (uint32_t)COMPRESSION::BITFIELDS;
+  ih.image_size = (uint32_t)data.size();
+  ih.colors_used = 0;
+  ih.colors_important = 0;
+  fh.offset_data = 54 + 12;
+  fh.file_size = fh.offset_data + (uint32_t)data.size();
+  // The masks go out after the headers
+  uint8_t header[54 + 12];
+  UTILS::write_headers(header, fh, ih);
+  UTILS::uint32_to_bytes(MASKS_RGB565.red, header + 54);
+  UTILS::uint32_to_bytes(MASKS_RGB565.green, header + 58);
+  UTILS::uint32_to_bytes(MASKS_RGB565.blue, header + 62);
+  if (!UTILS::write_file(fn, header, sizeof(header), data.data(),
+                         data.size()))
+    return false;
+  BMP_COUNT(bytes_written, sizeof(header) + data.size());
+  return true;
+}
+
+void Bitmap::SetBitDepth(const BIT_DEPTH &bd) {
+  if (HasPixels()) {
+    ConvertTo(bd);
+    return;
+  }
+  bit_depth = bd;
+  switch (bd) {
+  case BIT_DEPTH::BD_24:
+    info_header.bits_per_pixel = 24;
+    break;
+  case BIT_DEPTH::BD_32:
+    info_header.bits_per_pixel = 32;
+    break;
+  }
+}
+
+void Bitmap::SetPixel(int x, int y, const Color &color) {
+  int w = (int)info_header.width;
+  int h = (int)info_header.height;
+  // Pixel coordinate outside of bitmap
+  if (x < 0 || y < 0 || x >= w || y >= h) {
+    BMP_COUNT_PIXELS(PIXEL, 0, 1);
+    return;
+  }
+  BMP_COUNT_PIXELS(PIXEL, 1, 0);
+  SetPixelUnchecked(x, y, color);
+}
+
+void Bitmap::SetPixelUnchecked(int x, int y, const Color &color) {
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    PF::Store(Row(y) + (size_t)x * PF::channels, color);
+  });
+}
+
+void Bitmap::Plot(int x, int y, const Color &color) {
+  if (blend_mode == BLEND_MODE::REPLACE) {
+    SetPixelUnchecked(x, y, color);
+    return;
+  }
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    BlendColor<PF>(Row(y) + (size_t)x * PF::channels, 1, color, blend_mode);
+  });
+}
+
+void Bitmap::ConvertTo(const BIT_DEPTH &bd, uint8_t alpha) {
+  if (bd == bit_depth)
+    return;
+  if (view) {
+    std::cout << "Error: The bit depth of a view can not be changed.\n";
+    return;
+  }
+  BMP_TRACE("Bitmap::ConvertTo");
+  const uint32_t w = Width();
+  const uint32_t h = Height();
+  const uint16_t bits_per_pixel = bd == BIT_DEPTH::BD_32 ? 32 : 24;
+  const uint32_t dst_stride = UTILS::row_stride(w, bits_per_pixel);
+  if (!vec_pixels.empty()) {
+    // Rows are repacked into a new buffer from the same pool, which also
+    // takes care of the padding changing with the bit depth
+    PixelBuffer converted(vec_pixels.GetPool());
+    converted.resize((size_t)dst_stride * h, uninitialized);
+    const size_t used = (size_t)w * (bits_per_pixel / 8);
+    VisitPixelFormat(bit_depth, [&](auto src_format) {
+      VisitPixelFormat(bd, [&](auto dst_format) {
+        using SrcFormat = decltype(src_format);
+        using DstFormat = decltype(dst_format);
+        ForEachRowBand(h, dst_stride, [&](uint32_t y0, uint32_t y1) {
+          for (uint32_t y = y0; y < y1; y++) {
+            uint8_t *dst = converted.data() + (size_t)y * dst_stride;
+            ConvertPixels<SrcFormat, DstFormat>(std::as_const(*this).Row(y),
+                                                dst, w, alpha);
+            memset(dst + used, 0, dst_stride - used);
+          }
+        });
+      });
+    });
+    vec_pixels = std::move(converted);
+  }
+  bit_depth = bd;
+  info_header.bits_per_pixel = bits_per_pixel;
+  if (info_header.image_size != 0)
+    info_header.image_size = (uint32_t)vec_pixels.size();
+  file_header.file_size = file_header.offset_data + (uint32_t)vec_pixels.size();
+}
+
+void Bitmap::Fill(const Color &color) {
+  BMP_DRAW(FILL, "Bitmap::Fill");
+  uint32_t w = Width();
+  BMP_COUNT_PIXELS(FILL, (uint64_t)w * Height(), 0);
+  // Switch on the bit depth once, the rows are filled by the SIMD kernel in
+  // parallel bands
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    const bool padded = Stride() != w * PF::channels;
+    ForEachRow([&](uint32_t y0, uint32_t y1) {
+      if (!padded) {
+        // No padding, the whole band is one span
+        PutPixels<PF>(Row(y0), (size_t)w * (y1 - y0), color);
+        return;
+      }
+      for (uint32_t y = y0; y < y1; y++)
+        PutPixels<PF>(Row(y), w, color);
+    });
+  });
+}
+
+void Bitmap::FillSpan(int x0, int x1, int y, const Color &color) {
+  BMP_DRAW(SPAN, "Bitmap::FillSpan");
+  FillSpan(x0, x1, y, color, Bounds());
+}
+
+void Bitmap::FillSpan(int x0, int x1, int y, const Color &color,
+                      const Rect &clip) {
+  if (x1 < x0)
+    std::swap(x0, x1);
+  if (y < clip.y || y >= clip.y + clip.h || x1 < clip.x ||
+      x0 >= clip.x + clip.w) {
+    BMP_COUNT_PIXELS(SPAN, 0, (int64_t)x1 - x0 + 1);
+    return;
+  }
+  const int cx0 = std::max(x0, clip.x);
+  const int cx1 = std::min(x1, clip.x + clip.w - 1);
+  BMP_COUNT_PIXELS(SPAN, cx1 - cx0 + 1, (int64_t)x1 - x0 - (cx1 - cx0));
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    PutPixels<PF>(Row(y) + (size_t)cx0 * PF::channels, cx1 - cx0 + 1, color);
+  });
+}
+
+void BMP::Bitmap::DrawLine(int sx, int sy, int ex, int ey, Color color) {
+  DrawLine(sx, sy, ex, ey, color, Bounds());
+}
+
+void BMP::Bitmap::DrawLine(int sx, int sy, int ex, int ey, const Color &color,
+                           const Rect &clip) {
+  // The line is clipped before rasterizing, so the cost depends on the
+  // visible length only. Clipping happens on the steps of the Bresenham walk
+  // rather than on the geometric line, which keeps the drawn pixels identical
+  // to walking the whole line.
+  BMP_DRAW(LINE, "Bitmap::DrawLine");
+  const int64_t clip_x1 = (int64_t)clip.x + clip.w - 1;
+  const int64_t clip_y1 = (int64_t)clip.y + clip.h - 1;
+  int64_t x0 = sx, y0 = sy, x1 = ex, y1 = ey;
+  int64_t dx = x1 - x0;
+  int64_t dy = y1 - y0;
+
+  if (dx < 0) {
+    std::swap(x0, x1);
+    std::swap(y0, y1);
+    dx = -dx;
+    dy = -dy;
+  }
+  // Horizontal line
+  if (dy == 0) {
+    FillSpan(sx, ex, sy, color, clip);
+    return;
+  }
+  // Vertical line
+  if (dx == 0) {
+    if (x0 < clip.x || x0 > clip_x1) {
+      BMP_COUNT_PIXELS(LINE, 0, std::abs(dy) + 1);
+      return;
+    }
+    if (dy < 0)
+      std::swap(y0, y1);
+    const int64_t first = std::max<int64_t>(y0, clip.y);
+    const int64_t last = std::min(y1, clip_y1);
+    BMP_COUNT_PIXELS(LINE, std::max<int64_t>(last - first + 1, 0),
+                     y1 - y0 + 1 - std::max<int64_t>(last - first + 1, 0));
+    for (int64_t y = first; y <= last; y++)
+      Plot((int)x0, (int)y, color);
+    return;
+  }
+
+  // Walks a line along its major axis a from a0 for da steps. The minor axis b
+  // starts at b0 and moves by b_inc whenever the decision value is positive.
+  // Before step k it has moved m_k = floor((2 db k + da - 1) / (2 da)) times
+  // and the decision value is 2 db (k + 1) - da - 2 da m_k, so the walk can
+  // start at the first visible step directly. m_k never decreases, the
+  // visible steps are found by bisection. Returns the number of steps
+  // plotted.
+  auto walk = [&](int64_t a0, int64_t b0, int64_t b_inc, int64_t da,
+                  int64_t db, int64_t a_lo, int64_t a_hi, int64_t b_lo,
+                  int64_t b_hi, auto plot) -> int64_t {
+    auto moves = [&](int64_t k) {
+      uint64_t q = (uint64_t)db * (uint64_t)k;
+      uint64_t m = q / (uint64_t)da;
+      uint64_t rem = q % (uint64_t)da;
+      return (int64_t)(m + (2 * rem + (uint64_t)da - 1) / (2 * (uint64_t)da));
+    };
+    // Steps with the major axis inside [a_lo, a_hi]
+    int64_t k0 = std::max<int64_t>(0, a_lo - a0);
+    int64_t k1 = std::min(da, a_hi - a0);
+    // Range of moves keeping the minor axis inside [b_lo, b_hi]
+    int64_t m_lo = b_inc > 0 ? b_lo - b0 : b0 - b_hi;
+    int64_t m_hi = b_inc > 0 ? b_hi - b0 : b0 - b_lo;
+    if (k0 > k1)
+      return 0;
+    // First step with moves(k) >= m_lo, then the first with moves(k) > m_hi
+    auto first_step = [&](int64_t lo, int64_t hi, auto pred) {
+      while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (pred(moves(mid)))
+          hi = mid;
+        else
+          lo = mid + 1;
+      }
+      return lo;
+    };
+    k0 = first_step(k0, k1 + 1, [&](int64_t m) { return m >= m_lo; });
+    k1 = first_step(k0, k1 + 1, [&](int64_t m) { return m > m_hi; }) - 1;
+    if (k0 > k1)
+      return 0;
+
+    // The terms overflow for lines across the whole int range while the
+    // decision value does not, so it is computed modulo 2^64
+    int64_t m = moves(k0);
+    int64_t D = (int64_t)(2 * (uint64_t)db * (uint64_t)(k0 + 1) - (uint64_t)da -
+                          2 * (uint64_t)da * (uint64_t)m);
+    for (int64_t k = k0; k <= k1; k++) {
+      plot(a0 + k, b0 + b_inc * m);
+      if (D > 0) {
+        D += 2 * (db - da);
+        m++;
+      } else {
+        D += 2 * db;
+      }
+    }
+    return k1 - k0 + 1;
+  };
+
+  // Slope -1 <= m <= 1
+  if (dx >= std::abs(dy)) {
+    int64_t y_inc = 1;
+    if (dy < 0) {
+      y_inc = -1;
+      dy = -dy;
+    }
+    const int64_t plotted =
+        walk(x0, y0, y_inc, dx, dy, clip.x, clip_x1, clip.y, clip_y1,
+             [&](int64_t x, int64_t y) { Plot((int)x, (int)y, color); });
+    BMP_COUNT_PIXELS(LINE, plotted, dx + 1 - plotted);
+  }
+  // Slope abs(m) > 1
+  else {
+    if (dy < 0) {
+      std::swap(y0, y1);
+      std::swap(x0, x1);
+      dy = -dy;
+      dx = -dx;
+    }
+    int64_t x_inc = 1;
+    if (dx < 0) {
+      x_inc = -1;
+      dx = -dx;
+    }
+    const int64_t plotted =
+        walk(y0, x0, x_inc, dy, dx, clip.y, clip_y1, clip.x, clip_x1,
+             [&](int64_t y, int64_t x) { Plot((int)x, (int)y, color); });
+    BMP_COUNT_PIXELS(LINE, plotted, dy + 1 - plotted);
+  }
+}
+
+void BMP::Bitmap::DrawRect(const int &x, const int &y, const int &w,
+                           const int &h, const Color &color) {
+  DrawRect(x, y, w, h, color, Bounds());
+}
+
+void BMP::Bitmap::DrawRect(const int &x, const int &y, const int &w,
+                           const int &h, const Color &color,
+                           const Rect &clip) {
+  BMP_DRAW(RECT, "Bitmap::DrawRect");
+  if (w > 0 && h > 0) {
+    // The same pixels as the four lines below, drawn as disjoint runs so
+    // that the corners are not blended twice
+    FillSpan(x, x + w - 1, y, color, clip);
+    if (h > 1)
+      FillSpan(x, x + w - 1, y + h - 1, color, clip);
+    if (h > 2) {
+      DrawLine(x, y + 1, x, y + h - 2, color, clip);
+      if (w > 1)
+        DrawLine(x + w - 1, y + 1, x + w - 1, y + h - 2, color, clip);
+    }
+    return;
+  }
+  DrawLine(x, y, x + w - 1, y, color, clip);
+  DrawLine(x, y, x, y + h - 1, color, clip);
+  DrawLine(x + w - 1, y, x + w - 1, y + h - 1, color, clip);
+  DrawLine(x, y + h - 1, x + w - 1, y + h - 1, color, clip);
+}
+
+void BMP::Bitmap::FillRect(const int &x, const int &y, const int &w,
+                           const int &h, const Color &color) {
+  FillRect(x, y, w, h, color, Bounds());
+}
+
+void BMP::Bitmap::FillRect(const int &x, const int &y, const int &w,
+                           const int &h, const Color &color,
+                           const Rect &clip) {
+  // Clip once, then fill every row as a span
+  BMP_DRAW(RECT, "Bitmap::FillRect");
+  int64_t x0 = std::max<int64_t>(x, clip.x);
+  int64_t y0 = std::max<int64_t>(y, clip.y);
+  int64_t x1 = std::min<int64_t>((int64_t)x + w, (int64_t)clip.x + clip.w);
+  int64_t y1 = std::min<int64_t>((int64_t)y + h, (int64_t)clip.y + clip.h);
+  const int64_t area = (int64_t)std::max(w, 0) * std::max(h, 0);
+  if (x0 >= x1 || y0 >= y1) {
+    BMP_COUNT_PIXELS(RECT, 0, area);
+    return;
+  }
+  BMP_COUNT_PIXELS(RECT, (x1 - x0) * (y1 - y0), area - (x1 - x0) * (y1 - y0));
+
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    for (int64_t yi = y0; yi < y1; yi++)
+      PutPixels<PF>(Row((uint32_t)yi) + x0 * PF::channels,
+                     (uint32_t)(x1 - x0), color);
+  });
+}
+
+void BMP::Bitmap::DrawCircle(const int &xc, const int &yc, const int &r,
+                             const Color &color) {
+  DrawCircle(xc, yc, r, color, Bounds());
+}
+
+void BMP::Bitmap::DrawCircle(const int &xc, const int &yc, const int &r,
+                             const Color &color, const Rect &clip) {
+  BMP_DRAW(CIRCLE, "Bitmap::DrawCircle");
+  const int64_t clip_x1 = (int64_t)clip.x + clip.w - 1;
+  const int64_t clip_y1 = (int64_t)clip.y + clip.h - 1;
+  uint64_t written = 0, clipped = 0;
+  auto plot = [&](int64_t x, int64_t y) {
+    if (x >= clip.x && x <= clip_x1 && y >= clip.y && y <= clip_y1) {
+      Plot((int)x, (int)y, color);
+      written++;
+    } else {
+      clipped++;
+    }
+  };
+  auto setpixel_all_octants = [&](const int &x, const int &y) {
+    plot((int64_t)xc + x, (int64_t)yc + y);
+    plot((int64_t)xc - x, (int64_t)yc + y);
+    plot((int64_t)xc + x, (int64_t)yc - y);
+    plot((int64_t)xc - x, (int64_t)yc - y);
+    plot((int64_t)xc + y, (int64_t)yc + x);
+    plot((int64_t)xc - y, (int64_t)yc + x);
+    plot((int64_t)xc + y, (int64_t)yc - x);
+    plot((int64_t)xc - y, (int64_t)yc - x);
+  };
+
+  const int64_t ar = std::abs((int64_t)r);
+  // Nothing to draw when the bounding box misses the clip rectangle
+  if (xc + ar < clip.x || xc - ar > clip_x1 || yc + ar < clip.y ||
+      yc - ar > clip_y1)
+    return;
+
+  if (r <= (int64_t)clip.w + clip.h || r > (1 << 28)) {
+    // The walk costs about as much as the clip rectangle is large
+    int y = r;
+    int x = 0;
+    int64_t D = 3 - 2 * (int64_t)r;
+    setpixel_all_octants(x, y);
+    while (y >= x++) {
+      if (D > 0) {
+        y--;
+        D += 4 * (x - y) + 10;
+      } else {
+        D += 4 * x + 6;
+      }
+      setpixel_all_octants(x, y);
+    }
+    BMP_COUNT_PIXELS(CIRCLE, written, clipped);
+    return;
+  }
+
+  // Large radius, only the visible steps of every octant are walked. The
+  // closed form is exact up to x_safe, the few steps after it are walked for
+  // all octants as above.
+  auto first_x_below = [&](int64_t lo, int64_t hi, int64_t v) {
+    // First step in [lo, hi) with y <= v, y never increases
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (UTILS::circle_y(r, mid) <= v)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    return lo;
+  };
+  int64_t x_safe = 0;
+  for (int64_t lo = 1, hi = r; lo <= hi;) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (UTILS::circle_y(r, mid) >= mid + 3) {
+      x_safe = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  // Range of v for which c + s * v is inside [lo, hi]
+  auto visible = [](int64_t c, int64_t s, int64_t lo, int64_t hi) {
+    return s > 0 ? std::pair<int64_t, int64_t>{lo - c, hi - c}
+                 : std::pair<int64_t, int64_t>{c - hi, c - lo};
+  };
+
+  for (int octant = 0; octant < 8; octant++) {
+    const int64_t sx = octant & 1 ? -1 : 1;
+    const int64_t sy = octant & 2 ? -1 : 1;
+    const bool swap = octant & 4;
+    // The step x moves one coordinate linearly, y(x) moves the other
+    auto [x_lo, x_hi] = swap ? visible(yc, sy, clip.y, clip_y1)
+                             : visible(xc, sx, clip.x, clip_x1);
+    auto [y_lo, y_hi] = swap ? visible(xc, sx, clip.x, clip_x1)
+                             : visible(yc, sy, clip.y, clip_y1);
+    x_lo = std::max<int64_t>(x_lo, 0);
+    x_hi = std::min(x_hi, x_safe);
+    if (x_lo > x_hi)
+      continue;
+    x_lo = first_x_below(x_lo, x_hi + 1, y_hi);
+    x_hi = first_x_below(x_lo, x_hi + 1, y_lo - 1) - 1;
+    if (x_lo > x_hi)
+      continue;
+
+    int64_t y = UTILS::circle_y(r, x_lo);
+    int64_t D = UTILS::circle_d(r, x_lo, y);
+    written += (uint64_t)(x_hi - x_lo + 1);
+    for (int64_t x = x_lo;; x++) {
+      if (swap)
+        Plot((int)(xc + sx * y), (int)(yc + sy * x), color);
+      else
+        Plot((int)(xc + sx * x), (int)(yc + sy * y), color);
+      if (x == x_hi)
+        break;
+      if (D > 0) {
+        y--;
+        D += 4 * (x + 1 - y) + 10;
+      } else {
+        D += 4 * (x + 1) + 6;
+      }
+    }
+  }
+
+  int y = (int)UTILS::circle_y(r, x_safe);
+  int x = (int)x_safe;
+  int D = (int)UTILS::circle_d(r, x, y);
+  while (y >= x++) {
+    if (D > 0) {
+      y--;
+      D += 4 * (x - y) + 10;
+    } else {
+      D += 4 * x + 6;
+    }
+    setpixel_all_octants(x, y);
+  }
+  BMP_COUNT_PIXELS(CIRCLE, written, clipped);
+}
+
+void BMP::Bitmap::FillCircle(const int &xc, const int &yc, const int &r,
+                             const Color &color) {
+  FillCircle(xc, yc, r, color, Bounds());
+}
+
+void BMP::Bitmap::FillCircle(const int &xc, const int &yc, const int &r,
+                             const Color &color, const Rect &clip) {
+  BMP_DRAW(CIRCLE, "Bitmap::FillCircle");
+  const int64_t ar = std::abs((int64_t)r);
+  // Nothing to draw when the bounding box misses the clip rectangle
+  if (xc + ar < clip.x || xc - ar >= (int64_t)clip.x + clip.w ||
+      yc + ar < clip.y || yc - ar >= (int64_t)clip.y + clip.h)
+    return;
+  if (r < 0) {
+    // The walk of a negative radius stops after its first step, which fills
+    // row yc and plots the two pixels ar above and below the center
+    const int x0 = (int)std::max<int64_t>(xc - ar, INT_MIN);
+    const int x1 = (int)std::min<int64_t>(xc + ar, INT_MAX);
+    FillSpan(x0, x1, yc, color, clip);
+    if (yc + ar <= INT_MAX)
+      FillSpan(xc, xc, (int)(yc + ar), color, clip);
+    if (yc - ar >= INT_MIN)
+      FillSpan(xc, xc, (int)(yc - ar), color, clip);
+    return;
+  }
+  if (r > (int64_t)clip.w + clip.h || r > (1 << 28)) {
+    FillLargeCircle(xc, yc, r, color, clip);
+    return;
+  }
+
+  // Same walk as DrawCircle. All spans of a row are centered on xc, so only
+  // the widest half width per row offset |dy| is kept and every row is then
+  // filled once.
+  std::vector<int> half_width(r + 2, -1);
+  auto widen = [&](const int &dy, const int &hw) {
+    size_t row = (size_t)std::abs(dy);
+    if (row >= half_width.size())
+      half_width.resize(row + 1, -1);
+    half_width[row] = std::max(half_width[row], std::abs(hw));
+  };
+  auto span_helper = [&](const int &x, const int &y) {
+    widen(y, x);
+    widen(x, y);
+  };
+
+  int y = r;
+  int x = 0;
+  int D = 3 - (2 * r);
+  span_helper(x, y);
+  while (y >= x++) {
+    if (D > 0) {
+      y--;
+      D += 4 * (x - y) + 10;
+    } else {
+      D += 4 * x + 6;
+    }
+    span_helper(x, y);
+  }
+
+  for (int dy = 0; dy < (int)half_width.size(); dy++) {
+    if (half_width[dy] < 0)
+      continue;
+    FillSpan(xc - half_width[dy], xc + half_width[dy], yc + dy, color, clip);
+    if (dy != 0)
+      FillSpan(xc - half_width[dy], xc + half_width[dy], yc - dy, color, clip);
+  }
+}
+
+void BMP::Bitmap::FillLargeCircle(const int &xc, const int &yc, const int &r,
+                                  const Color &color, const Rect &clip) {
+  // Only the visible rows are filled. Row offset d gets the half width y(d)
+  // from the walk's step d and the last step x whose y(x) is d, both from the
+  // closed form up to x_safe. The few steps after x_safe are walked.
+  const bool walk = r <= (1 << 28);
+  auto first_x_below = [&](int64_t lo, int64_t hi, int64_t v) {
+    // First step in [lo, hi) with y <= v, y never increases
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (UTILS::circle_y(r, mid) <= v)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    return lo;
+  };
+  int64_t x_safe = 0;
+  for (int64_t lo = 1, hi = walk ? r : 0; lo <= hi;) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (UTILS::circle_y(r, mid) >= mid + 3) {
+      x_safe = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  std::vector<std::pair<int64_t, int64_t>> tail;
+  int64_t y = walk ? UTILS::circle_y(r, x_safe) : -1;
+  int64_t D = walk ? UTILS::circle_d(r, x_safe, y) : 0;
+  for (int64_t x = x_safe; y >= x++;) {
+    if (D > 0) {
+      y--;
+      D += 4 * (x - y) + 10;
+    } else {
+      D += 4 * x + 6;
+    }
+    tail.push_back({x, y});
+  }
+
+  // Row offsets d with yc + d or yc - d inside the clip rectangle. When both
+  // ranges are non-empty yc is inside it and they span at most 2 * clip.h.
+  const int64_t y0 = clip.y;
+  const int64_t y1 = (int64_t)clip.y + clip.h - 1;
+  int64_t d_lo = (int64_t)r + 1, d_hi = -1;
+  for (auto [lo, hi] : {std::pair<int64_t, int64_t>{y0 - yc, y1 - yc},
+                        std::pair<int64_t, int64_t>{yc - y1, yc - y0}}) {
+    lo = std::max<int64_t>(lo, 0);
+    hi = std::min<int64_t>(hi, r);
+    if (lo <= hi) {
+      d_lo = std::min(d_lo, lo);
+      d_hi = std::max(d_hi, hi);
+    }
+  }
+
+  for (int64_t d = d_lo; d <= d_hi; d++) {
+    int64_t half_width = -1;
+    if (!walk) {
+      // (r - d) * (r + d) is below 2^62 for any int radius
+      const int64_t sq = (r - d) * (r + d);
+      half_width = (int64_t)std::sqrt((double)sq);
+      while (half_width * half_width > sq)
+        half_width--;
+      while ((half_width + 1) * (half_width + 1) <= sq)
+        half_width++;
+    } else {
+      if (d <= x_safe)
+        half_width = UTILS::circle_y(r, d);
+      int64_t x = first_x_below(0, x_safe + 1, d - 1) - 1;
+      if (x >= 0 && UTILS::circle_y(r, x) == d)
+        half_width = std::max(half_width, x);
+      for (auto [tx, ty] : tail) {
+        if (ty == d)
+          half_width = std::max(half_width, tx);
+        if (tx == d)
+          half_width = std::max(half_width, ty);
+      }
+    }
+    if (half_width < 0)
+      continue;
+    int x0 = (int)std::max<int64_t>(xc - half_width, INT_MIN);
+    int x1 = (int)std::min<int64_t>(xc + half_width, INT_MAX);
+    if (yc + d <= y1)
+      FillSpan(x0, x1, (int)(yc + d), color, clip);
+    if (d != 0 && yc - d >= y0)
+      FillSpan(x0, x1, (int)(yc - d), color, clip);
+  }
+}
+
+void BMP::Bitmap::DrawTriangle(const int &x1, const int &y1, const int &x2,
+                               const int &y2, const int &x3, const int &y3,
+                               const Color &color) {
+  DrawTriangle(x1, y1, x2, y2, x3, y3, color, Bounds());
+}
+
+void BMP::Bitmap::DrawTriangle(const int &x1, const int &y1, const int &x2,
+                               const int &y2, const int &x3, const int &y3,
+                               const Color &color, const Rect &clip) {
+  BMP_DRAW(TRIANGLE, "Bitmap::DrawTriangle");
+  DrawLine(x1, y1, x2, y2, color, clip);
+  DrawLine(x1, y1, x3, y3, color, clip);
+  DrawLine(x2, y2, x3, y3, color, clip);
+}
+
+void BMP::Bitmap::FillTriangle(const int &x1, const int &y1, const int &x2,
+                               const int &y2, const int &x3, const int &y3,
+                               const Color &color) {
+  FillTriangle(Vertex{x1, y1}, Vertex{x2, y2}, Vertex{x3, y3}, color);
+}
+
+void BMP::Bitmap::DrawLine(const Vertex &vStart, const Vertex &vEnd,
+                           const Color &color) {
+  DrawLine(vStart.x, vStart.y, vEnd.x, vEnd.y, color);
+}
+
+void BMP::Bitmap::DrawRect(const Vertex &vTopLeft, const Vertex &vSize,
+                           const Color &color) {
+  DrawRect(vTopLeft.x, vTopLeft.y, vSize.x, vSize.y, color);
+}
+
+void BMP::Bitmap::FillRect(const Vertex &vTopLeft, const Vertex &vSize,
+                           const Color &color) {
+  FillRect(vTopLeft.x, vTopLeft.y, vSize.x, vSize.y, color);
+}
+
+void BMP::Bitmap::DrawCircle(const Vertex &vCenter, const int &r,
+                             const Color &color) {
+  DrawCircle(vCenter.x, vCenter.y, r, color);
+}
+
+void BMP::Bitmap::FillCircle(const Vertex &vCenter, const int &r,
+                             const Color &color) {
+  FillCircle(vCenter.x, vCenter.y, r, color);
+}
+
+void BMP::Bitmap::DrawTriangle(const Vertex &v1, const Vertex &v2,
+                               const Vertex &v3, const Color &color) {
+  DrawTriangle(v1.x, v1.y, v2.x, v2.y, v3.x, v3.y, color);
+}
+
+void BMP::Bitmap::FillTriangle(Vertex v1, Vertex v2, Vertex v3,
+                               const Color &color) {
+  FillTriangle(v1, v2, v3, color, Bounds());
+}
+
+void BMP::Bitmap::FillTriangle(Vertex v1, Vertex v2, Vertex v3,
+                               const Color &color, const Rect &clip) {
+  BMP_DRAW(TRIANGLE, "Bitmap::FillTriangle");
+  if (v2.y < v1.y)
+    std::swap(v1, v2);
+  if (v3.y < v1.y)
+    std::swap(v1, v3);
+  if (v3.y < v2.y)
+    std::swap(v2, v3);
+
+  int h = (int)info_header.height;
+
+  // Nothing to draw when the bounding box misses the clip rectangle
+  if (std::max({v1.x, v2.x, v3.x}) < clip.x ||
+      std::min({v1.x, v2.x, v3.x}) >= clip.x + clip.w || v3.y < clip.y ||
+      v1.y >= clip.y + clip.h)
+    return;
+
+  // The edge walks below only record the extent of every visible row between
+  // v1.y and v3.y, the rows are filled once at the end
+  const int y_first = std::max(v1.y, clip.y);
+  const int y_last = std::min(v3.y, clip.y + clip.h - 1);
+  std::vector<std::pair<int, int>> spans((size_t)(y_last - y_first) + 1,
+                                         {INT_MAX, INT_MIN});
+  auto add_span = [&](const int &xa, const int &xb, const int &y) {
+    if (y < y_first || y > y_last)
+      return;
+    auto &span = spans[(size_t)(y - y_first)];
+    span.first = std::min({span.first, xa, xb});
+    span.second = std::max({span.second, xa, xb});
+  };
+
+  auto fill_top_triangle = [&](const Vertex &v1, const Vertex &v2,
+                               const Vertex &v3, bool top = true) {
+    // v1.y <= v2.y <= v3.y
+    int dy1 = v2.y - v1.y;
+    int dy2 = v3.y - v1.y;
+    int dx1 = v2.x - v1.x;
+    int dx2 = v3.x - v1.x;
+
+    bool steep1 = false;
+    bool steep2 = false;
+    if (abs(dx1) < dy1)
+      steep1 = true;
+    if (abs(dx2) < dy2)
+      steep2 = true;
+
+    int x_inc1 = 1;
+    int x_inc2 = 1;
+    if (dx1 < 0) {
+      x_inc1 = -1;
+      dx1 = -dx1;
+    }
+    if (dx2 < 0) {
+      x_inc2 = -1;
+      dx2 = -dx2;
+    }
+    int curr_x1 = v1.x;
+    int curr_y1 = v1.y;
+    int curr_x2 = v1.x;
+    int curr_y2 = v1.y;
+
+    int D1 = steep1 ? 2 * dx1 - dy1 : 2 * dy1 - dx1;
+    int D2 = steep2 ? 2 * dx2 - dy2 : 2 * dy2 - dx2;
+    int D1_inc1 = steep1 ? 2 * (dx1 - dy1) : 2 * (dy1 - dx1);
+    int D2_inc1 = steep2 ? 2 * (dx2 - dy2) : 2 * (dy2 - dx2);
+    int D1_inc2 = steep1 ? 2 * dx1 : 2 * dy1;
+    int D2_inc2 = steep2 ? 2 * dx2 : 2 * dy2;
+    while (curr_y1 < v2.y || curr_y2 < v2.y) {
+      if (curr_y1 <= curr_y2) {
+        if (D1 > 0) {
+          D1 += D1_inc1;
+          if (steep1)
+            curr_x1 += x_inc1;
+          else
+            curr_y1++;
+        } else {
+          D1 += D1_inc2;
+        }
+        if (steep1)
+          curr_y1++;
+        else
+          curr_x1 += x_inc1;
+      }
+      if (curr_y2 < curr_y1) {
+        if (D2 > 0) {
+          D2 += D2_inc1;
+          if (steep2)
+            curr_x2 += x_inc2;
+          else
+            curr_y2++;
+        } else {
+          D2 += D2_inc2;
+        }
+        if (steep2)
+          curr_y2++;
+        else
+          curr_x2 += x_inc2;
+      }
+      if (curr_y1 == curr_y2) {
+        if (top)
+          add_span(curr_x1, curr_x2, curr_y1);
+        else // bottom
+          add_span(curr_x1, curr_x2, h - curr_y1 - 1);
+      }
+    }
+  };
+
+  auto fill_bottom_triangle = [&](const Vertex &v1, const Vertex &v2,
+                                  const Vertex &v3) {
+    fill_top_triangle(Vertex{v3.x, h - v3.y - 1}, Vertex{v2.x, h - v2.y - 1},
+                      Vertex{v1.x, h - v1.y - 1}, false);
+  };
+
+  fill_top_triangle(v1, v2, v3);
+  fill_bottom_triangle(v1, v2, v3);
+
+  for (size_t i = 0; i < spans.size(); i++)
+    if (spans[i].first <= spans[i].second)
+      FillSpan(spans[i].first, spans[i].second, y_first + (int)i, color,
+               clip);
+}
+
+void Bitmap::FillTriangles(std::span<const Triangle> triangles) {
+  BMP_DRAW(TRIANGLE, "Bitmap::FillTriangles");
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    for (const Triangle &tri : triangles)
+      RasterizeTriangle<PF>(tri);
+  });
+}
+
+template <class PixelFormat>
+void Bitmap::RasterizeTriangle(const Triangle &tri) {
+  const int64_t limit = int64_t(1) << 29;
+  for (const Vertex &v : {tri.v1, tri.v2, tri.v3})
+    if (std::abs((int64_t)v.x) > limit || std::abs((int64_t)v.y) > limit) {
+      FillTriangle(tri.v1, tri.v2, tri.v3, tri.color);
+      return;
+    }
+
+  // Orient counterclockwise so that the inside is where all edge functions
+  // are positive, degenerate triangles cover nothing
+  Vertex a = tri.v1, b = tri.v2, c = tri.v3;
+  int64_t area = (int64_t)(b.x - a.x) * (c.y - a.y) -
+                 (int64_t)(b.y - a.y) * (c.x - a.x);
+  if (area == 0)
+    return;
+  if (area < 0)
+    std::swap(b, c);
+
+  // Pixel (x, y) is sampled at its center (x + 0.5, y + 0.5), so the pixels
+  // that can be covered are [min, max) of the vertex coordinates
+  int64_t x_begin = std::max<int64_t>(std::min({a.x, b.x, c.x}), 0);
+  int64_t y_begin = std::max<int64_t>(std::min({a.y, b.y, c.y}), 0);
+  int64_t x_end = std::min<int64_t>(std::max({a.x, b.x, c.x}), Width());
+  int64_t y_end = std::min<int64_t>(std::max({a.y, b.y, c.y}), Height());
+  if (x_begin >= x_end || y_begin >= y_end)
+    return;
+
+  // Edge functions in doubled coordinates so pixel centers are integers:
+  // E(x, y) = e0 + x * dx + y * dy, the pixel is inside when E >= 0 for all
+  // three edges. Edges that are not top-left have 1 subtracted, which turns
+  // E > 0 into E >= 0 and excludes centers lying exactly on them.
+  struct Edge {
+    int64_t e0, dx, dy;
+    int64_t At(int64_t x, int64_t y) const { return e0 + x * dx + y * dy; }
+  };
+  auto make_edge = [](const Vertex &p, const Vertex &q) {
+    int64_t ex = (int64_t)q.x - p.x;
+    int64_t ey = (int64_t)q.y - p.y;
+    bool top_left = ey < 0 || (ey == 0 && ex < 0);
+    return Edge{ex * (1 - 2 * (int64_t)p.y) - ey * (1 - 2 * (int64_t)p.x) -
+                    (top_left ? 0 : 1),
+                -2 * ey, 2 * ex};
+  };
+  const Edge edges[3] = {make_edge(a, b), make_edge(b, c), make_edge(c, a)};
+
+  // Evaluate 8 lanes in 32-bit integers when every value within a block of the
+  // bounding box fits, otherwise fall back to 64-bit scalar evaluation
+  bool fits32 = true;
+  for (const Edge &e : edges)
+    for (int64_t x : {x_begin - 8, x_end + 8})
+      for (int64_t y : {y_begin - 8, y_end + 8})
+        fits32 = fits32 && std::abs(e.At(x, y)) < (int64_t(1) << 29);
+  alignas(32) int32_t steps[3][8];
+  if (fits32)
+    for (int i = 0; i < 3; i++)
+      for (int lane = 0; lane < 8; lane++)
+        steps[i][lane] = (int32_t)(edges[i].dx * lane);
+
+  // Bit i is set if pixel (x + i, y) is inside, for i < 8
+  auto coverage = [&](int64_t x, int64_t y) -> uint32_t {
+    if (!fits32) {
+      uint32_t mask = 0;
+      for (int lane = 0; lane < 8; lane++)
+        if (edges[0].At(x + lane, y) >= 0 && edges[1].At(x + lane, y) >= 0 &&
+            edges[2].At(x + lane, y) >= 0)
+          mask |= 1u << lane;
+      return mask;
+    }
+    int32_t e[3];
+    for (int i = 0; i < 3; i++)
+      e[i] = (int32_t)edges[i].At(x, y);
+#if defined(BMP_AVX2)
+    __m256i outside = _mm256_setzero_si256();
+    for (int i = 0; i < 3; i++)
+      outside = _mm256_or_si256(
+          outside,
+          _mm256_add_epi32(_mm256_set1_epi32(e[i]),
+                           _mm256_load_si256((const __m256i *)steps[i])));
+    return ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xFF;
+#elif defined(BMP_SSE2)
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    for (int i = 0; i < 3; i++) {
+      __m128i ei = _mm_set1_epi32(e[i]);
+      lo = _mm_or_si128(
+          lo, _mm_add_epi32(ei, _mm_load_si128((const __m128i *)steps[i])));
+      hi = _mm_or_si128(
+          hi,
+          _mm_add_epi32(ei, _mm_load_si128((const __m128i *)(steps[i] + 4))));
+    }
+    uint32_t outside = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(lo)) |
+                       (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+    return ~outside & 0xFF;
+#else
+    uint32_t mask = 0;
+    for (int lane = 0; lane < 8; lane++)
+      if (((e[0] + steps[0][lane]) | (e[1] + steps[1][lane]) |
+           (e[2] + steps[2][lane])) >= 0)
+        mask |= 1u << lane;
+    return mask;
+#endif
+  };
+
+  // Walk 8x8 blocks aligned to the image grid. Classifying a whole aligned
+  // block is conservative for the part of it inside the bounding box. The
+  // covered pixels of a row are contiguous since the triangle is convex, so
+  // blocks only widen the span of their rows and each row is filled once per
+  // block row.
+  int64_t lo_offset[3], hi_offset[3];
+  for (int i = 0; i < 3; i++) {
+    // The edge functions are linear, so their extremes over a block are at
+    // its corners
+    int64_t ox = edges[i].dx * 7, oy = edges[i].dy * 7;
+    lo_offset[i] = std::min<int64_t>(ox, 0) + std::min<int64_t>(oy, 0);
+    hi_offset[i] = std::max<int64_t>(ox, 0) + std::max<int64_t>(oy, 0);
+  }
+  const int64_t bx_begin = x_begin & ~int64_t(7);
+  uint64_t written = 0;
+  for (int64_t by = y_begin & ~int64_t(7); by < y_end; by += 8) {
+    const int64_t y0 = std::max(by, y_begin);
+    const int64_t y1 = std::min(by + 8, y_end);
+    int64_t full_first = INT64_MAX, full_last = INT64_MIN;
+    int64_t first[8], last[8];
+    std::fill(first, first + 8, INT64_MAX);
+    std::fill(last, last + 8, INT64_MIN);
+
+    int64_t base[3];
+    for (int i = 0; i < 3; i++)
+      base[i] = edges[i].At(bx_begin, by);
+    for (int64_t bx = bx_begin; bx < x_end; bx += 8) {
+      bool empty = false;
+      bool full = true;
+      for (int i = 0; i < 3; i++) {
+        empty |= base[i] + hi_offset[i] < 0;
+        full &= base[i] + lo_offset[i] >= 0;
+      }
+      for (int i = 0; i < 3; i++)
+        base[i] += 8 * edges[i].dx;
+      if (empty)
+        continue;
+
+      const int64_t x0 = std::max(bx, x_begin);
+      const int64_t x1 = std::min(bx + 8, x_end);
+      if (full) {
+        full_first = std::min(full_first, x0);
+        full_last = x1 - 1;
+        continue;
+      }
+
+      // Partially covered, test 8 pixels per row at a time
+      const uint32_t valid = ((1u << (x1 - x0)) - 1) << (x0 - bx);
+      for (int64_t y = y0; y < y1; y++) {
+        uint32_t mask = coverage(bx, y) & valid;
+        if (mask == 0)
+          continue;
+        first[y - by] = std::min(first[y - by], bx + std::countr_zero(mask));
+        last[y - by] =
+            std::max(last[y - by], bx + 31 - std::countl_zero(mask));
+      }
+    }
+
+    for (int64_t y = y0; y < y1; y++) {
+      int64_t x0 = std::min(first[y - by], full_first);
+      int64_t x1 = std::max(last[y - by], full_last);
+      if (x0 <= x1) {
+        PutPixels<PixelFormat>(Row((uint32_t)y) + x0 * PixelFormat::channels,
+                                (size_t)(x1 - x0 + 1), tri.color);
+        written += (uint64_t)(x1 - x0 + 1);
+      }
+    }
+  }
+  BMP_COUNT_PIXELS(TRIANGLE, written, 0);
+}
+
+void Bitmap::Composite(const Bitmap &src, int x, int y, BLEND_MODE mode) {
+  BMP_DRAW(BLIT, "Bitmap::Composite");
+  const int64_t x0 = std::max<int64_t>(x, 0);
+  const int64_t y0 = std::max<int64_t>(y, 0);
+  const int64_t x1 = std::min<int64_t>((int64_t)x + src.Width(), Width());
+  const int64_t y1 = std::min<int64_t>((int64_t)y + src.Height(), Height());
+  const uint64_t area = (uint64_t)src.Width() * src.Height();
+  if (x0 >= x1 || y0 >= y1) {
+    BMP_COUNT_PIXELS(BLIT, 0, area);
+    return;
+  }
+  BMP_COUNT_PIXELS(BLIT, (x1 - x0) * (y1 - y0), area - (x1 - x0) * (y1 - y0));
+  const uint32_t w = (uint32_t)(x1 - x0);
+  Unshare();
+  VisitPixelFormat(src.bit_depth, [&](auto src_format) {
+    VisitPixelFormat(bit_depth, [&](auto dst_format) {
+      using SrcFormat = decltype(src_format);
+      using DstFormat = decltype(dst_format);
+      constexpr bool wide_src = std::is_same_v<SrcFormat, BGRA32>;
+      constexpr bool wide_dst = std::is_same_v<DstFormat, BGRA32>;
+      ForEachRowBand((uint32_t)(y1 - y0), Stride(), [&](uint32_t r0,
+                                                        uint32_t r1) {
+        // 24-bit rows are widened to BGRA32 for the kernel
+        std::vector<uint8_t> src_row(wide_src ? 0 : 4 * (size_t)w);
+        std::vector<uint8_t> dst_row(wide_dst ? 0 : 4 * (size_t)w);
+        for (uint32_t r = r0; r < r1; r++) {
+          const uint8_t *s = src.Row((uint32_t)(y0 - y + r)) +
+                             (size_t)(x0 - x) * SrcFormat::channels;
+          uint8_t *d = Row((uint32_t)(y0 + r)) + x0 * DstFormat::channels;
+          if constexpr (!wide_src) {
+            ConvertPixels<SrcFormat, BGRA32>(s, src_row.data(), w);
+            s = src_row.data();
+          }
+          if constexpr (wide_dst) {
+            BlendPixels(d, s, w, mode);
+          } else {
+            ConvertPixels<DstFormat, BGRA32>(d, dst_row.data(), w);
+            BlendPixels(dst_row.data(), s, w, mode);
+            ConvertPixels<BGRA32, DstFormat>(dst_row.data(), d, w);
+          }
+        }
+      });
+    });
+  });
+}
+
+void Bitmap::Blit(const Bitmap &src, const Rect &src_rect,
+                  const Vertex &dst_pos) {
+  BMP_DRAW(BLIT, "Bitmap::Blit");
+  // Clips the source range to src and the destination range to this image,
+  // moving both starts by the same amount
+  auto clip = [](int64_t &s, int64_t &d, int64_t &n, int64_t s_size,
+                 int64_t d_size) {
+    const int64_t skip = std::max<int64_t>({0, -s, -d});
+    s += skip;
+    d += skip;
+    n = std::min({n - skip, s_size - s, d_size - d});
+  };
+  int64_t sx = src_rect.x, sy = src_rect.y, w = src_rect.w;
+  int64_t dx = dst_pos.x, dy = dst_pos.y, h = src_rect.h;
+  clip(sx, dx, w, src.Width(), Width());
+  clip(sy, dy, h, src.Height(), Height());
+  const int64_t area =
+      (int64_t)std::max(src_rect.w, 0) * std::max(src_rect.h, 0);
+  if (w <= 0 || h <= 0 || !src.HasPixels() || !HasPixels()) {
+    BMP_COUNT_PIXELS(BLIT, 0, area);
+    return;
+  }
+  BMP_COUNT_PIXELS(BLIT, w * h, area - w * h);
+
+  // Before taking any pointers, src may be this image
+  Unshare();
+  const size_t src_bytes = (size_t)w * src.Channels();
+  const size_t dst_bytes = (size_t)w * Channels();
+  const uint8_t *src_first = src.Row((uint32_t)sy) + sx * src.Channels();
+  const uint8_t *src_last =
+      src.Row((uint32_t)(sy + h - 1)) + sx * src.Channels() + src_bytes;
+  const uint8_t *dst_first = Row((uint32_t)dy) + dx * Channels();
+  const uint8_t *dst_last =
+      Row((uint32_t)(dy + h - 1)) + dx * Channels() + dst_bytes;
+  if ((uintptr_t)src_first < (uintptr_t)dst_last &&
+      (uintptr_t)dst_first < (uintptr_t)src_last) {
+    // Only views of the same pixels overlap, and those share bit depth and
+    // stride. Rows are moved in the order that reads each before it is
+    // overwritten.
+    const bool backwards = (uintptr_t)dst_first > (uintptr_t)src_first;
+    for (int64_t i = 0; i < h; i++) {
+      const int64_t r = backwards ? h - 1 - i : i;
+      memmove(Row((uint32_t)(dy + r)) + dx * Channels(),
+              src.Row((uint32_t)(sy + r)) + sx * src.Channels(), dst_bytes);
+    }
+    return;
+  }
+
+  VisitPixelFormat(src.bit_depth, [&](auto src_format) {
+    VisitPixelFormat(bit_depth, [&](auto dst_format) {
+      using SrcFormat = decltype(src_format);
+      using DstFormat = decltype(dst_format);
+      ForEachRowBand((uint32_t)h, Stride(), [&](uint32_t r0, uint32_t r1) {
+        for (uint32_t r = r0; r < r1; r++)
+          ConvertPixels<SrcFormat, DstFormat>(
+              src.Row((uint32_t)(sy + r)) + sx * SrcFormat::channels,
+              Row((uint32_t)(dy + r)) + dx * DstFormat::channels,
+              (uint32_t)w);
+      });
+    });
+  });
+}
+
+Bitmap Bitmap::SubView(int x, int y, int w, int h) {
+  const int64_t x0 = std::clamp<int64_t>(x, 0, Width());
+  const int64_t y0 = std::clamp<int64_t>(y, 0, Height());
+  const int64_t x1 =
+      std::clamp<int64_t>((int64_t)x + std::max(w, 0), x0, Width());
+  const int64_t y1 =
+      std::clamp<int64_t>((int64_t)y + std::max(h, 0), y0, Height());
+  Bitmap sub;
+  sub.file_header = file_header;
+  sub.info_header = info_header;
+  sub.filename = filename;
+  sub.bit_depth = bit_depth;
+  sub.blend_mode = blend_mode;
+  sub.info_header.width = (uint32_t)(x1 - x0);
+  sub.info_header.height = (uint32_t)(y1 - y0);
+  // Headers describe the view as written to a file
+  const uint32_t size =
+      UTILS::row_stride(sub.Width(), info_header.bits_per_pixel) *
+      sub.Height();
+  if (info_header.image_size != 0)
+    sub.info_header.image_size = size;
+  sub.file_header.file_size = file_header.offset_data + size;
+  if (HasPixels() && x1 > x0 && y1 > y0) {
+    sub.view = Row((uint32_t)y0) + x0 * Channels();
+    sub.view_stride = Stride();
+    sub.view_pin = view ? view_pin : PixelBuffer::Pin(vec_pixels);
+  }
+  return sub;
+}
+
+void Bitmap::Convolve(std::span<const float> kernel_x,
+                      std::span<const float> kernel_y) {
+  if (!HasPixels())
+    return;
+  BMP_TRACE("Bitmap::Convolve");
+  if (!kernel_x.empty())
+    ConvolveRows(kernel_x);
+  if (!kernel_y.empty())
+    ConvolveColumns(kernel_y);
+}
+
+void Bitmap::BoxBlur(int radius, int passes) {
+  if (!HasPixels() || radius <= 0)
+    return;
+  BMP_TRACE("Bitmap::BoxBlur");
+  for (int i = 0; i < passes; i++)
+    BoxBlurRows(radius);
+  for (int i = 0; i < passes; i++)
+    BoxBlurColumns(radius);
+}
+
+void Bitmap::GaussianBlur(double sigma) {
+  if (!HasPixels() || !(sigma > 0))
+    return;
+  BMP_TRACE("Bitmap::GaussianBlur");
+  // Widths wl and wl + 2 of the three boxes, m of them wl wide
+  const double var = 12 * sigma * sigma;
+  int wl = (int)std::sqrt(var / 3 + 1);
+  if (wl % 2 == 0)
+    wl--;
+  const int m = (int)std::lround((var - 3.0 * wl * wl - 12.0 * wl - 9) /
+                                 (-4.0 * wl - 4));
+  for (int i = 0; i < 3; i++)
+    if (int r = (i < m ? wl : wl + 2) / 2; r > 0)
+      BoxBlurRows(r);
+  for (int i = 0; i < 3; i++)
+    if (int r = (i < m ? wl : wl + 2) / 2; r > 0)
+      BoxBlurColumns(r);
+}
+
+void Bitmap::BoxBlurRows(int radius) {
+  const uint32_t w = Width();
+  const size_t r = (size_t)radius;
+  const uint32_t d = 2 * (uint32_t)radius + 1;
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    constexpr size_t ch = decltype(format)::channels;
+    ForEachRow([&](uint32_t y0, uint32_t y1) {
+      std::vector<uint8_t> ext((w + 2 * r) * ch + 1);
+      std::vector<uint32_t> sums((size_t)w * ch + 1);
+      for (uint32_t y = y0; y < y1; y++) {
+        uint8_t *row = Row(y);
+        // The row with radius copies of the edge pixels on both sides
+        for (size_t p = 0; p < r; p++) {
+          memcpy(&ext[p * ch], row, ch);
+          memcpy(&ext[(r + w + p) * ch], row + (size_t)(w - 1) * ch, ch);
+        }
+        memcpy(&ext[r * ch], row, (size_t)w * ch);
+        WindowSums<ch>(ext.data(), sums.data(), w, d);
+        DivideSums(sums.data(), row, (size_t)w * ch, d);
+      }
+    });
+  });
+}
+
+void Bitmap::BoxBlurColumns(int radius) {
+  const int64_t h = Height();
+  const int64_t r = radius;
+  const uint32_t d = 2 * (uint32_t)radius + 1;
+  const size_t row_bytes = (size_t)Width() * Channels();
+  // The input rows of the window are kept in a ring, so the columns can be
+  // written in place. The window spans at most 2 radius + 2 distinct rows.
+  const size_t slots = (size_t)std::min<int64_t>(2 * r + 2, h);
+  Unshare();
+  ForEachColumnStrip(row_bytes, slots + 4, [&](size_t x0, size_t x1) {
+    const size_t n = x1 - x0;
+    std::vector<uint8_t> ring(slots * n);
+    std::vector<uint32_t> sums(n, 0);
+    int64_t loaded = 0;
+    auto clamp = [&](int64_t y) { return std::clamp<int64_t>(y, 0, h - 1); };
+    auto slot = [&](int64_t y) { return &ring[(size_t)(y % slots) * n]; };
+    auto load_to = [&](int64_t y) {
+      for (; loaded <= y; loaded++)
+        memcpy(slot(loaded), Row((uint32_t)loaded) + x0, n);
+    };
+
+    // Window of row 0: the first row r + 1 times, rows 1 to r and the last
+    // row once more for every row of the window past the bottom edge
+    load_to(std::min(r, h - 1));
+    for (int64_t y = 0; y <= std::min(r, h - 1); y++) {
+      const int64_t times = (y == 0 ? r + 1 : 1) + (y == h - 1 ? r - y : 0);
+      const uint8_t *src = slot(y);
+      for (size_t i = 0; i < n; i++)
+        sums[i] += (uint32_t)times * src[i];
+    }
+
+    for (int64_t y = 0; y < h; y++) {
+      load_to(clamp(y + r + 1));
+      DivideSums(sums.data(), Row((uint32_t)y) + x0, n, d);
+      if (y + 1 < h)
+        SlideSums(sums.data(), slot(clamp(y + r + 1)), slot(clamp(y - r)), n);
+    }
+  });
+}
+
+void Bitmap::ConvolveRows(std::span<const float> kernel) {
+  const uint32_t w = Width();
+  const size_t len = kernel.size();
+  const int64_t c = (int64_t)len / 2;
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    constexpr size_t ch = decltype(format)::channels;
+    ForEachRow([&](uint32_t y0, uint32_t y1) {
+      // The row as floats, extended by copies of the edge pixels, tap j
+      // reads it j pixels further on
+      std::vector<float> ext((w + len - 1) * ch);
+      std::vector<const float *> taps(len);
+      for (size_t j = 0; j < len; j++)
+        taps[j] = ext.data() + j * ch;
+      for (uint32_t y = y0; y < y1; y++) {
+        uint8_t *row = Row(y);
+        for (size_t p = 0; p < w + len - 1; p++) {
+          const uint8_t *px =
+              row + std::clamp<int64_t>((int64_t)p - c, 0, w - 1) * ch;
+          for (size_t i = 0; i < ch; i++)
+            ext[p * ch + i] = px[i];
+        }
+        ConvolveTaps(taps.data(), kernel.data(), len, row, (size_t)w * ch);
+      }
+    });
+  });
+}
+
+void Bitmap::ConvolveColumns(std::span<const float> kernel) {
+  const int64_t h = Height();
+  const size_t len = kernel.size();
+  const int64_t c = (int64_t)len / 2;
+  const size_t row_bytes = (size_t)Width() * Channels();
+  // Ring of the input rows under the kernel, as floats
+  const size_t slots = (size_t)std::min<int64_t>((int64_t)len, h);
+  Unshare();
+  ForEachColumnStrip(row_bytes, 4 * slots, [&](size_t x0, size_t x1) {
+    const size_t n = x1 - x0;
+    std::vector<float> ring(slots * n);
+    std::vector<const float *> taps(len);
+    int64_t loaded = 0;
+    auto slot = [&](int64_t y) { return &ring[(size_t)(y % slots) * n]; };
+    for (int64_t y = 0; y < h; y++) {
+      for (; loaded <= std::min(y - c + (int64_t)len - 1, h - 1); loaded++) {
+        const uint8_t *src = Row((uint32_t)loaded) + x0;
+        float *dst = slot(loaded);
+        for (size_t i = 0; i < n; i++)
+          dst[i] = src[i];
+      }
+      for (size_t j = 0; j < len; j++)
+        taps[j] = slot(std::clamp<int64_t>(y - c + (int64_t)j, 0, h - 1));
+      ConvolveTaps(taps.data(), kernel.data(), len, Row((uint32_t)y) + x0, n);
+    }
+  });
+}
+
+Bitmap Bitmap::Resize(uint32_t w, uint32_t h, RESIZE_FILTER filter) const {
+  BMP_TRACE("Bitmap::Resize");
+  Bitmap out(filename.c_str(), w, h, bit_depth == BIT_DEPTH::BD_32, uninitialized,
+             vec_pixels.GetPool());
+  if (!HasPixels() || out.vec_pixels.empty() || Width() == 0 ||
+      Height() == 0) {
+    std::fill(out.vec_pixels.begin(), out.vec_pixels.end(), 0);
+    return out;
+  }
+  const ResampleWeights wx = MakeResampleWeights(Width(), w, filter);
+  const ResampleWeights wy = MakeResampleWeights(Height(), h, filter);
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    constexpr size_t ch = decltype(format)::channels;
+    if (filter == RESIZE_FILTER::NEAREST) {
+      out.ForEachRow([&](uint32_t y0, uint32_t y1) {
+        for (uint32_t y = y0; y < y1; y++) {
+          const uint8_t *src = Row(wy.first[y]);
+          uint8_t *dst = out.Row(y);
+          for (uint32_t x = 0; x < w; x++)
+            memcpy(dst + x * ch, src + (size_t)wx.first[x] * ch, ch);
+        }
+      });
+      return;
+    }
+
+    const size_t row_floats = (size_t)w * ch + 1;
+    out.ForEachRow([&](uint32_t y0, uint32_t y1) {
+      // The source rows under the band, resampled horizontally. Neighbouring
+      // bands share the few rows under their edge.
+      const uint32_t r0 = wy.first[y0];
+      const uint32_t r1 = wy.first[y1 - 1] + wy.taps;
+      std::vector<float> rows((size_t)(r1 - r0) * row_floats);
+      for (uint32_t r = r0; r < r1; r++)
+        ResampleRow<ch>(Row(r), &rows[(size_t)(r - r0) * row_floats], wx);
+      std::vector<const float *> taps(wy.taps);
+      for (uint32_t y = y0; y < y1; y++) {
+        for (uint32_t j = 0; j < wy.taps; j++)
+          taps[j] = &rows[(size_t)(wy.first[y] + j - r0) * row_floats];
+        ConvolveTaps(taps.data(), &wy.weights[(size_t)y * wy.taps], wy.taps,
+                     out.Row(y), (size_t)w * ch);
+      }
+    });
+  });
+  return out;
+}
+
+Color Bitmap::GetPixelColor(const int &x, const int &y) const {
+  int w = (int)info_header.width;
+  int h = (int)info_header.height;
+  if (x < 0 || y < 0 || x >= w || y >= h) {
+    std::cout << "Error: Pixel (" << x << ", " << y << ") is out of bounds.\n";
+    std::cout << "Dimensions are (width, height) = (" << info_header.width
+              << ", " << info_header.height << ")\n";
+    return Color{0, 0, 0};
+  }
+
+  return GetPixelUnchecked(x, y);
+}
+
+Color Bitmap::GetPixelUnchecked(int x, int y) const {
+  return VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    return PF::Load(Row(y) + (size_t)x * PF::channels);
+  });
+}
+
+void Bitmap::LoadFromByteArray(uint8_t *data, int n) {
+  view = nullptr;
+  view_stride = 0;
+  view_pin = {};
+  vec_pixels.assign(data, data + n);
+}
+
+template <class PixelFormat>
+BasicBitmap<PixelFormat>::BasicBitmap(const char *fn, const uint32_t &w,
+                                      const uint32_t &h, BitmapPool *pool)
+    : BasicBitmap(fn, w, h, uninitialized, pool) {
+  std::fill(vec_pixels.begin(), vec_pixels.end(), 0);
+}
+
+template <class PixelFormat>
+BasicBitmap<PixelFormat>::BasicBitmap(const char *fn, const uint32_t &w,
+                                      const uint32_t &h, Uninitialized,
+                                      BitmapPool *pool)
+    : BasicBitmap() {
+  filename = fn ? fn : "";
+  info_header.width = w;
+  info_header.height = h;
+  stride = RowStride<PixelFormat>(w);
+  vec_pixels = PixelBuffer(pool);
+  vec_pixels.resize((size_t)stride * h, uninitialized);
+  const size_t used = (size_t)w * PixelFormat::channels;
+  if (used < stride)
+    for (uint32_t y = 0; y < h; y++)
+      memset(Row(y) + used, 0, stride - used);
+  file_header.file_size = file_header.offset_data + (uint32_t)vec_pixels.size();
+}
+
+template <class PixelFormat>
+BasicBitmap<PixelFormat>::BasicBitmap(const Bitmap &bmp) : BasicBitmap() {
+  Assign(bmp);
+}
+
+template <class PixelFormat>
+BasicBitmap<PixelFormat>::BasicBitmap(Bitmap &&bmp) : BasicBitmap() {
+  if (bmp.GetBitDepth() != bit_depth || bmp.IsView()) {
+    Assign(bmp);
+    return;
+  }
+  // Same layout, take over the pixels
+  PixelBuffer pixels = std::move(bmp.vec_pixels);
+  bmp.vec_pixels.clear();
+  Assign(bmp);
+  vec_pixels = std::move(pixels);
+}
+
+template <class PixelFormat>
+void BasicBitmap<PixelFormat>::Assign(const Bitmap &bmp) {
+  file_header = bmp.file_header;
+  info_header = bmp.info_header;
+  filename = bmp.filename;
+  info_header.bits_per_pixel = PixelFormat::bits_per_pixel;
+  stride = RowStride<PixelFormat>(Width());
+  file_header.file_size =
+      file_header.offset_data + (uint32_t)((size_t)stride * Height());
+  if (bmp.vec_pixels.empty() && !bmp.IsView())
+    return;
+
+  if (bmp.GetBitDepth() == bit_depth && !bmp.IsView()) {
+    vec_pixels = bmp.vec_pixels;
+  } else {
+    // Different layout or rows of a view, convert row by row in parallel
+    // bands
+    vec_pixels.assign((size_t)stride * Height(), 0);
+    VisitPixelFormat(bmp.GetBitDepth(), [&](auto format) {
+      using SrcFormat = decltype(format);
+      ForEachRow([&](uint32_t y0, uint32_t y1) {
+        for (uint32_t y = y0; y < y1; y++)
+          ConvertPixels<SrcFormat, PixelFormat>(
+              bmp.Row(y), &vec_pixels[(size_t)y * stride], Width());
+      });
+    });
+  }
+}
+
+template <class PixelFormat> bool BasicBitmap<PixelFormat>::Read(const char *fn) {
+  Bitmap bmp;
+  if (!bmp.Read(fn))
+    return false;
+  std::string name = std::move(filename);
+  *this = BasicBitmap(std::move(bmp));
+  filename = std::move(name);
+  return true;
+}
+
+template <class PixelFormat>
+bool BasicBitmap<PixelFormat>::Write(const char *fn) const {
+  BMP_TRACE("BasicBitmap::Write");
+  if (UTILS::write_bitmap(fn, file_header, info_header, vec_pixels.data(),
+                          vec_pixels.size())) {
+    if (Verbose())
+      std::cout << "Bitmap saved to " << fn << "\n";
+    return true;
+  } else {
+    std::cout << "Failed to save " << fn << "\n";
+    return false;
+  }
+}
+
+template <class PixelFormat>
+Bitmap BasicBitmap<PixelFormat>::ToBitmap() const {
+  constexpr bool alpha = PixelFormat::alpha >= 0;
+  Bitmap bmp(filename.c_str(), Width(), Height(), alpha, uninitialized,
+             vec_pixels.GetPool());
+  using DstFormat = std::conditional_t<alpha, BGRA32, BGR24>;
+  const uint32_t dst_stride = RowStride<DstFormat>(Width());
+  bmp.ForEachRow([&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++)
+      ConvertPixels<PixelFormat, DstFormat>(
+          &vec_pixels[(size_t)y * stride],
+          &bmp.vec_pixels[(size_t)y * dst_stride], Width());
+  });
+  return bmp;
+}
+
+template <class PixelFormat>
+void BasicBitmap<PixelFormat>::Fill(const Color &color) {
+  const uint32_t w = Width();
+  ForEachRow([&](uint32_t y0, uint32_t y1) {
+    if (stride == w * PixelFormat::channels) {
+      FillPixels<PixelFormat>(Row(y0), (size_t)w * (y1 - y0), color);
+      return;
+    }
+    for (uint32_t y = y0; y < y1; y++)
+      FillPixels<PixelFormat>(Row(y), w, color);
+  });
+}
+
+template <class PixelFormat>
+Color BasicBitmap<PixelFormat>::GetPixelColor(const int &x,
+                                              const int &y) const {
+  if (x < 0 || y < 0 || x >= (int)Width() || y >= (int)Height()) {
+    std::cout << "Error: Pixel (" << x << ", " << y << ") is out of bounds.\n";
+    std::cout << "Dimensions are (width, height) = (" << Width() << ", "
+              << Height() << ")\n";
+    return Color{0, 0, 0};
+  }
+  return GetPixelUnchecked(x, y);
+}
+
+IndexedBitmap::IndexedBitmap(const char *fn, const uint32_t &w,
+                             const uint32_t &h, uint16_t bits,
+                             std::vector<Color> palette, BitmapPool *pool) {
+  filename = fn ? fn : "";
+  Create(w, h, bits, pool);
+  SetPalette(std::move(palette));
+}
+
+IndexedBitmap::IndexedBitmap(const Bitmap &bmp, uint16_t bits,
+                             DITHER dither) {
+  BMP_TRACE("IndexedBitmap::IndexedBitmap");
+  filename = bmp.filename;
+  const uint32_t w = bmp.Width();
+  const uint32_t h = bmp.Height();
+  Create(w, h, bits, bmp.vec_pixels.GetPool());
+  bits = BitsPerPixel();
+  if (!bmp.HasPixels())
+    return;
+  vec_pixels.data(); // Unshared before the rows are written in parallel
+
+  // Images with few enough colors keep them
+  std::vector<Color> colors;
+  std::vector<uint8_t> indices;
+  if (bmp.Palettize((size_t)1 << bits, colors, indices)) {
+    SetPalette(std::move(colors));
+    ForEachRowBand(h, Stride(), [&](uint32_t y0, uint32_t y1) {
+      for (uint32_t y = y0; y < y1; y++)
+        PackIndices(indices.data() + (size_t)y * w, bits, w, Row(y));
+    });
+    return;
+  }
+  SetPalette(Quantize(bmp, (size_t)1 << bits));
+
+  // Nearest palette entry of the center of every histogram bin
+  std::vector<std::array<float, 3>> colors_float;
+  for (const Color &c : palette)
+    colors_float.push_back({(float)c.red, (float)c.green, (float)c.blue});
+  const ColorSearch search(colors_float);
+  std::vector<uint8_t> nearest((size_t)1 << 15);
+  for (uint32_t bin = 0; bin < nearest.size(); bin++) {
+    const float center[3] = {(float)((bin >> 10) << 3 | 4),
+                             (float)((bin >> 5 & 31) << 3 | 4),
+                             (float)((bin & 31) << 3 | 4)};
+    nearest[bin] = (uint8_t)search.Nearest(center);
+  }
+
+  VisitPixelFormat(bmp.bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    if (dither == DITHER::NONE) {
+      ForEachRowBand(h, Stride(), [&](uint32_t y0, uint32_t y1) {
+        std::vector<uint8_t> row(w);
+        for (uint32_t y = y0; y < y1; y++) {
+          const uint8_t *src = bmp.Row(y);
+          for (uint32_t x = 0; x < w; x++) {
+            const Color c = PF::Load(src + (size_t)x * PF::channels);
+            row[x] = nearest[Bin(c.red, c.green, c.blue)];
+          }
+          PackIndices(row.data(), bits, w, Row(y));
+        }
+      });
+      return;
+    }
+    // Floyd-Steinberg: 7/16 of the error goes right, 3/16, 5/16 and 1/16 to
+    // the row below. The errors are kept in sixteenths, one pixel of margin
+    // on either side.
+    std::vector<int> errors(6 * ((size_t)w + 2), 0);
+    int *current = errors.data();
+    int *below = current + 3 * ((size_t)w + 2);
+    std::vector<uint8_t> row(w);
+    for (uint32_t y = 0; y < h; y++) {
+      const uint8_t *src = bmp.Row(y);
+      for (uint32_t x = 0; x < w; x++) {
+        const Color c = PF::Load(src + (size_t)x * PF::channels);
+        int *e = current + 3 * ((size_t)x + 1);
+        int *d = below + 3 * ((size_t)x + 1);
+        const int v[3] = {std::clamp(c.red + ((e[0] + 8) >> 4), 0, 255),
+                          std::clamp(c.green + ((e[1] + 8) >> 4), 0, 255),
+                          std::clamp(c.blue + ((e[2] + 8) >> 4), 0, 255)};
+        row[x] = nearest[Bin(v[0], v[1], v[2])];
+        const Color &q = palette[row[x]];
+        const int q3[3] = {q.red, q.green, q.blue};
+        for (int i = 0; i < 3; i++) {
+          const int error = v[i] - q3[i];
+          e[3 + i] += 7 * error;
+          d[i - 3] += 3 * error;
+          d[i] += 5 * error;
+          d[3 + i] += error;
+        }
+      }
+      PackIndices(row.data(), bits, w, Row(y));
+      std::swap(current, below);
+      std::fill(below, below + 3 * ((size_t)w + 2), 0);
+    }
+  });
+}
+
+std::vector<Color> IndexedBitmap::Quantize(const Bitmap &bmp,
+                                           size_t max_colors) {
+  // Histogram with the sums of the exact colors, every bin stands for the
+  // mean of its pixels. Large images are sampled every step rows.
+  struct Cell {
+    uint64_t count, red, green, blue;
+  };
+  std::vector<Cell> histogram((size_t)1 << 15, Cell{});
+  const uint32_t w = bmp.Width();
+  const uint32_t h = bmp.Height();
+  const uint32_t step =
+      (uint32_t)std::max<uint64_t>(1, ((uint64_t)w * h) >> 20);
+  VisitPixelFormat(bmp.bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    for (uint32_t y = 0; y < h; y += step) {
+      const uint8_t *row = bmp.Row(y);
+      for (uint32_t x = 0; x < w; x++) {
+        const Color c = PF::Load(row + (size_t)x * PF::channels);
+        Cell &bin = histogram[Bin(c.red, c.green, c.blue)];
+        bin.count++;
+        bin.red += c.red;
+        bin.green += c.green;
+        bin.blue += c.blue;
+      }
+    }
+  });
+  struct Point {
+    float color[3];
+    float weight;
+  };
+  std::vector<Point> points;
+  for (const Cell &bin : histogram)
+    if (bin.count) {
+      const float n = (float)bin.count;
+      points.push_back(Point{{bin.red / n, bin.green / n, bin.blue / n}, n});
+    }
+  auto distance = [](const float *a, const float *b) {
+    const float dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+    return dr * dr + dg * dg + db * db;
+  };
+
+  std::vector<std::array<float, 3>> centers;
+  if (points.size() <= max_colors) {
+    for (const Point &p : points)
+      centers.push_back({p.color[0], p.color[1], p.color[2]});
+  } else {
+    // Seeded from the most common color, then again and again from the
+    // point farthest from all centers so far weighted by its count
+    std::vector<float> gap(points.size(), FLT_MAX);
+    size_t next = 0;
+    for (size_t i = 1; i < points.size(); i++)
+      if (points[i].weight > points[next].weight)
+        next = i;
+    while (centers.size() < max_colors) {
+      const float *c = points[next].color;
+      centers.push_back({c[0], c[1], c[2]});
+      float farthest = -1;
+      for (size_t i = 0; i < points.size(); i++) {
+        gap[i] = std::min(gap[i], distance(points[i].color, c));
+        if (gap[i] * points[i].weight > farthest) {
+          farthest = gap[i] * points[i].weight;
+          next = i;
+        }
+      }
+    }
+    // Lloyd iterations move every center to the mean of its points
+    std::vector<uint32_t> cluster(points.size(), UINT32_MAX);
+    for (int iteration = 0; iteration < 8; iteration++) {
+      bool moved = false;
+      std::vector<std::array<double, 4>> sums(centers.size(), {0, 0, 0, 0});
+      const ColorSearch search(centers);
+      for (size_t i = 0; i < points.size(); i++) {
+        const uint32_t best = search.Nearest(points[i].color);
+        moved |= cluster[i] != best;
+        cluster[i] = best;
+        const Point &p = points[i];
+        sums[best][0] += (double)p.color[0] * p.weight;
+        sums[best][1] += (double)p.color[1] * p.weight;
+        sums[best][2] += (double)p.color[2] * p.weight;
+        sums[best][3] += p.weight;
+      }
+      if (!moved)
+        break;
+      for (size_t k = 0; k < centers.size(); k++)
+        if (sums[k][3] > 0)
+          for (int i = 0; i < 3; i++)
+            centers[k][i] = (float)(sums[k][i] / sums[k][3]);
+    }
+  }
+  std::vector<Color> colors;
+  for (const auto &c : centers)
+    colors.push_back(Color{(uint8_t)std::lround(c[0]),
+                           (uint8_t)std::lround(c[1]),
+                           (uint8_t)std::lround(c[2])});
+  return colors;
+}
+
+IndexedBitmap::ColorSearch::ColorSearch(
+    const std::vector<std::array<float, 3>> &colors)
+    : order(colors.size()) {
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return colors[a][0] < colors[b][0];
+  });
+  for (uint32_t i : order)
+    sorted.push_back(colors[i]);
+}
+
+uint32_t IndexedBitmap::ColorSearch::Nearest(const float *color) const {
+  float best = FLT_MAX;
+  uint32_t nearest = 0;
+  auto visit = [&](size_t i) {
+    const float dr = sorted[i][0] - color[0];
+    if (dr * dr >= best)
+      return false;
+    const float dg = sorted[i][1] - color[1], db = sorted[i][2] - color[2];
+    const float d = dr * dr + dg * dg + db * db;
+    if (d < best) {
+      best = d;
+      nearest = order[i];
+    }
+    return true;
+  };
+  // Outwards from the first color with at least the red of the query
+  const size_t start =
+      (size_t)(std::lower_bound(sorted.begin(), sorted.end(), color[0],
+                                [](const std::array<float, 3> &c, float r) {
+                                  return c[0] < r;
+                                }) -
+               sorted.begin());
+  for (size_t i = start; i < sorted.size() && visit(i); i++)
+    ;
+  for (size_t i = start; i > 0 && visit(i - 1); i--)
+    ;
+  return nearest;
+}
+
+void IndexedBitmap::Create(uint32_t w, uint32_t h, uint16_t bits,
+                           BitmapPool *pool) {
+  if (bits != 1 && bits != 4 && bits != 8) {
+    std::cout << "Unsupported bit depth: " << bits << "\n";
+    bits = 8;
+  }
+  info_header.width = w;
+  info_header.height = h;
+  info_header.bits_per_pixel = bits;
+  if (vec_pixels.GetPool() != pool)
+    vec_pixels = PixelBuffer(pool);
+  vec_pixels.clear();
+  vec_pixels.resize((size_t)Stride() * h, 0);
+  palette.resize(std::min(palette.size(), (size_t)1 << bits));
+  UpdateHeaders();
+}
+
+void IndexedBitmap::UpdateHeaders() {
+  info_header.header_size = 40;
+  info_header.compression = (uint32_t)COMPRESSION::RGB;
+  info_header.image_size = (uint32_t)vec_pixels.size();
+  info_header.colors_used = (uint32_t)palette.size();
+  info_header.colors_important = 0;
+  file_header.offset_data = 54 + 4 * (uint32_t)palette.size();
+  file_header.file_size = file_header.offset_data + info_header.image_size;
+}
+
+bool IndexedBitmap::Read(const char *fn) {
+  BMP_TRACE("IndexedBitmap::Read");
+  std::ifstream infile(fn, std::ios::binary);
+  if (!infile.is_open()) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  uint8_t header[54];
+  if (!infile.read((char *)header, sizeof(header))) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  FileHeader fh;
+  Infoheader ih;
+  UTILS::read_headers(header, fh, ih);
+  const uint16_t bits = ih.bits_per_pixel;
+  if (bits != 1 && bits != 4 && bits != 8) {
+    std::cout << "Unsupported bit depth: " << bits << "\n";
+    return false;
+  }
+  const uint32_t rle =
+      (uint32_t)(bits == 8 ? COMPRESSION::RLE8 : COMPRESSION::RLE4);
+  if (ih.compression != 0 && (bits == 1 || ih.compression != rle)) {
+    std::cout << "Unsupported compression " << ih.compression << " at "
+              << bits << " bits\n";
+    return false;
+  }
+
+  // The color table follows the info header
+  const uint32_t colors = ih.colors_used == 0
+                              ? 1u << bits
+                              : std::min(ih.colors_used, 1u << bits);
+  std::vector<uint8_t> table(4 * (size_t)colors);
+  infile.seekg(14 + (std::streamoff)ih.header_size);
+  infile.read((char *)table.data(), (std::streamsize)table.size());
+  std::vector<Color> colors_read((size_t)infile.gcount() / 4);
+  for (size_t i = 0; i < colors_read.size(); i++)
+    colors_read[i] = Color{table[4 * i + 2], table[4 * i + 1], table[4 * i]};
+  infile.clear();
+
+  infile.seekg(0, std::ios::end);
+  const uint64_t length = (uint64_t)infile.tellg();
+  const uint64_t offset = fh.offset_data;
+  const size_t n = length > offset ? (size_t)(length - offset) : 0;
+  file_header = fh;
+  info_header = ih;
+  palette.clear();
+  Create(ih.width, ih.height, bits, vec_pixels.GetPool());
+  SetPalette(std::move(colors_read));
+  infile.seekg((std::streamoff)offset);
+  if (ih.compression == 0) {
+    // Straight into the rows, a short file leaves the rest at index 0
+    const size_t size = std::min(n, vec_pixels.size());
+    if (!infile.read((char *)vec_pixels.data(), (std::streamsize)size)) {
+      std::cout << "Failed to read " << fn << "\n";
+      return false;
+    }
+    BMP_COUNT(bytes_read, 54 + table.size() + size);
+    return true;
+  }
+  std::vector<uint8_t> data(n);
+  if (!infile.read((char *)data.data(), (std::streamsize)n)) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  BMP_COUNT(bytes_read, 54 + table.size() + n);
+  const uint32_t w = Width();
+  const uint32_t h = Height();
+  if (bits == 8) {
+    // 8-bit rows hold one index per byte already
+    DecodeRLE(data.data(), data.size(), bits, w, h, Data(), Stride());
+    return true;
+  }
+  std::vector<uint8_t> indices((size_t)w * h, 0);
+  DecodeRLE(data.data(), data.size(), bits, w, h, indices.data());
+  ForEachRowBand(h, Stride(), [&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++)
+      PackIndices(indices.data() + (size_t)y * w, bits, w, Row(y));
+  });
+  return true;
+}
+
+bool IndexedBitmap::Write(const char *fn, COMPRESSION compression) const {
+  BMP_TRACE("IndexedBitmap::Write");
+  if (WriteFile(fn, compression)) {
+    if (Verbose())
+      std::cout << "Bitmap saved to " << fn << "\n";
+    return true;
+  } else {
+    std::cout << "Failed to save " << fn << "\n";
+    return false;
+  }
+}
+
+bool IndexedBitmap::WriteFile(const char *fn, COMPRESSION compression) const {
+  const uint16_t bits = BitsPerPixel();
+  const uint8_t *pixels = vec_pixels.data();
+  size_t size = vec_pixels.size();
+  std::vector<uint8_t> data;
+  if (compression != COMPRESSION::RGB) {
+    const uint16_t rle_bits = compression == COMPRESSION::RLE8 ? 8 : 4;
+    if (bits != rle_bits) {
+      std::cout << "Error: RLE" << rle_bits << " needs " << rle_bits
+                << "-bit indices.\n";
+      return false;
+    }
+    std::vector<uint8_t> indices(Width());
+    for (uint32_t y = 0; y < Height(); y++) {
+      GetRow(y, indices.data());
+      EncodeRLERow(indices.data(), Width(), bits, data);
+      data.push_back(0);
+      data.push_back(0);
+    }
+    // The last end of line becomes the end of bitmap
+    if (data.empty())
+      data.resize(2);
+    data.back() = 1;
+    pixels = data.data();
+    size = data.size();
+  }
+
+  FileHeader fh = file_header;
+  Infoheader ih = info_header;
+  ih.compression = (uint32_t)compression;
+  ih.image_size = (uint32_t)size;
+  fh.file_size = fh.offset_data + (uint32_t)size;
+  // Headers and color table go out as the header of the file
+  std::vector<uint8_t> header(fh.offset_data, 0);
+  UTILS::write_headers(header.data(), fh, ih);
+  for (size_t i = 0; i < palette.size(); i++) {
+    header[54 + 4 * i] = palette[i].blue;
+    header[55 + 4 * i] = palette[i].green;
+    header[56 + 4 * i] = palette[i].red;
+  }
+  if (!UTILS::write_file(fn, header.data(), header.size(), pixels, size))
+    return false;
+  BMP_COUNT(bytes_written, header.size() + size);
+  return true;
+}
+
+Bitmap IndexedBitmap::ToBitmap(BIT_DEPTH bd, BitmapPool *pool) const {
+  BMP_TRACE("IndexedBitmap::ToBitmap");
+  const uint32_t w = Width();
+  const uint32_t h = Height();
+  Bitmap bmp(filename.c_str(), w, h, bd == BIT_DEPTH::BD_32, uninitialized,
+             pool);
+  // Every index has a color, past the palette black
+  std::vector<Color> colors(256);
+  std::copy(palette.begin(), palette.end(), colors.begin());
+  VisitPixelFormat(bd, [&](auto format) {
+    using PF = decltype(format);
+    bmp.ForEachRow([&](uint32_t y0, uint32_t y1) {
+      std::vector<uint8_t> unpacked(w);
+      for (uint32_t y = y0; y < y1; y++) {
+        const uint8_t *index = Row(y);
+        if (BitsPerPixel() != 8) {
+          GetRow(y, unpacked.data());
+          index = unpacked.data();
+        }
+        uint8_t *row = bmp.Row(y);
+        for (uint32_t x = 0; x < w;) {
+          // Runs of an index are filled as one span
+          const size_t n =
+              1 + CommonPrefix(index + x, index + x + 1, w - x - 1);
+          FillPixels<PF>(row + (size_t)x * PF::channels, n,
+                         colors[index[x]]);
+          x += (uint32_t)n;
+        }
+      }
+    });
+  });
+  return bmp;
+}
+
+void IndexedBitmap::SetIndex(int x, int y, uint8_t index) {
+  if (x < 0 || y < 0 || x >= (int)Width() || y >= (int)Height())
+    return;
+  uint8_t *row = Row(y);
+  switch (BitsPerPixel()) {
+  case 8:
+    row[x] = index;
+    break;
+  case 4: {
+    const int shift = x % 2 ? 0 : 4;
+    row[x / 2] = (uint8_t)((row[x / 2] & ~(15 << shift)) |
+                           (index & 15) << shift);
+    break;
+  }
+  case 1: {
+    const int shift = 7 - x % 8;
+    row[x / 8] =
+        (uint8_t)((row[x / 8] & ~(1 << shift)) | (index & 1) << shift);
+    break;
+  }
+  }
+}
+
+void IndexedBitmap::SetPalette(std::vector<Color> colors) {
+  // Files need at least one color, a table of none means 2^bits of them
+  if (colors.empty())
+    colors.push_back(Color{0, 0, 0});
+  colors.resize(std::min(colors.size(), (size_t)1 << BitsPerPixel()));
+  for (Color &c : colors)
+    c.alpha = 255;
+  palette = std::move(colors);
+  UpdateHeaders();
+}
+
+void IndexedBitmap::SetRow(uint32_t y, const uint8_t *indices) {
+  if (y < Height())
+    PackIndices(indices, BitsPerPixel(), Width(), Row(y));
+}
+
+uint8_t IndexedBitmap::GetIndex(int x, int y) const {
+  if (x < 0 || y < 0 || x >= (int)Width() || y >= (int)Height())
+    return 0;
+  const uint8_t *row = Row(y);
+  switch (BitsPerPixel()) {
+  case 4:
+    return x % 2 ? row[x / 2] & 15 : row[x / 2] >> 4;
+  case 1:
+    return (row[x / 8] >> (7 - x % 8)) & 1;
+  default:
+    return row[x];
+  }
+}
+
+Color IndexedBitmap::GetPixelColor(const int &x, const int &y) const {
+  if (x < 0 || y < 0 || x >= (int)Width() || y >= (int)Height()) {
+    std::cout << "Error: Pixel (" << x << ", " << y << ") is out of bounds.\n";
+    std::cout << "Dimensions are (width, height) = (" << Width() << ", "
+              << Height() << ")\n";
+    return Color{0, 0, 0};
+  }
+  const uint8_t index = GetIndex(x, y);
+  return index < palette.size() ? palette[index] : Color{0, 0, 0};
+}
+
+void IndexedBitmap::GetRow(uint32_t y, uint8_t *indices) const {
+  if (y < Height())
+    UnpackIndices(Row(y), BitsPerPixel(), Width(), indices);
+}
+
+bool BitmapWriter::Open(const char *fn, const uint32_t &w, const uint32_t &h,
+                        bool alpha, ROW_ORDER order) {
+  Close();
+  outfile.open(fn, std::ios::binary);
+  if (!outfile.is_open()) {
+    std::cout << "Failed to open " << fn << "\n";
+    return false;
+  }
+
+  bit_depth = alpha ? BIT_DEPTH::BD_32 : BIT_DEPTH::BD_24;
+  row_order = order;
+  rows_written = 0;
+  failed = false;
+  file_header = FileHeader{};
+  info_header = Infoheader{};
+  info_header.width = w;
+  info_header.height = h;
+  info_header.bits_per_pixel = alpha ? 32 : 24;
+  stride = UTILS::row_stride(w, info_header.bits_per_pixel);
+  // Images past 4 GB can still be written, the size field is then saturated
+  uint64_t total_size = file_header.offset_data + (uint64_t)stride * h;
+  file_header.file_size = (uint32_t)std::min<uint64_t>(total_size, UINT32_MAX);
+
+  uint8_t header[54];
+  UTILS::write_headers(header, file_header, info_header);
+  outfile.write((const char *)header, sizeof(header));
+  BMP_COUNT(bytes_written, sizeof(header));
+
+  // Rows arrive last to first, so the file is extended to its final size once
+  // and every row is written at its own offset
+  if (order == ROW_ORDER::TOP_DOWN && h > 0 && stride > 0) {
+    outfile.seekp((std::streamoff)total_size - 1);
+    outfile.put(0);
+  }
+  return outfile.good();
+}
+
+bool BitmapWriter::WriteRows(const uint8_t *band, const uint32_t &n,
+                             const uint32_t &band_stride) {
+  if (!outfile.is_open() || n > Height() - rows_written) {
+    failed = true;
+    return false;
+  }
+
+  static const uint8_t padding[4]{};
+  const uint32_t row_size = Width() * (info_header.bits_per_pixel / 8);
+  if (row_order == ROW_ORDER::BOTTOM_UP && band_stride == stride) {
+    // Band already has the file layout, write it in one go
+    outfile.write((const char *)band, (std::streamsize)stride * n);
+  } else {
+    for (uint32_t i = 0; i < n; i++) {
+      if (row_order == ROW_ORDER::TOP_DOWN) {
+        uint32_t y = Height() - 1 - (rows_written + i);
+        outfile.seekp(file_header.offset_data + (std::streamoff)y * stride);
+      }
+      outfile.write((const char *)band + (size_t)i * band_stride, row_size);
+      outfile.write((const char *)padding, stride - row_size);
+    }
+  }
+  rows_written += n;
+  BMP_COUNT(bytes_written, (uint64_t)stride * n);
+  if (!outfile.good())
+    failed = true;
+  return !failed;
+}
+
+bool BitmapWriter::Close() {
+  if (!outfile.is_open())
+    return false;
+  outfile.close();
+  if (rows_written != Height()) {
+    std::cout << "Bitmap incomplete, wrote " << rows_written << " of "
+              << Height() << " rows\n";
+    failed = true;
+  }
+  return !failed && !outfile.fail();
+}
+
+bool BitmapReader::Open(const char *fn, size_t read_ahead) {
+  Close();
+#if defined(_WIN32)
+  file_handle = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+  fd = open(fn, O_RDONLY);
+#endif
+  if (!IsOpen()) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+
+  uint8_t header[54];
+  if (!ReadAt(0, header, sizeof(header))) {
+    std::cout << "Not a bitmap file: " << fn << "\n";
+    Close();
+    return false;
+  }
+  UTILS::read_headers(header, file_header, info_header);
   switch (info_header.bits_per_pixel) {
   case 24:
     bit_depth = BIT_DEPTH::BD_24;
@@ -246,418 +5402,681 @@ bool Bitmap::Read(const char *fn) {
   default:
     std::cout << "Unsupported bit depth: " << info_header.bits_per_pixel
               << "\n";
+    Close();
+    return false;
+  }
+  if (file_header.signature != 0x4D42 || info_header.compression != 0) {
+    std::cout << "Invalid or unsupported bitmap: " << fn << "\n";
+    Close();
+    return false;
   }
+  stride = UTILS::row_stride(info_header.width, info_header.bits_per_pixel);
+  SetReadAhead(read_ahead);
+  return true;
+}
+
+void BitmapReader::Close() {
+#if defined(_WIN32)
+  if (file_handle != INVALID_HANDLE_VALUE)
+    CloseHandle(file_handle);
+  file_handle = INVALID_HANDLE_VALUE;
+#else
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+#endif
+  buffer.clear();
+  buffer.shrink_to_fit();
+  buffer_rows = 0;
+}
+
+bool BitmapReader::IsOpen() const {
+#if defined(_WIN32)
+  return file_handle != INVALID_HANDLE_VALUE;
+#else
+  return fd >= 0;
+#endif
+}
 
-  // Load remaining data in buffer into
-  LoadFromByteArray(&buffer[file_header.offset_data],
-                    file_header.file_size - file_header.offset_data);
+void BitmapReader::SetReadAhead(size_t read_ahead) {
+  read_ahead_size = read_ahead;
+  buffer_capacity = 1;
+  if (stride > 0 && read_ahead / stride > 1)
+    buffer_capacity = (uint32_t)std::min<size_t>(read_ahead / stride,
+                                                 std::max(Height(), 1u));
+  buffer.resize((size_t)buffer_capacity * stride);
+  buffer_rows = 0;
+}
 
+bool BitmapReader::ReadAt(uint64_t offset, uint8_t *dst, size_t n) {
+  while (n > 0) {
+#if defined(_WIN32)
+    OVERLAPPED ov{};
+    ov.Offset = (DWORD)(offset & 0xFFFFFFFF);
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD count = 0;
+    DWORD chunk = (DWORD)std::min<size_t>(n, 1u << 30);
+    if (!ReadFile(file_handle, dst, chunk, &count, &ov) || count == 0)
+      return false;
+#else
+    ssize_t count = pread(fd, dst, n, (off_t)offset);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+#endif
+    BMP_COUNT(bytes_read, count);
+    offset += (uint64_t)count;
+    dst += count;
+    n -= (size_t)count;
+  }
   return true;
 }
 
-bool Bitmap::Write(const char *fn) const {
-  // Open/Create new file with name stored in fn
-  std::ofstream outfile(fn, std::ios::binary);
+bool BitmapReader::FillBuffer(const uint32_t &y) {
+  // Read ahead in the direction of the access, a row just below the buffer
+  // starts a backward scan
+  uint32_t first = y;
+  if (buffer_rows > 0 && y + 1 == buffer_first)
+    first = y + 1 > buffer_capacity ? y + 1 - buffer_capacity : 0;
+  uint32_t n = std::min(buffer_capacity, Height() - first);
+  buffer_rows = 0;
+  if (!ReadAt(file_header.offset_data + (uint64_t)first * stride,
+              buffer.data(), (size_t)n * stride))
+    return false;
+  buffer_first = first;
+  buffer_rows = n;
+  return true;
+}
 
-  if (!outfile.is_open())
-    return false; // Could not open/create file
+const uint8_t *BitmapReader::Row(const uint32_t &y) {
+  if (!IsOpen() || y >= Height())
+    return nullptr;
+  if (y < buffer_first || y >= buffer_first + buffer_rows)
+    if (!FillBuffer(y))
+      return nullptr;
+  return &buffer[(size_t)(y - buffer_first) * stride];
+}
+
+bool BitmapReader::ReadRow(const uint32_t &y, uint8_t *dst) {
+  const uint8_t *row = Row(y);
+  if (!row)
+    return false;
+  memcpy(dst, row, (size_t)Width() * Channels());
+  return true;
+}
+
+bool BitmapReader::ReadTile(const uint32_t &x, const uint32_t &y,
+                            const uint32_t &w, const uint32_t &h, uint8_t *dst,
+                            const uint32_t &dst_stride) {
+  if (!IsOpen() || x > Width() || w > Width() - x || y > Height() ||
+      h > Height() - y)
+    return false;
+
+  const size_t offset = (size_t)x * Channels();
+  const size_t n = (size_t)w * Channels();
+  // Narrow tiles are read segment by segment straight from the file, wide
+  // tiles go through the read-ahead buffer one row at a time
+  bool direct = n * 4 < stride;
+  for (uint32_t i = 0; i < h; i++) {
+    uint8_t *out = dst + (size_t)i * dst_stride;
+    if (direct) {
+      uint64_t pos =
+          file_header.offset_data + (uint64_t)(y + i) * stride + offset;
+      if (!ReadAt(pos, out, n))
+        return false;
+    } else {
+      const uint8_t *row = Row(y + i);
+      if (!row)
+        return false;
+      memcpy(out, row + offset, n);
+    }
+  }
+  return true;
+}
+
+BitmapView &BitmapView::operator=(BitmapView &&other) noexcept {
+  if (this == &other)
+    return *this;
+  Close();
+  file_header = other.file_header;
+  info_header = other.info_header;
+  bit_depth = other.bit_depth;
+  mapping = std::exchange(other.mapping, nullptr);
+  mapping_size = std::exchange(other.mapping_size, 0);
+  pixels = std::exchange(other.pixels, nullptr);
+  stride = std::exchange(other.stride, 0);
+#if defined(_WIN32)
+  file_handle = std::exchange(other.file_handle, INVALID_HANDLE_VALUE);
+  map_handle = std::exchange(other.map_handle, nullptr);
+#endif
+  return *this;
+}
+
+bool BitmapView::Map(const char *fn, bool writable) {
+  Close();
+
+  // Map the whole file
+#if defined(_WIN32)
+  file_handle = CreateFileA(fn, writable ? GENERIC_READ | GENERIC_WRITE
+                                         : GENERIC_READ,
+                            FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file_handle == INVALID_HANDLE_VALUE) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(file_handle, &size) && size.QuadPart > 0)
+    map_handle = CreateFileMappingA(file_handle, nullptr,
+                                    writable ? PAGE_READWRITE : PAGE_READONLY,
+                                    0, 0, nullptr);
+  if (map_handle)
+    mapping = (uint8_t *)MapViewOfFile(
+        map_handle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+  if (!mapping) {
+    std::cout << "Failed to map " << fn << "\n";
+    Close();
+    return false;
+  }
+  mapping_size = (size_t)size.QuadPart;
+#else
+  int fd = open(fn, writable ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    std::cout << "Failed to read " << fn << "\n";
+    return false;
+  }
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    addr = mmap(nullptr, (size_t)st.st_size,
+                writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  close(fd); // The mapping keeps its own reference to the file
+  if (addr == MAP_FAILED) {
+    std::cout << "Failed to map " << fn << "\n";
+    return false;
+  }
+  mapping = (uint8_t *)addr;
+  mapping_size = (size_t)st.st_size;
+#endif
+
+  // Parse the headers in place and make sure the pixel array fits in the file
+  if (mapping_size < 54) {
+    std::cout << "Not a bitmap file: " << fn << "\n";
+    Close();
+    return false;
+  }
+  UTILS::read_headers(mapping, file_header, info_header);
+  switch (info_header.bits_per_pixel) {
+  case 24:
+    bit_depth = BIT_DEPTH::BD_24;
+    break;
+  case 32:
+    bit_depth = BIT_DEPTH::BD_32;
+    break;
+  default:
+    std::cout << "Unsupported bit depth: " << info_header.bits_per_pixel
+              << "\n";
+    Close();
+    return false;
+  }
+  stride = UTILS::row_stride(info_header.width, info_header.bits_per_pixel);
+  if (file_header.signature != 0x4D42 || info_header.compression != 0 ||
+      file_header.offset_data > mapping_size ||
+      (uint64_t)stride * info_header.height >
+          mapping_size - file_header.offset_data) {
+    std::cout << "Invalid or unsupported bitmap: " << fn << "\n";
+    Close();
+    return false;
+  }
+  pixels = mapping + file_header.offset_data;
+  return true;
+}
+
+void BitmapView::Close() {
+#if defined(_WIN32)
+  if (mapping)
+    UnmapViewOfFile(mapping);
+  if (map_handle)
+    CloseHandle(map_handle);
+  if (file_handle != INVALID_HANDLE_VALUE)
+    CloseHandle(file_handle);
+  map_handle = nullptr;
+  file_handle = INVALID_HANDLE_VALUE;
+#else
+  if (mapping)
+    munmap(mapping, mapping_size);
+#endif
+  mapping = nullptr;
+  mapping_size = 0;
+  pixels = nullptr;
+  stride = 0;
+}
+
+Color BitmapView::GetPixelColor(const int &x, const int &y) const {
+  int w = (int)info_header.width;
+  int h = (int)info_header.height;
+  if (!IsOpen() || x < 0 || y < 0 || x >= w || y >= h) {
+    std::cout << "Error: Pixel (" << x << ", " << y << ") is out of bounds.\n";
+    return Color{0, 0, 0};
+  }
+
+  return VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    return PF::Load(Row(y) + x * PF::channels);
+  });
+}
+
+bool MutableBitmapView::Flush() {
+  if (!IsOpen())
+    return false;
+#if defined(_WIN32)
+  return FlushViewOfFile(mapping, 0) != 0;
+#else
+  return msync(mapping, mapping_size, MS_SYNC) == 0;
+#endif
+}
+
+void MutableBitmapView::SetPixel(int x, int y, const Color &color) {
+  int w = (int)info_header.width;
+  int h = (int)info_header.height;
+  if (!IsOpen() || x < 0 || y < 0 || x >= w || y >= h)
+    return;
+
+  VisitPixelFormat(bit_depth, [&](auto format) {
+    using PF = decltype(format);
+    PF::Store(Row(y) + x * PF::channels, color);
+  });
+}
+
+void DisplayList::DrawLine(int sx, int sy, int ex, int ey,
+                           const Color &color) {
+  commands.push_back({COMMAND::LINE, {sx, sy, ex, ey}, color});
+}
+
+void DisplayList::DrawRect(const int &x, const int &y, const int &w,
+                           const int &h, const Color &color) {
+  commands.push_back({COMMAND::RECT, {x, y, w, h}, color});
+}
+
+void DisplayList::FillRect(const int &x, const int &y, const int &w,
+                           const int &h, const Color &color) {
+  commands.push_back({COMMAND::FILL_RECT, {x, y, w, h}, color});
+}
+
+void DisplayList::DrawCircle(const int &xc, const int &yc, const int &r,
+                             const Color &color) {
+  commands.push_back({COMMAND::CIRCLE, {xc, yc, r}, color});
+}
+
+void DisplayList::FillCircle(const int &xc, const int &yc, const int &r,
+                             const Color &color) {
+  commands.push_back({COMMAND::FILL_CIRCLE, {xc, yc, r}, color});
+}
 
-  // Create byte buffer to store output data
-  std::vector<uint8_t> buffer(file_header.file_size);
+void DisplayList::DrawTriangle(const int &x1, const int &y1, const int &x2,
+                               const int &y2, const int &x3, const int &y3,
+                               const Color &color) {
+  commands.push_back({COMMAND::TRIANGLE, {x1, y1, x2, y2, x3, y3}, color});
+}
 
-  // Write file header data
-  memcpy(&buffer[0x0000], UTILS::uint16_to_bytes(file_header.signature),
-         2 * sizeof(uint8_t));
-  memcpy(&buffer[0x0002], UTILS::uint32_to_bytes(file_header.file_size),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x0004], UTILS::uint16_to_bytes(file_header.reserved1),
-         2 * sizeof(uint8_t));
-  memcpy(&buffer[0x0006], UTILS::uint16_to_bytes(file_header.reserved2),
-         2 * sizeof(uint8_t));
-  memcpy(&buffer[0x000A], UTILS::uint32_to_bytes(file_header.offset_data),
-         4 * sizeof(uint8_t));
+void DisplayList::FillTriangle(const int &x1, const int &y1, const int &x2,
+                               const int &y2, const int &x3, const int &y3,
+                               const Color &color) {
+  commands.push_back({COMMAND::FILL_TRIANGLE, {x1, y1, x2, y2, x3, y3}, color});
+}
 
-  // Write header info data
-  memcpy(&buffer[0x000E], UTILS::uint32_to_bytes(info_header.header_size),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x0012], UTILS::uint32_to_bytes(info_header.width),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x0016], UTILS::uint32_to_bytes(info_header.height),
-         4 * sizeof(uint8_t));
-
-  memcpy(&buffer[0x001A], UTILS::uint16_to_bytes(info_header.planes),
-         2 * sizeof(uint8_t));
-  memcpy(&buffer[0x001C], UTILS::uint16_to_bytes(info_header.bits_per_pixel),
-         2 * sizeof(uint8_t));
-
-  memcpy(&buffer[0x001E], UTILS::uint32_to_bytes(info_header.compression),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x0022], UTILS::uint32_to_bytes(info_header.image_size),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x0026], UTILS::uint32_to_bytes(info_header.x_res),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x002A], UTILS::uint32_to_bytes(info_header.y_res),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x002E], UTILS::uint32_to_bytes(info_header.colors_used),
-         4 * sizeof(uint8_t));
-  memcpy(&buffer[0x0032], UTILS::uint32_to_bytes(info_header.colors_important),
-         4 * sizeof(uint8_t));
-
-  // write pixel data
-  memcpy(&buffer[file_header.offset_data], &vec_pixels[0],
-         vec_pixels.size() * sizeof(uint8_t));
-
-  outfile.write((const char *)&buffer[0], buffer.size());
-  if (outfile.good()) {
-    std::cout << "Bitmap saved to " << filename << "\n";
+bool DisplayList::BoundingBox(const Command &command, int64_t box[4]) {
+  const int *a = command.args;
+  switch (command.type) {
+  case COMMAND::LINE:
+    box[0] = std::min(a[0], a[2]);
+    box[1] = std::min(a[1], a[3]);
+    box[2] = std::max(a[0], a[2]);
+    box[3] = std::max(a[1], a[3]);
+    return true;
+  case COMMAND::RECT:
+    // The outline runs from x to x + w - 1, in either direction
+    box[0] = std::min<int64_t>(a[0], (int64_t)a[0] + a[2] - 1);
+    box[1] = std::min<int64_t>(a[1], (int64_t)a[1] + a[3] - 1);
+    box[2] = std::max<int64_t>(a[0], (int64_t)a[0] + a[2] - 1);
+    box[3] = std::max<int64_t>(a[1], (int64_t)a[1] + a[3] - 1);
+    return true;
+  case COMMAND::FILL_RECT:
+    box[0] = a[0];
+    box[1] = a[1];
+    box[2] = (int64_t)a[0] + a[2] - 1;
+    box[3] = (int64_t)a[1] + a[3] - 1;
+    return a[2] > 0 && a[3] > 0;
+  case COMMAND::CIRCLE:
+  case COMMAND::FILL_CIRCLE: {
+    int64_t r = std::abs((int64_t)a[2]);
+    box[0] = a[0] - r;
+    box[1] = a[1] - r;
+    box[2] = a[0] + r;
+    box[3] = a[1] + r;
+    return true;
+  }
+  case COMMAND::TRIANGLE:
+  case COMMAND::FILL_TRIANGLE:
+    box[0] = std::min({a[0], a[2], a[4]});
+    box[1] = std::min({a[1], a[3], a[5]});
+    box[2] = std::max({a[0], a[2], a[4]});
+    box[3] = std::max({a[1], a[3], a[5]});
     return true;
-  } else {
-    std::cout << "Failed to save " << filename << "\n";
-    return false;
   }
+  return false;
 }
 
-void Bitmap::SetBitDepth(const BIT_DEPTH &bd) {
-  bit_depth = bd;
-  switch (bd) {
-  case BIT_DEPTH::BD_24:
-    info_header.bits_per_pixel = 24;
+void DisplayList::Execute(Bitmap &image, const Command &command,
+                          const Rect &clip) {
+  const int *a = command.args;
+  const Color &c = command.color;
+  switch (command.type) {
+  case COMMAND::LINE:
+    image.DrawLine(a[0], a[1], a[2], a[3], c, clip);
     break;
-  case BIT_DEPTH::BD_32:
-    info_header.bits_per_pixel = 32;
+  case COMMAND::RECT:
+    image.DrawRect(a[0], a[1], a[2], a[3], c, clip);
+    break;
+  case COMMAND::FILL_RECT:
+    image.FillRect(a[0], a[1], a[2], a[3], c, clip);
+    break;
+  case COMMAND::CIRCLE:
+    image.DrawCircle(a[0], a[1], a[2], c, clip);
+    break;
+  case COMMAND::FILL_CIRCLE:
+    image.FillCircle(a[0], a[1], a[2], c, clip);
+    break;
+  case COMMAND::TRIANGLE:
+    image.DrawTriangle(a[0], a[1], a[2], a[3], a[4], a[5], c, clip);
+    break;
+  case COMMAND::FILL_TRIANGLE:
+    image.FillTriangle(Vertex{a[0], a[1]}, Vertex{a[2], a[3]},
+                       Vertex{a[4], a[5]}, c, clip);
     break;
   }
 }
 
-void Bitmap::SetPixel(int x, int y, const Color &color) {
-  int w = (int)info_header.width;
-  int h = (int)info_header.height;
-  if (x < 0 || y < 0 || x >= w || y >= h) // Pixel coordinate outside of bitmap
+void DisplayList::Render(Bitmap &image, ThreadPool &pool) const {
+  BMP_TRACE("DisplayList::Render");
+  const int64_t w = image.Width();
+  const int64_t h = image.Height();
+  if (w == 0 || h == 0 || commands.empty())
     return;
+  const int64_t size = tile_size > 0 ? tile_size : 128;
+  const int64_t tiles_x = (w + size - 1) / size;
+  const int64_t tiles_y = (h + size - 1) / size;
+  const size_t n_tiles = (size_t)(tiles_x * tiles_y);
 
-  switch (bit_depth) {
-  case BIT_DEPTH::BD_24: {
-    int padding = w % 4;
-    int idx = 3 * (y * w + x) + y * padding;
-    vec_pixels[idx + 0] = color.blue;
-    vec_pixels[idx + 1] = color.green;
-    vec_pixels[idx + 2] = color.red;
-    break;
-  }
-  case BIT_DEPTH::BD_32: {
-    int idx = 4 * (y * w + x);
-    vec_pixels[idx + 0] = color.blue;
-    vec_pixels[idx + 1] = color.green;
-    vec_pixels[idx + 2] = color.red;
-    vec_pixels[idx + 3] = color.alpha;
-    break;
+  // Tile range of every command, commands outside the image get none
+  std::vector<std::array<int32_t, 4>> ranges(commands.size());
+  std::vector<uint32_t> bin_start(n_tiles + 1, 0);
+  for (size_t i = 0; i < commands.size(); i++) {
+    int64_t box[4];
+    auto &range = ranges[i];
+    range = {0, 0, -1, -1};
+    if (!BoundingBox(commands[i], box) || box[2] < 0 || box[3] < 0 ||
+        box[0] >= w || box[1] >= h)
+      continue;
+    range[0] = (int32_t)(std::max<int64_t>(box[0], 0) / size);
+    range[1] = (int32_t)(std::max<int64_t>(box[1], 0) / size);
+    range[2] = (int32_t)(std::min(box[2], w - 1) / size);
+    range[3] = (int32_t)(std::min(box[3], h - 1) / size);
+    for (int32_t ty = range[1]; ty <= range[3]; ty++)
+      for (int32_t tx = range[0]; tx <= range[2]; tx++)
+        bin_start[(size_t)(ty * tiles_x + tx) + 1]++;
   }
+  // The bins are slices of one array, filled in recording order
+  for (size_t t = 0; t < n_tiles; t++)
+    bin_start[t + 1] += bin_start[t];
+  std::vector<uint32_t> bins(bin_start[n_tiles]);
+  std::vector<uint32_t> bin_end(bin_start.begin(), bin_start.end() - 1);
+  for (size_t i = 0; i < commands.size(); i++) {
+    const auto &range = ranges[i];
+    for (int32_t ty = range[1]; ty <= range[3]; ty++)
+      for (int32_t tx = range[0]; tx <= range[2]; tx++)
+        bins[bin_end[(size_t)(ty * tiles_x + tx)]++] = (uint32_t)i;
   }
+
+  // Tiles are handed out one at a time, so busy tiles don't hold up others
+  image.Unshare();
+  pool.ParallelFor(n_tiles, 1, [&](size_t begin, size_t end) {
+    BMP_TRACE("DisplayList tiles");
+    for (size_t t = begin; t < end; t++) {
+      int64_t x = (int64_t)(t % tiles_x) * size;
+      int64_t y = (int64_t)(t / tiles_x) * size;
+      Rect clip{(int)x, (int)y, (int)std::min(size, w - x),
+                (int)std::min(size, h - y)};
+      for (uint32_t i = bin_start[t]; i < bin_start[t + 1]; i++)
+        Execute(image, commands[bins[i]], clip);
+    }
+  });
 }
 
-void Bitmap::Fill(const Color &color) {
-  uint32_t h = Height();
-  uint32_t w = Width();
-  // x as inner loop for better performance
-  for (int y = (int)h - 1; y >= 0; y--)
-    for (int x = 0; x < (int)w; x++)
-      SetPixel(x, y, color);
+std::atomic<bool> &VerboseFlag() {
+  static std::atomic<bool> verbose{false};
+  return verbose;
 }
 
-void BMP::Bitmap::DrawLine(int sx, int sy, int ex, int ey, Color color) {
-  int dx = ex - sx;
-  int dy = ey - sy;
+void SetVerbose(bool verbose) { VerboseFlag() = verbose; }
 
-  if (dx < 0) {
-    std::swap(sx, ex);
-    std::swap(sy, ey);
-    dx = -dx;
-    dy = -dy;
-  }
-  // Horizontal line
-  if (dy == 0) {
-    for (; sx <= ex; sx++)
-      SetPixel(sx, sy, color);
-  }
-  // Vertical line
-  else if (dx == 0) {
-    if (dy < 0)
-      std::swap(sy, ey);
-    for (; sy <= ey; sy++)
-      SetPixel(sx, sy, color);
-  }
-  // Slope -1 <= m <= 1
-  else if (abs(dx) >= abs(dy)) {
-    int y_inc = 1;
-    if (dy < 0) {
-      y_inc = -1;
-      dy = -dy;
-    }
-    int D = 2 * dy - dx;
-    for (; sx <= ex; sx++) {
-      SetPixel(sx, sy, color);
-      if (D > 0) {
-        D += 2 * (dy - dx);
-        sy += y_inc;
-      } else {
-        D += 2 * dy;
-      }
-    }
-  }
-  // Slope abs(m) > 1
-  else {
-    if (dy < 0) {
-      std::swap(sy, ey);
-      std::swap(sx, ex);
-      dy = -dy;
-      dx = -dx;
-    }
-    int x_inc = 1;
-    if (dx < 0) {
-      x_inc = -1;
-      dx = -dx;
-    }
-    int D = 2 * dx - dy;
-    for (; sy <= ey; sy++) {
-      SetPixel(sx, sy, color);
-      if (D > 0) {
-        D += 2 * (dx - dy);
-        sx += x_inc;
-      } else {
-        D += 2 * dx;
-      }
-    }
-  }
-}
+bool Verbose() { return VerboseFlag(); }
 
-void BMP::Bitmap::DrawRect(const int &x, const int &y, const int &w,
-                           const int &h, const Color &color) {
-  DrawLine(x, y, x + w - 1, y, color);
-  DrawLine(x, y, x, y + h - 1, color);
-  DrawLine(x + w - 1, y, x + w - 1, y + h - 1, color);
-  DrawLine(x, y + h - 1, x + w - 1, y + h - 1, color);
+ThreadPool &IoPool() {
+  static ThreadPool pool(
+      std::clamp(2 * std::thread::hardware_concurrency(), 8u, 64u));
+  return pool;
 }
 
-void BMP::Bitmap::FillRect(const int &x, const int &y, const int &w,
-                           const int &h, const Color &color) {
-  for (int yi = (int)(y + h - 1); yi >= (int)y; yi--)
-    for (int xi = x; xi <= (int)(x + w - 1); xi++)
-      SetPixel(xi, yi, color);
+LoadResult Load(const std::string &fn) {
+  LoadResult result;
+  result.filename = fn;
+  result.ok = result.bitmap.Read(fn.c_str());
+  result.bitmap.SetFileName(fn.c_str());
+  return result;
 }
 
-void BMP::Bitmap::DrawCircle(const int &xc, const int &yc, const int &r,
-                             const Color &color) {
-  auto setpixel_all_octants = [&](const int &x, const int &y) {
-    SetPixel(xc + x, yc + y, color);
-    SetPixel(xc - x, yc + y, color);
-    SetPixel(xc + x, yc - y, color);
-    SetPixel(xc - x, yc - y, color);
-    SetPixel(xc + y, yc + x, color);
-    SetPixel(xc - y, yc + x, color);
-    SetPixel(xc + y, yc - x, color);
-    SetPixel(xc - y, yc - x, color);
-  };
-
-  int y = r;
-  int x = 0;
-  int D = 3 - (2 * r);
-  setpixel_all_octants(x, y);
-  while (y >= x++) {
-    if (D > 0) {
-      y--;
-      D += 4 * (x - y) + 10;
-    } else {
-      D += 4 * x + 6;
+std::future<LoadResult> LoadAsync(std::string fn, ThreadPool &pool) {
+  // Tasks are std::functions and must be copyable, the promise is not
+  auto promise = std::make_shared<std::promise<LoadResult>>();
+  std::future<LoadResult> future = promise->get_future();
+  pool.Submit([promise, fn = std::move(fn)]() {
+    try {
+      promise->set_value(Load(fn));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
     }
-    setpixel_all_octants(x, y);
-  }
+  });
+  return future;
 }
 
-void BMP::Bitmap::FillCircle(const int &xc, const int &yc, const int &r,
-                             const Color &color) {
-  auto line_drawing_helper = [&](const int &x, const int &y) {
-    DrawLine(xc - x, yc + y, xc + x, yc + y, color);
-    DrawLine(xc - x, yc - y, xc + x, yc - y, color);
-    DrawLine(xc - y, yc + x, xc + y, yc + x, color);
-    DrawLine(xc - y, yc - x, xc + y, yc - x, color);
-  };
-
-  int y = r;
-  int x = 0;
-  int D = 3 - (2 * r);
-  line_drawing_helper(x, y);
-  while (y >= x++) {
-    if (D > 0) {
-      y--;
-      D += 4 * (x - y) + 10;
-    } else {
-      D += 4 * x + 6;
+std::future<bool> SaveAsync(Bitmap bmp, std::string fn, ThreadPool &pool) {
+  auto promise = std::make_shared<std::promise<bool>>();
+  std::future<bool> future = promise->get_future();
+  pool.Submit([promise, bmp = std::move(bmp), fn = std::move(fn)]() {
+    try {
+      promise->set_value(bmp.Write(fn.c_str()));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
     }
-    line_drawing_helper(x, y);
-  }
+  });
+  return future;
 }
 
-void BMP::Bitmap::DrawTriangle(const int &x1, const int &y1, const int &x2,
-                               const int &y2, const int &x3, const int &y3,
-                               const Color &color) {
-  DrawLine(x1, y1, x2, y2, color);
-  DrawLine(x1, y1, x3, y3, color);
-  DrawLine(x2, y2, x3, y3, color);
+void LoadBatch(std::span<const std::string> files,
+               const std::function<void(size_t, LoadResult &)> &on_loaded,
+               ThreadPool &pool) {
+  // One file per chunk, so a slow file doesn't hold up the ones after it
+  pool.ParallelFor(files.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      LoadResult result = Load(files[i]);
+      on_loaded(i, result);
+    }
+  });
 }
 
-void BMP::Bitmap::FillTriangle(const int &x1, const int &y1, const int &x2,
-                               const int &y2, const int &x3, const int &y3,
-                               const Color &color) {
-  FillTriangle(Vertex{x1, y1}, Vertex{x2, y2}, Vertex{x3, y3}, color);
+std::vector<LoadResult> LoadBatch(std::span<const std::string> files,
+                                  ThreadPool &pool) {
+  std::vector<LoadResult> results(files.size());
+  LoadBatch(
+      files, [&](size_t i, LoadResult &result) { results[i] = std::move(result); },
+      pool);
+  return results;
 }
 
-void BMP::Bitmap::DrawLine(const Vertex &vStart, const Vertex &vEnd,
-                           const Color &color) {
-  DrawLine(vStart.x, vStart.y, vEnd.x, vEnd.y, color);
+size_t SaveBatch(std::span<const Bitmap> bitmaps,
+                 std::span<const std::string> files, ThreadPool &pool) {
+  std::atomic<size_t> saved{0};
+  pool.ParallelFor(std::min(bitmaps.size(), files.size()), 1,
+                   [&](size_t begin, size_t end) {
+                     for (size_t i = begin; i < end; i++)
+                       if (bitmaps[i].Write(files[i].c_str()))
+                         saved++;
+                   });
+  return saved;
 }
 
-void BMP::Bitmap::DrawRect(const Vertex &vTopLeft, const Vertex &vSize,
-                           const Color &color) {
-  DrawRect(vTopLeft.x, vTopLeft.y, vSize.x, vSize.y, color);
-}
+// Instrumentation state of the calling thread: the primitive of its
+// outermost draw call and the number of open spans
+struct TraceThread {
+  PRIMITIVE primitive;
+  int depth;
+  uint32_t id;
+};
 
-void BMP::Bitmap::FillRect(const Vertex &vTopLeft, const Vertex &vSize,
-                           const Color &color) {
-  FillRect(vTopLeft.x, vTopLeft.y, vSize.x, vSize.y, color);
+TraceThread &CurrentTraceThread() {
+  static std::atomic<uint32_t> next_id{1};
+  thread_local TraceThread thread{PRIMITIVE::COUNT, 0, next_id++};
+  return thread;
 }
 
-void BMP::Bitmap::DrawCircle(const Vertex &vCenter, const int &r,
-                             const Color &color) {
-  DrawCircle(vCenter.x, vCenter.y, r, color);
-}
+struct TraceEvent {
+  const char *name;
+  std::chrono::steady_clock::time_point start, end;
+  uint32_t thread;
+};
 
-void BMP::Bitmap::FillCircle(const Vertex &vCenter, const int &r,
-                             const Color &color) {
-  FillCircle(vCenter.x, vCenter.y, r, color);
-}
+struct TraceLog {
+  std::mutex mutex;
+  std::vector<TraceEvent> events;
+};
 
-void BMP::Bitmap::DrawTriangle(const Vertex &v1, const Vertex &v2,
-                               const Vertex &v3, const Color &color) {
-  DrawTriangle(v1.x, v1.y, v2.x, v2.y, v3.x, v3.y, color);
+TraceLog &GetTraceLog() {
+  static TraceLog log;
+  return log;
 }
 
-void BMP::Bitmap::FillTriangle(Vertex v1, Vertex v2, Vertex v3,
-                               const Color &color) {
-  if (v2.y < v1.y)
-    std::swap(v1, v2);
-  if (v3.y < v1.y)
-    std::swap(v1, v3);
-  if (v3.y < v2.y)
-    std::swap(v2, v3);
-
-  int h = (int)info_header.height;
+void RecordSpan(const char *name, std::chrono::steady_clock::time_point start,
+                uint32_t thread) {
+  const auto end = std::chrono::steady_clock::now();
+  TraceLog &log = GetTraceLog();
+  std::lock_guard<std::mutex> lock(log.mutex);
+  if (log.events.size() < (1 << 20))
+    log.events.push_back({name, start, end, thread});
+}
 
-  auto fill_top_triangle = [&](const Vertex &v1, const Vertex &v2,
-                               const Vertex &v3, bool top = true) {
-    // v1.y <= v2.y <= v3.y
-    int dy1 = v2.y - v1.y;
-    int dy2 = v3.y - v1.y;
-    int dx1 = v2.x - v1.x;
-    int dx2 = v3.x - v1.x;
+Counters &GetCounters() {
+  static Counters counters;
+  return counters;
+}
 
-    bool steep1 = false;
-    bool steep2 = false;
-    if (abs(dx1) < dy1)
-      steep1 = true;
-    if (abs(dx2) < dy2)
-      steep2 = true;
+void ResetCounters() {
+  Counters &counters = GetCounters();
+  for (PrimitiveCounters &p : counters.primitives) {
+    p.calls = 0;
+    p.pixels_written = 0;
+    p.pixels_clipped = 0;
+  }
+  counters.bytes_read = 0;
+  counters.bytes_written = 0;
+  counters.allocations = 0;
+  counters.allocated_bytes = 0;
+}
 
-    int x_inc1 = 1;
-    int x_inc2 = 1;
-    if (dx1 < 0) {
-      x_inc1 = -1;
-      dx1 = -dx1;
-    }
-    if (dx2 < 0) {
-      x_inc2 = -1;
-      dx2 = -dx2;
-    }
-    int curr_x1 = v1.x;
-    int curr_y1 = v1.y;
-    int curr_x2 = v1.x;
-    int curr_y2 = v1.y;
+void CountPixels(PRIMITIVE primitive, uint64_t written, uint64_t clipped) {
+  const PRIMITIVE current = CurrentTraceThread().primitive;
+  PrimitiveCounters &counters =
+      GetCounters()[current != PRIMITIVE::COUNT ? current : primitive];
+  if (written)
+    counters.pixels_written.fetch_add(written, std::memory_order_relaxed);
+  if (clipped)
+    counters.pixels_clipped.fetch_add(clipped, std::memory_order_relaxed);
+}
 
-    int D1 = steep1 ? 2 * dx1 - dy1 : 2 * dy1 - dx1;
-    int D2 = steep2 ? 2 * dx2 - dy2 : 2 * dy2 - dx2;
-    int D1_inc1 = steep1 ? 2 * (dx1 - dy1) : 2 * (dy1 - dx1);
-    int D2_inc1 = steep2 ? 2 * (dx2 - dy2) : 2 * (dy2 - dx2);
-    int D1_inc2 = steep1 ? 2 * dx1 : 2 * dy1;
-    int D2_inc2 = steep2 ? 2 * dx2 : 2 * dy2;
-    while (curr_y1 < v2.y || curr_y2 < v2.y) {
-      if (curr_y1 <= curr_y2) {
-        if (D1 > 0) {
-          D1 += D1_inc1;
-          if (steep1)
-            curr_x1 += x_inc1;
-          else
-            curr_y1++;
-        } else {
-          D1 += D1_inc2;
-        }
-        if (steep1)
-          curr_y1++;
-        else
-          curr_x1 += x_inc1;
-      }
-      if (curr_y2 < curr_y1) {
-        if (D2 > 0) {
-          D2 += D2_inc1;
-          if (steep2)
-            curr_x2 += x_inc2;
-          else
-            curr_y2++;
-        } else {
-          D2 += D2_inc2;
-        }
-        if (steep2)
-          curr_y2++;
-        else
-          curr_x2 += x_inc2;
-      }
-      if (curr_y1 == curr_y2) {
-        if (top)
-          DrawLine(curr_x1, curr_y1, curr_x2, curr_y2, color);
-        else // bottom
-          DrawLine(curr_x1, h - curr_y1 - 1, curr_x2, h - curr_y2 - 1, color);
-      }
-    }
+bool WriteTrace(const char *fn) {
+  std::ofstream outfile(fn);
+  if (!outfile.is_open()) {
+    std::cout << "Failed to save " << fn << "\n";
+    return false;
+  }
+  TraceLog &log = GetTraceLog();
+  std::lock_guard<std::mutex> lock(log.mutex);
+  // Complete events ("ph": "X") in microseconds from the first span
+  auto first = std::chrono::steady_clock::time_point::max();
+  for (const TraceEvent &e : log.events)
+    first = std::min(first, e.start);
+  auto us = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
   };
+  outfile << std::fixed;
+  outfile.precision(3);
+  outfile << "{\"traceEvents\":[";
+  for (size_t i = 0; i < log.events.size(); i++) {
+    const TraceEvent &e = log.events[i];
+    outfile << (i ? ",\n" : "\n") << "{\"name\":\"" << e.name
+            << "\",\"cat\":\"bmp\",\"ph\":\"X\",\"ts\":" << us(e.start - first)
+            << ",\"dur\":" << us(e.end - e.start)
+            << ",\"pid\":1,\"tid\":" << e.thread << "}";
+  }
+  outfile << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  if (!outfile.good()) {
+    std::cout << "Failed to save " << fn << "\n";
+    return false;
+  }
+  return true;
+}
 
-  auto fill_bottom_triangle = [&](const Vertex &v1, const Vertex &v2,
-                                  const Vertex &v3) {
-    fill_top_triangle(Vertex{v3.x, h - v3.y - 1}, Vertex{v2.x, h - v2.y - 1},
-                      Vertex{v1.x, h - v1.y - 1}, false);
-  };
+void ClearTrace() {
+  TraceLog &log = GetTraceLog();
+  std::lock_guard<std::mutex> lock(log.mutex);
+  log.events.clear();
+}
 
-  fill_top_triangle(v1, v2, v3);
-  fill_bottom_triangle(v1, v2, v3);
+TraceSpan::TraceSpan(const char *name)
+    : name(name), start(std::chrono::steady_clock::now()) {
+  CurrentTraceThread().depth++;
 }
 
-Color Bitmap::GetPixelColor(const int &x, const int &y) const {
-  int w = (int)info_header.width;
-  int h = (int)info_header.height;
-  if (x < 0 || y < 0 || x >= w || y >= h) {
-    std::cout << "Error: Pixel (" << x << ", " << y << ") is out of bounds.\n";
-    std::cout << "Dimensions are (width, height) = (" << info_header.width
-              << ", " << info_header.height << ")\n";
-    return Color{0, 0, 0};
-  }
+TraceSpan::~TraceSpan() {
+  TraceThread &thread = CurrentTraceThread();
+  thread.depth--;
+  RecordSpan(name, start, thread.id);
+}
 
-  int index = 3 * (y * info_header.width + x);
-  return Color{vec_pixels[index + 2], vec_pixels[index + 1],
-               vec_pixels[index + 0]};
+DrawScope::DrawScope(PRIMITIVE primitive, const char *name) {
+  TraceThread &thread = CurrentTraceThread();
+  if (thread.primitive != PRIMITIVE::COUNT)
+    return;
+  outer = true;
+  thread.primitive = primitive;
+  GetCounters()[primitive].calls.fetch_add(1, std::memory_order_relaxed);
+  if (thread.depth == 0) {
+    this->name = name;
+    start = std::chrono::steady_clock::now();
+  }
+  thread.depth++;
 }
 
-void Bitmap::LoadFromByteArray(uint8_t *data, int n) {
-  vec_pixels.clear();
-  vec_pixels.resize(n, 0);
-  for (int i = 0; i < n; i++)
-    vec_pixels[i] = data[i];
+DrawScope::~DrawScope() {
+  if (!outer)
+    return;
+  TraceThread &thread = CurrentTraceThread();
+  thread.depth--;
+  thread.primitive = PRIMITIVE::COUNT;
+  if (name)
+    RecordSpan(name, start, thread.id);
 }
 
 }; // namespace BMP
@@ -1 +1 @@
-g++ -O2 -fopenmp -Wall -Werror -std=c++23 -o main main.cpp -lstdc++exp
+g++ -O2 -Wall -Werror -std=c++23 -o main main.cpp -lstdc++exp
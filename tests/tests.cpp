@@ -1,5 +1,6 @@
 #include <cassert>
 #include <print>
+#include <random>
 
 #include "../bmp.h"
 
@@ -104,6 +105,1545 @@ void TestLoadFromByteArray() {
   blank.Save();
 }
 
+// Testa BitmapView genom att jämföra den mappade filen med Bitmap::Read
+void TestBitmapView() {
+  BMP::Bitmap bmp24("bmp_24.bmp");
+  BMP::BitmapView view("bmp_24.bmp");
+  assert(view.IsOpen());
+  assert(view.Width() == 200 && view.Height() == 200);
+  assert(view.GetBitDepth() == BMP::BIT_DEPTH::BD_24);
+  for (uint32_t y = 0; y < view.Height(); y++)
+    assert(memcmp(view.Row(y), &bmp24.vec_pixels[y * view.Stride()],
+                  view.Stride()) == 0);
+  assert(view.GetPixelColor(0, 0) == RED);
+  assert(view.GetPixelColor(60, 150) == GREEN);
+  assert(view.GetPixelColor(150, 60) == BLUE);
+
+  // Skriv via en skrivbar vy och läs tillbaka med Bitmap::Read
+  bmp24.Write("test_output/bmp24_view.bmp");
+  {
+    BMP::MutableBitmapView mview("test_output/bmp24_view.bmp");
+    assert(mview.IsOpen());
+    mview.SetPixel(199, 0, WHITE);
+    assert(mview.Flush());
+  }
+  BMP::Bitmap modified("test_output/bmp24_view.bmp");
+  assert(modified.GetPixelColor(199, 0) == WHITE);
+}
+
+// Testa BitmapWriter med båda radordningarna och jämför med en Bitmap
+void TestBitmapWriter() {
+  BMP::Bitmap reference("test_output/writer_reference.bmp", 37, 23, false);
+  reference.Fill(WHITE);
+  reference.DrawLine(0, 0, 36, 22, RED);
+  reference.FillCircle(18, 11, 6, BLUE);
+  uint32_t stride = reference.vec_pixels.size() / reference.Height();
+
+  // Nedifrån och upp, hela bilden som ett band
+  BMP::BitmapWriter bottom_up("test_output/writer_bottom_up.bmp", 37, 23,
+                              false);
+  assert(bottom_up.WriteRows(reference.vec_pixels.data(), 23, stride));
+  assert(bottom_up.Close());
+
+  // Uppifrån och ner, en rad i taget
+  BMP::BitmapWriter top_down("test_output/writer_top_down.bmp", 37, 23, false,
+                             BMP::ROW_ORDER::TOP_DOWN);
+  for (int y = 22; y >= 0; y--)
+    assert(top_down.WriteRow(&reference.vec_pixels[y * stride]));
+  assert(top_down.Close());
+
+  BMP::Bitmap a("test_output/writer_bottom_up.bmp");
+  BMP::Bitmap b("test_output/writer_top_down.bmp");
+  assert(a.vec_pixels == reference.vec_pixels);
+  assert(b.vec_pixels == reference.vec_pixels);
+}
+
+// Testa BitmapReader med en liten read-ahead-buffert så att den laddas om
+void TestBitmapReader() {
+  BMP::Bitmap bmp24("bmp_24.bmp");
+  uint32_t stride = bmp24.vec_pixels.size() / bmp24.Height();
+  BMP::BitmapReader reader("bmp_24.bmp", 7 * stride);
+  assert(reader.IsOpen());
+  assert(reader.Width() == 200 && reader.Height() == 200);
+
+  // Rader framåt och bakåt
+  std::vector<uint8_t> row(3 * 200);
+  for (uint32_t y = 0; y < 200; y++) {
+    assert(reader.ReadRow(y, row.data()));
+    assert(memcmp(row.data(), &bmp24.vec_pixels[y * stride], row.size()) == 0);
+  }
+  for (int y = 199; y >= 0; y--)
+    assert(memcmp(reader.Row(y), &bmp24.vec_pixels[y * stride], 600) == 0);
+  assert(reader.Row(200) == nullptr);
+
+  // Smala och breda rutor
+  for (uint32_t w : {5u, 180u}) {
+    std::vector<uint8_t> tile(3 * w * 20);
+    assert(reader.ReadTile(13, 150, w, 20, tile.data(), 3 * w));
+    for (uint32_t ty = 0; ty < 20; ty++)
+      for (uint32_t tx = 0; tx < w; tx++) {
+        uint8_t *p = &tile[3 * (ty * w + tx)];
+        BMP::Color c{p[2], p[1], p[0]};
+        assert(c == bmp24.GetPixelColor(13 + tx, 150 + ty));
+      }
+  }
+  assert(!reader.ReadTile(190, 0, 20, 1, row.data(), 0));
+}
+
+// Testa att en avkortad fil ger en hel bild med nollade rader och att ett
+// okänt bitdjup inte läses
+void TestShortRead() {
+  std::ifstream in("bmp_24.bmp", std::ios::binary);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+  std::ofstream("test_output/short.bmp", std::ios::binary).write(bytes.data(),
+                                                                 2000);
+  BMP::Bitmap full("bmp_24.bmp");
+  BMP::Bitmap short_bmp;
+  assert(short_bmp.Read("test_output/short.bmp"));
+  assert(short_bmp.vec_pixels.size() == full.vec_pixels.size());
+  assert(memcmp(short_bmp.Data(), full.Data(), 2000 - 54) == 0);
+  for (size_t i = 2000 - 54; i < short_bmp.vec_pixels.size(); i++)
+    assert(short_bmp.vec_pixels[i] == 0);
+  short_bmp.Fill(RED);
+  assert(short_bmp.GetPixelColor(199, 199) == RED);
+
+  bytes[28] = 48;
+  std::ofstream("test_output/deep.bmp", std::ios::binary)
+      .write(bytes.data(), (std::streamsize)bytes.size());
+  BMP::Bitmap deep;
+  assert(!deep.Read("test_output/deep.bmp"));
+}
+
+// Testa att Write skriver korrekta headers även för filer större än 64 KB
+void TestWriteHeaders() {
+  BMP::Bitmap large("test_output/write_headers.bmp", 300, 200);
+  large.Fill(BLUE);
+  assert(large.Save());
+  BMP::Bitmap read("test_output/write_headers.bmp");
+  assert(read.GetFileSize() == 54 + 4 * 300 * 200);
+  assert(read.file_header.offset_data == 54);
+  assert(read.file_header.reserved1 == 0 && read.file_header.reserved2 == 0);
+  assert(read.vec_pixels == large.vec_pixels);
+}
+
+// Testa BasicBitmap mot Bitmap, med udda bredd så att raderna har padding
+void TestBasicBitmap() {
+  BMP::Bitmap bmp("test_output/basic_reference.bmp", 37, 23, false);
+  BMP::BasicBitmap<BMP::BGR24> basic("test_output/basic.bmp", 37, 23);
+  bmp.Fill(WHITE);
+  basic.Fill(WHITE);
+  for (int i = 0; i < 23; i++) {
+    bmp.SetPixel(i, i, RED);
+    basic.SetPixel(i, i, RED);
+  }
+  assert(basic.vec_pixels == bmp.vec_pixels);
+  assert(basic.ToBitmap().vec_pixels == bmp.vec_pixels);
+  assert(bmp.GetPixelColor(22, 22) == RED);
+  assert(basic.GetPixelColor(36, 22) == WHITE);
+
+  // Konvertering mellan 24 och 32 bitar
+  BMP::BasicBitmap<BMP::BGRA32> basic32(bmp);
+  assert(basic32.vec_pixels.size() == 4 * 37 * 23);
+  for (int y = 0; y < 23; y++)
+    for (int x = 0; x < 37; x++)
+      assert(basic32.GetPixelColor(x, y) == bmp.GetPixelColor(x, y));
+  BMP::Bitmap bmp32 = basic32.ToBitmap();
+  assert(bmp32.GetBitDepth() == BMP::BIT_DEPTH::BD_32);
+  assert(bmp32.GetPixelColor(5, 5) == RED);
+
+  // Läs filen direkt in i ett BasicBitmap
+  BMP::BasicBitmap<BMP::BGR24> example("bmp_24.bmp");
+  assert(example.GetPixelColor(0, 0) == RED);
+  assert(example.GetPixelColor(60, 150) == GREEN);
+  assert(example.GetPixelColor(150, 60) == BLUE);
+}
+
+// Testa rå pixelåtkomst via Row/Stride och de okontrollerade metoderna
+void TestRawAccess() {
+  for (bool alpha : {false, true}) {
+    BMP::Bitmap bmp("test_output/raw.bmp", 37, 23, alpha);
+    assert(bmp.Stride() == (alpha ? 4 * 37 : 3 * 37 + 1));
+    assert(bmp.vec_pixels.size() == bmp.Stride() * bmp.Height());
+    assert(bmp.Row(5) == bmp.Data() + 5 * bmp.Stride());
+    bmp.SetPixelUnchecked(36, 22, RED);
+    assert(bmp.GetPixelColor(36, 22) == RED);
+    assert(bmp.GetPixelUnchecked(36, 22) == RED);
+    assert(bmp.Row(22)[36 * bmp.Channels() + 2] == 255);
+  }
+
+  BMP::BasicBitmap<BMP::BGR24> basic("test_output/raw.bmp", 37, 23);
+  static_assert(BMP::BasicBitmap<BMP::BGR24>::Channels() == 3);
+  assert(basic.Stride() == 3 * 37 + 1);
+  basic.SetPixelUnchecked(10, 20, BLUE);
+  assert(basic.GetPixelUnchecked(10, 20) == BLUE);
+  assert(basic.Row(20)[3 * 10 + BMP::BGR24::blue] == 255);
+#if defined(__cpp_lib_mdspan)
+  auto pixels = basic.Mdspan();
+  assert(pixels.extent(0) == 23 && pixels.extent(1) == 37);
+  assert((pixels[20, 10, BMP::BGR24::blue] == 255));
+#endif
+}
+
+// Testa Fill och FillRect mot SetPixel för många bredder, inklusive klippning
+// och att paddingen mellan raderna lämnas orörd
+void TestFillKernels() {
+  for (bool alpha : {false, true}) {
+    for (int w = 1; w <= 70; w++) {
+      BMP::Bitmap fast("test_output/fill_kernel.bmp", w, 5, alpha);
+      BMP::Bitmap reference("test_output/fill_kernel.bmp", w, 5, alpha);
+      fast.Fill(GREEN);
+      for (int y = 0; y < 5; y++)
+        for (int x = 0; x < w; x++)
+          reference.SetPixel(x, y, GREEN);
+      assert(fast.vec_pixels == reference.vec_pixels);
+
+      fast.FillRect(-3, 1, w / 2 + 3, 10, RED);
+      fast.FillRect(w / 3, -1, w, 2, BLUE);
+      for (int y = 1; y < 5; y++)
+        for (int x = 0; x < w / 2; x++)
+          reference.SetPixel(x, y, RED);
+      for (int y = 0; y < 1; y++)
+        for (int x = w / 3; x < w; x++)
+          reference.SetPixel(x, y, BLUE);
+      assert(fast.vec_pixels == reference.vec_pixels);
+    }
+  }
+}
+
+// Testa att FillCircle ger samma cirkel som den tidigare linjebaserade
+// versionen (fyra DrawLine per steg), även när cirkeln klipps
+void TestFillCircleSpans() {
+  for (int r : {0, 1, 2, 7, 30, 64, -1, -7, -64}) {
+    for (BMP::Vertex c : {BMP::Vertex{40, 30}, BMP::Vertex{-5, 70}}) {
+      BMP::Bitmap fast("test_output/circle_spans.bmp", 80, 75, false);
+      BMP::Bitmap reference("test_output/circle_spans.bmp", 80, 75, false);
+      fast.FillCircle(c, r, RED);
+
+      auto lines = [&](int x, int y) {
+        reference.DrawLine(c.x - x, c.y + y, c.x + x, c.y + y, RED);
+        reference.DrawLine(c.x - x, c.y - y, c.x + x, c.y - y, RED);
+        reference.DrawLine(c.x - y, c.y + x, c.x + y, c.y + x, RED);
+        reference.DrawLine(c.x - y, c.y - x, c.x + y, c.y - x, RED);
+      };
+      int y = r;
+      int x = 0;
+      int D = 3 - (2 * r);
+      lines(x, y);
+      while (y >= x++) {
+        if (D > 0) {
+          y--;
+          D += 4 * (x - y) + 10;
+        } else {
+          D += 4 * x + 6;
+        }
+        lines(x, y);
+      }
+      assert(fast.vec_pixels == reference.vec_pixels);
+    }
+  }
+
+  // Jätteradier fyller bara de synliga raderna, utan minne per radie
+  BMP::Bitmap huge("test_output/circle_spans.bmp", 80, 75, false);
+  huge.FillCircle(40, 30, INT_MAX, RED);
+  for (uint32_t y = 0; y < 75; y += 37)
+    assert(huge.GetPixelColor(0, y) == RED && huge.GetPixelColor(79, y) == RED);
+  huge.Fill(BLACK);
+  huge.FillCircle(40, 30 + (1 << 29), 1 << 29, RED);
+  assert(huge.GetPixelColor(40, 30) == RED);
+  assert(huge.GetPixelColor(39, 30) != RED);
+  assert(huge.GetPixelColor(0, 31) == RED && huge.GetPixelColor(40, 29) != RED);
+  huge.Fill(BLACK);
+  huge.FillCircle(40, 30, INT_MIN, RED);
+  assert(huge.GetPixelColor(0, 30) == RED && huge.GetPixelColor(79, 30) == RED);
+  assert(huge.GetPixelColor(40, 29) != RED);
+  assert(huge.GetPixelColor(40, 31) != RED);
+}
+
+// Testa FillTriangles mot en pixel-för-pixel referens och att två trianglar
+// med gemensam kant täcker varje pixel exakt en gång
+void TestFillTriangles() {
+  auto covered = [](BMP::Vertex a, BMP::Vertex b, BMP::Vertex c, int x, int y) {
+    auto edge = [&](BMP::Vertex p, BMP::Vertex q) {
+      int64_t ex = q.x - p.x, ey = q.y - p.y;
+      int64_t e = ex * (2 * y + 1 - 2 * p.y) - ey * (2 * x + 1 - 2 * p.x);
+      bool top_left = ey < 0 || (ey == 0 && ex < 0);
+      return e > 0 || (e == 0 && top_left);
+    };
+    int64_t area = (int64_t)(b.x - a.x) * (c.y - a.y) -
+                   (int64_t)(b.y - a.y) * (c.x - a.x);
+    if (area == 0)
+      return false;
+    if (area < 0)
+      std::swap(b, c);
+    return edge(a, b) && edge(b, c) && edge(c, a);
+  };
+
+  uint32_t seed = 12345;
+  auto rnd = [&](int lo, int hi) {
+    seed = seed * 1664525u + 1013904223u;
+    return lo + (int)((seed >> 8) % (uint32_t)(hi - lo + 1));
+  };
+  for (bool alpha : {false, true}) {
+    for (int i = 0; i < 300; i++) {
+      int range = i < 150 ? 40 : i < 250 ? 3000 : 200000000;
+      BMP::Triangle tri{{rnd(-20, 90), rnd(-20, 70)},
+                        {rnd(-range, range), rnd(-range, range)},
+                        {rnd(-20, 90), rnd(-20, 70)},
+                        RED};
+      BMP::Bitmap fast("test_output/triangles.bmp", 75, 53, alpha);
+      BMP::Bitmap reference("test_output/triangles.bmp", 75, 53, alpha);
+      fast.FillTriangles(std::span(&tri, 1));
+      for (int y = 0; y < 53; y++)
+        for (int x = 0; x < 75; x++)
+          if (covered(tri.v1, tri.v2, tri.v3, x, y))
+            reference.SetPixel(x, y, RED);
+      assert(fast.vec_pixels == reference.vec_pixels);
+    }
+  }
+
+  // Rektangel delad längs båda diagonalerna
+  BMP::Vertex p00{3, 2}, p10{61, 2}, p11{61, 47}, p01{3, 47};
+  for (int diagonal = 0; diagonal < 2; diagonal++) {
+    BMP::Triangle first{p00, p10, p11, RED};
+    BMP::Triangle second{p00, p11, p01, RED};
+    if (diagonal == 1) {
+      first = BMP::Triangle{p00, p10, p01, RED};
+      second = BMP::Triangle{p10, p11, p01, RED};
+    }
+    BMP::Bitmap a("test_output/triangles.bmp", 64, 50);
+    BMP::Bitmap b("test_output/triangles.bmp", 64, 50);
+    a.FillTriangles(std::span(&first, 1));
+    b.FillTriangles(std::span(&second, 1));
+    for (int y = 0; y < 50; y++)
+      for (int x = 0; x < 64; x++) {
+        bool in_a = a.GetPixelColor(x, y) == RED;
+        bool in_b = b.GetPixelColor(x, y) == RED;
+        bool in_rect = x >= 3 && x < 61 && y >= 2 && y < 47;
+        assert(!(in_a && in_b));
+        assert((in_a || in_b) == in_rect);
+      }
+  }
+}
+
+void TestClipping() {
+  // Clippad rendering ska ge samma pixlar som ett utsnitt av en större bild
+  const int w = 64, h = 48, margin = 400;
+  auto crop_equal = [&](const BMP::Bitmap &small, const BMP::Bitmap &big) {
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++) {
+        BMP::Color a = small.GetPixelColor(x, y);
+        BMP::Color b = big.GetPixelColor(x + margin, y + margin);
+        if (a.red != b.red || a.green != b.green || a.blue != b.blue)
+          return false;
+      }
+    return true;
+  };
+
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> coord(-margin, w + margin - 1);
+  std::uniform_int_distribution<int> radius(0, 390);
+  for (int i = 0; i < 200; i++) {
+    BMP::Bitmap small("test_output/clipping.bmp", w, h, false);
+    BMP::Bitmap big("test_output/clipping.bmp", w + 2 * margin,
+                    h + 2 * margin, false);
+    int x1 = coord(rng), y1 = coord(rng), x2 = coord(rng), y2 = coord(rng);
+    int x3 = coord(rng), y3 = coord(rng), r = radius(rng);
+    small.DrawLine(x1, y1, x2, y2, RED);
+    big.DrawLine(x1 + margin, y1 + margin, x2 + margin, y2 + margin, RED);
+    small.DrawCircle(x3, y3, r, GREEN);
+    big.DrawCircle(x3 + margin, y3 + margin, r, GREEN);
+    small.FillCircle(x1, y3, r / 2, BLUE);
+    big.FillCircle(x1 + margin, y3 + margin, r / 2, BLUE);
+    small.FillTriangle(x1, y1, x2, y3, x3, y2, RED);
+    big.FillTriangle(x1 + margin, y1 + margin, x2 + margin, y3 + margin,
+                     x3 + margin, y2 + margin, RED);
+    assert(crop_equal(small, big));
+  }
+
+  // Geometri långt utanför bilden ska gå snabbt att rita
+  BMP::Bitmap image("test_output/clipping.bmp", w, h, false);
+  image.DrawLine(-1000000000, 0, 1000000000, 10, RED);
+  image.DrawLine(INT_MIN, INT_MIN, INT_MAX, INT_MAX, RED);
+  image.DrawCircle(w / 2, h / 2 + 100000000, 100000000, GREEN);
+  image.FillCircle(w / 2, -100000000, 100000000, BLUE);
+  image.DrawRect(-100000000, -100000000, 200000000, 200000000, RED);
+  assert(image.GetPixelColor(w / 2, h / 2).green == 255);
+  assert(image.GetPixelColor(0, 0).blue == 255);
+}
+
+void TestDisplayList() {
+  // En inspelad lista ska ge exakt samma bild som direkta anrop, oavsett
+  // antal trådar och rutstorlek
+  auto record = [](auto &target) {
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<int> coord(-60, 260);
+    std::uniform_int_distribution<int> radius(-5, 150);
+    std::uniform_int_distribution<int> kind(0, 6);
+    std::uniform_int_distribution<int> channel(0, 255);
+    for (int i = 0; i < 2000; i++) {
+      int a[6];
+      for (int &v : a)
+        v = coord(rng);
+      int r = radius(rng);
+      BMP::Color c{(uint8_t)channel(rng), (uint8_t)channel(rng),
+                   (uint8_t)channel(rng)};
+      switch (kind(rng)) {
+      case 0:
+        target.DrawLine(a[0], a[1], a[2], a[3], c);
+        break;
+      case 1:
+        target.DrawRect(a[0], a[1], a[2] - 100, a[3] - 100, c);
+        break;
+      case 2:
+        target.FillRect(a[0], a[1], a[2] / 4, a[3] / 4, c);
+        break;
+      case 3:
+        target.DrawCircle(a[0], a[1], r, c);
+        break;
+      case 4:
+        target.FillCircle(a[0], a[1], r / 4, c);
+        break;
+      case 5:
+        target.DrawTriangle(a[0], a[1], a[2], a[3], a[4], a[5], c);
+        break;
+      case 6:
+        target.FillTriangle(a[0], a[1], a[2], a[3], a[4], a[5], c);
+        break;
+      }
+    }
+  };
+
+  BMP::Bitmap reference("test_output/display_list.bmp", 200, 150, false);
+  record(reference);
+  for (uint32_t tile_size : {16u, 37u, 128u, 1024u}) {
+    BMP::DisplayList list(tile_size);
+    record(list);
+    assert(list.Size() == 2000);
+    for (unsigned threads : {1u, 4u}) {
+      BMP::ThreadPool pool(threads);
+      BMP::Bitmap image("test_output/display_list.bmp", 200, 150, false);
+      list.Render(image, pool);
+      assert(image.vec_pixels == reference.vec_pixels);
+    }
+    list.Clear();
+    assert(list.Size() == 0);
+  }
+}
+
+void TestThreadPool() {
+  BMP::ThreadPool pool(4);
+  assert(pool.Concurrency() == 4);
+
+  // Alla uppgifter ska köras innan Wait returnerar
+  std::atomic<int> counter{0};
+  for (int i = 0; i < 1000; i++)
+    pool.Submit([&]() { counter++; });
+  pool.Wait();
+  assert(counter == 1000);
+
+  // Varje index ska besökas exakt en gång, även med nästlade anrop
+  std::vector<std::atomic<int>> visits(10007);
+  pool.ParallelFor(visits.size(), 100, [&](size_t begin, size_t end) {
+    assert(begin % 100 == 0);
+    pool.ParallelFor(end - begin, 7, [&](size_t b, size_t e) {
+      for (size_t i = begin + b; i < begin + e; i++)
+        visits[i]++;
+    });
+  });
+  for (auto &v : visits)
+    assert(v == 1);
+
+  // Radbanden ska täcka bilden och börja på 64-bytesgränser
+  for (uint32_t w : {1u, 3u, 1000u, 1021u}) {
+    BMP::Bitmap image("test_output/thread_pool.bmp", w, 777, false);
+    std::vector<int> rows(image.Height(), 0);
+    image.ForEachRow(
+        [&](uint32_t y0, uint32_t y1) {
+          assert((size_t)y0 * image.Stride() % 64 == 0);
+          for (uint32_t y = y0; y < y1; y++)
+            rows[y]++;
+        },
+        pool);
+    for (int r : rows)
+      assert(r == 1);
+
+    image.Fill(BLUE);
+    for (uint32_t y = 0; y < image.Height(); y += 97)
+      assert(image.GetPixelColor(w - 1, y) == BLUE);
+  }
+
+  // Ett undantag ur f stoppar nya bitar och kastas vidare till anroparen,
+  // först när de påbörjade bitarna är klara
+  for (int round = 0; round < 20; round++) {
+    std::atomic<int> running{0}, started{0};
+    bool caught = false;
+    try {
+      pool.ParallelFor(1000, 1, [&](size_t begin, size_t) {
+        running++;
+        started++;
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        running--;
+        if (begin == (size_t)round)
+          throw std::runtime_error("chunk");
+      });
+    } catch (const std::runtime_error &e) {
+      caught = std::string(e.what()) == "chunk";
+    }
+    assert(caught && running == 0 && started < 1000);
+  }
+  // Även ur nästlade anrop, och poolen fungerar efteråt
+  bool nested = false;
+  try {
+    pool.ParallelFor(64, 1, [&](size_t begin, size_t) {
+      pool.ParallelFor(64, 1, [&](size_t b, size_t) {
+        if (begin == 7 && b == 9)
+          throw std::logic_error("nested");
+      });
+    });
+  } catch (const std::logic_error &) {
+    nested = true;
+  }
+  assert(nested);
+  pool.Wait();
+
+  // Undantag ur uppgifter stannar i poolen tills Wait, även när de körs av
+  // en ParallelFor som väntar på sina egna bitar
+  for (int i = 0; i < 8; i++)
+    pool.Submit([]() { throw std::logic_error("task"); });
+  pool.ParallelFor(1000, 1, [&](size_t, size_t) {});
+  bool thrown = false;
+  try {
+    pool.Wait();
+  } catch (const std::logic_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+  pool.Wait();
+  counter = 0;
+  pool.ParallelFor(1000, 10, [&](size_t begin, size_t end) {
+    counter += (int)(end - begin);
+  });
+  assert(counter == 1000);
+
+  BMP::ThreadPool single(1);
+  assert(single.Concurrency() == 1);
+  int calls = 0;
+  single.Submit([&]() { calls++; });
+  single.ParallelFor(10, 3, [&](size_t, size_t) { calls++; });
+  assert(calls == 5);
+}
+
+// Testa ConvertTo mellan 24 och 32 bitar för många bredder, så att både
+// SIMD-looparna, resten av raden och paddingen täcks
+void TestConvert() {
+  std::mt19937 rng(13);
+  for (uint32_t w = 1; w <= 80; w++) {
+    BMP::Bitmap bmp("test_output/convert.bmp", w, 7, false);
+    std::vector<BMP::Color> colors;
+    for (uint32_t y = 0; y < bmp.Height(); y++)
+      for (uint32_t x = 0; x < w; x++) {
+        BMP::Color c{(uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng()};
+        bmp.SetPixel(x, y, c);
+        colors.push_back(c);
+      }
+    BMP::PixelBuffer original = bmp.vec_pixels;
+
+    bmp.ConvertTo(BMP::BIT_DEPTH::BD_32, 77);
+    assert(bmp.GetBitDepth() == BMP::BIT_DEPTH::BD_32);
+    assert(bmp.vec_pixels.size() == (size_t)4 * w * 7);
+    assert(bmp.GetFileSize() == 54 + bmp.vec_pixels.size());
+    size_t i = 0;
+    for (uint32_t y = 0; y < bmp.Height(); y++)
+      for (uint32_t x = 0; x < w; x++, i++) {
+        BMP::Color expected = colors[i];
+        expected.alpha = 77;
+        assert(bmp.GetPixelColor(x, y) == expected);
+      }
+
+    // Tillbaka till 24 bitar ska ge exakt samma bytes, även paddingen
+    bmp.SetBitDepth(BMP::BIT_DEPTH::BD_24);
+    assert(bmp.Stride() == BMP::UTILS::row_stride(w, 24));
+    assert(bmp.vec_pixels == original);
+  }
+
+  // En bild utan pixlar byter bara format
+  BMP::Bitmap empty;
+  empty.ConvertTo(BMP::BIT_DEPTH::BD_32);
+  assert(empty.GetBitDepth() == BMP::BIT_DEPTH::BD_32);
+  assert(empty.vec_pixels.empty());
+}
+
+// Testa blandningslägena: radkärnan mot Blend pixel för pixel, avrundningen
+// mot en exakt referens, Composite med klippning och ritrutiner med blandning
+void TestBlend() {
+  using BMP::BLEND_MODE;
+  const BLEND_MODE modes[] = {BLEND_MODE::REPLACE, BLEND_MODE::SOURCE_OVER,
+                              BLEND_MODE::ADD, BLEND_MODE::MULTIPLY,
+                              BLEND_MODE::SCREEN};
+  // Source over på en ogenomskinlig bild ska avrundas exakt
+  for (int a = 0; a < 256; a++)
+    for (int c = 0; c < 256; c += 5)
+      for (int d = 0; d < 256; d += 3) {
+        BMP::Color out =
+            BMP::Blend(BMP::Color{(uint8_t)c, 0, 0, (uint8_t)a},
+                       BMP::Color{(uint8_t)d, 0, 0, 255}, BLEND_MODE::SOURCE_OVER);
+        int expected = (2 * (c * a + d * (255 - a)) + 255) / 510;
+        assert(out.red == expected && out.alpha == 255);
+      }
+
+  // Kärnan ska ge samma resultat som Blend för alla bredder
+  std::mt19937 rng(14);
+  for (BLEND_MODE mode : modes)
+    for (size_t n = 1; n <= 40; n++) {
+      std::vector<uint8_t> src(4 * n), dst(4 * n);
+      for (auto &v : src)
+        v = (uint8_t)rng();
+      for (auto &v : dst)
+        v = (uint8_t)rng();
+      std::vector<uint8_t> expected = dst;
+      for (size_t i = 0; i < n; i++)
+        BMP::BGRA32::Store(&expected[4 * i],
+                           BMP::Blend(BMP::BGRA32::Load(&src[4 * i]),
+                                      BMP::BGRA32::Load(&dst[4 * i]), mode));
+      BMP::BlendPixels(dst.data(), src.data(), n, mode);
+      assert(dst == expected);
+    }
+
+  // Genomskinlig källa lämnar bilden orörd
+  for (BLEND_MODE mode : modes) {
+    if (mode == BLEND_MODE::REPLACE)
+      continue;
+    BMP::Color d{10, 200, 30, 40};
+    assert(BMP::Blend(BMP::Color{1, 2, 3, 0}, d, mode) == d);
+  }
+
+  // Composite med alla kombinationer av format, delvis utanför bilden
+  for (bool src_alpha : {false, true})
+    for (bool dst_alpha : {false, true}) {
+      BMP::Bitmap overlay("test_output/blend.bmp", 23, 9, src_alpha);
+      BMP::Bitmap base("test_output/blend.bmp", 30, 20, dst_alpha);
+      for (uint32_t y = 0; y < overlay.Height(); y++)
+        for (uint32_t x = 0; x < overlay.Width(); x++)
+          overlay.SetPixel(x, y,
+                           BMP::Color{(uint8_t)rng(), (uint8_t)rng(),
+                                      (uint8_t)rng(), (uint8_t)rng()});
+      base.Fill(BMP::Color{90, 120, 150, 200});
+      BMP::Bitmap reference = base;
+      base.Composite(overlay, -4, 15, BLEND_MODE::SOURCE_OVER);
+      for (int y = 0; y < 20; y++)
+        for (int x = 0; x < 30; x++) {
+          int sx = x + 4, sy = y - 15;
+          if (sx >= 23 || sy < 0 || sy >= 9)
+            continue;
+          reference.SetPixel(x, y,
+                             BMP::Blend(overlay.GetPixelColor(sx, sy),
+                                        reference.GetPixelColor(x, y),
+                                        BLEND_MODE::SOURCE_OVER));
+        }
+      assert(base.vec_pixels == reference.vec_pixels);
+    }
+
+  // Ritrutiner blandar varje pixel en gång, även hörnen i DrawRect
+  for (bool alpha : {false, true}) {
+    BMP::Bitmap image("test_output/blend.bmp", 40, 30, alpha);
+    image.Fill(BMP::Color{0, 0, 0, 255});
+    image.SetBlendMode(BLEND_MODE::ADD);
+    const BMP::Color half{100, 100, 100, 128};
+    image.FillRect(5, 5, 20, 10, half);
+    image.DrawRect(5, 5, 26, 17, half);
+    image.DrawLine(0, 29, 39, 25, half);
+    const BMP::Color once = BMP::Blend(half, BMP::Color{0, 0, 0, 255},
+                                       BLEND_MODE::ADD);
+    assert(image.GetPixelColor(10, 10) == once);
+    assert(image.GetPixelColor(30, 21) == once);
+    assert(image.GetPixelColor(5, 21) == once);
+    assert(image.GetPixelColor(0, 29) == once);
+    assert(image.GetPixelColor(5, 5) ==
+           BMP::Blend(half, once, BLEND_MODE::ADD));
+    assert(image.GetPixelColor(1, 1) == (BMP::Color{0, 0, 0, 255}));
+  }
+}
+
+// Enkla referenser för filtren: ett pass längs raderna (dx = 1) eller
+// kolumnerna (dy = 1) med upprepade kantpixlar, kanal för kanal
+template <class F>
+void FilterPass(BMP::Bitmap &bmp, int dx, int dy, int reach, F weigh) {
+  BMP::Bitmap src = bmp;
+  const int w = (int)bmp.Width(), h = (int)bmp.Height();
+  const int ch = (int)bmp.Channels();
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      for (int c = 0; c < ch; c++) {
+        std::vector<uint8_t> values;
+        for (int j = -reach; j <= reach; j++) {
+          int sx = std::clamp(x + j * dx, 0, w - 1);
+          int sy = std::clamp(y + j * dy, 0, h - 1);
+          values.push_back(src.Row(sy)[sx * ch + c]);
+        }
+        bmp.Row(y)[x * ch + c] = weigh(values);
+      }
+}
+
+// Testa BoxBlur exakt mot referensen, Convolve med högst 1 i avrundningsfel
+// och egenskaper hos GaussianBlur
+void TestFilters() {
+  std::mt19937 rng(15);
+  auto random_image = [&](uint32_t w, uint32_t h, bool alpha) {
+    BMP::Bitmap bmp("test_output/filter.bmp", w, h, alpha);
+    for (auto &v : bmp.vec_pixels)
+      v = (uint8_t)rng();
+    // Paddingen ska förbli noll
+    for (uint32_t y = 0; y < h; y++)
+      std::fill(bmp.Row(y) + w * bmp.Channels(), bmp.Row(y) + bmp.Stride(), 0);
+    return bmp;
+  };
+
+  for (bool alpha : {false, true})
+    for (auto [w, h] : {std::pair<uint32_t, uint32_t>{1, 1}, {7, 5}, {37, 29},
+                        {70, 3}, {3, 70}})
+      for (int radius : {1, 2, 5, 40}) {
+        BMP::Bitmap fast = random_image(w, h, alpha);
+        BMP::Bitmap reference = fast;
+        fast.BoxBlur(radius, 2);
+        const int d = 2 * radius + 1;
+        auto mean = [&](const std::vector<uint8_t> &v) {
+          int sum = 0;
+          for (uint8_t x : v)
+            sum += x;
+          return (uint8_t)((2 * sum + d) / (2 * d));
+        };
+        for (int pass = 0; pass < 2; pass++)
+          FilterPass(reference, 1, 0, radius, mean);
+        for (int pass = 0; pass < 2; pass++)
+          FilterPass(reference, 0, 1, radius, mean);
+        assert(fast.vec_pixels == reference.vec_pixels);
+      }
+
+  const std::vector<float> kernel_x = {-0.25f, 0.5f, 1.0f, 0.5f, -0.75f};
+  const std::vector<float> kernel_y = {0.1f, 0.2f, 0.4f, 0.2f, 0.1f,
+                                       0.05f, -0.05f};
+  for (bool alpha : {false, true}) {
+    BMP::Bitmap fast = random_image(45, 33, alpha);
+    BMP::Bitmap reference = fast;
+    fast.Convolve(kernel_x, kernel_y);
+    for (auto [kernel, dx] : {std::pair{&kernel_x, 1}, {&kernel_y, 0}}) {
+      const int reach = (int)kernel->size() / 2;
+      FilterPass(reference, dx, 1 - dx, reach, [&](const std::vector<uint8_t> &v) {
+        float acc = 0;
+        for (size_t j = 0; j < kernel->size(); j++)
+          acc += (*kernel)[j] * v[j];
+        return (uint8_t)std::lrint(std::clamp(acc, 0.0f, 255.0f));
+      });
+    }
+    for (size_t i = 0; i < fast.vec_pixels.size(); i++)
+      assert(std::abs(fast.vec_pixels[i] - reference.vec_pixels[i]) <= 1);
+  }
+
+  // En bild i en färg ändras inte och en punkt sprids ut symmetriskt
+  BMP::Bitmap flat("test_output/filter.bmp", 50, 40, true);
+  flat.Fill(BMP::Color{10, 100, 200, 150});
+  BMP::Bitmap blurred = flat;
+  blurred.GaussianBlur(4.5);
+  assert(blurred.vec_pixels == flat.vec_pixels);
+
+  BMP::Bitmap dot("test_output/filter.bmp", 41, 41, false);
+  dot.SetPixel(20, 20, BMP::Color{255, 255, 255});
+  dot.GaussianBlur(2.0);
+  assert(dot.GetPixelColor(20, 20).red > dot.GetPixelColor(22, 20).red);
+  for (int d = 1; d < 10; d++) {
+    assert(dot.GetPixelColor(20 + d, 20) == dot.GetPixelColor(20 - d, 20));
+    assert(dot.GetPixelColor(20, 20 + d) == dot.GetPixelColor(20, 20 - d));
+  }
+}
+
+// Testa Resize: samma storlek ger samma bild, en färg förblir samma färg,
+// NEAREST väljer pixeln under mitten och BILINEAR väger med en triangel
+void TestResize() {
+  using BMP::RESIZE_FILTER;
+  std::mt19937 rng(16);
+  for (bool alpha : {false, true}) {
+    BMP::Bitmap image("test_output/resize.bmp", 37, 23, alpha);
+    for (uint32_t y = 0; y < image.Height(); y++)
+      for (uint32_t x = 0; x < image.Width(); x++)
+        image.SetPixel(x, y, BMP::Color{(uint8_t)rng(), (uint8_t)rng(),
+                                        (uint8_t)rng(), (uint8_t)rng()});
+    for (RESIZE_FILTER filter : {RESIZE_FILTER::NEAREST, RESIZE_FILTER::BILINEAR,
+                                 RESIZE_FILTER::LANCZOS3}) {
+      BMP::Bitmap same = image.Resize(37, 23, filter);
+      assert(same.GetBitDepth() == image.GetBitDepth());
+      assert(same.vec_pixels == image.vec_pixels);
+
+      BMP::Bitmap flat("test_output/resize.bmp", 53, 31, alpha);
+      flat.Fill(BMP::Color{12, 34, 56, 78});
+      for (auto [w, h] : {std::pair<uint32_t, uint32_t>{5, 3}, {100, 7},
+                          {1, 1}, {200, 90}}) {
+        BMP::Bitmap resized = flat.Resize(w, h, filter);
+        assert(resized.Width() == w && resized.Height() == h);
+        for (uint32_t y = 0; y < h; y++)
+          for (uint32_t x = 0; x < w; x++)
+            assert(resized.GetPixelColor(x, y) ==
+                   flat.GetPixelColor(0, 0));
+      }
+    }
+
+    BMP::Bitmap nearest = image.Resize(12, 7, RESIZE_FILTER::NEAREST);
+    for (int y = 0; y < 7; y++)
+      for (int x = 0; x < 12; x++)
+        assert(nearest.GetPixelColor(x, y) ==
+               image.GetPixelColor((2 * x + 1) * 37 / 24, (2 * y + 1) * 23 / 14));
+  }
+
+  // Halverad bredd: utpixel i väger in 2i - 1 .. 2i + 2 med 1, 3, 3, 1
+  BMP::Bitmap row("test_output/resize.bmp", 8, 1, false);
+  const uint8_t values[8] = {0, 40, 80, 120, 160, 200, 240, 255};
+  for (int x = 0; x < 8; x++)
+    row.SetPixel(x, 0, BMP::Color{values[x], 0, 0});
+  BMP::Bitmap half = row.Resize(4, 1, RESIZE_FILTER::BILINEAR);
+  for (int i = 0; i < 4; i++) {
+    double sum = 0, total = 0;
+    const double weights[4] = {1, 3, 3, 1};
+    for (int j = 0; j < 4; j++) {
+      int x = 2 * i - 1 + j;
+      if (x < 0 || x > 7)
+        continue;
+      sum += weights[j] * values[x];
+      total += weights[j];
+    }
+    assert(half.GetPixelColor(i, 0).red == (uint8_t)std::lround(sum / total));
+  }
+}
+
+void TestPool() {
+  auto aligned = [](const uint8_t *p) { return (uintptr_t)p % 64 == 0; };
+  BMP::Bitmap plain("test_output/pool.bmp", 7, 5, false);
+  assert(aligned(plain.Data()));
+  for (uint8_t v : plain.vec_pixels)
+    assert(v == 0);
+
+  // Oinitierade pixlar, men utfyllnaden i slutet av varje rad är noll
+  BMP::Bitmap raw("test_output/pool.bmp", 7, 5, false, BMP::uninitialized);
+  assert(raw.vec_pixels.size() == plain.vec_pixels.size());
+  assert(raw.GetFileSize() == plain.GetFileSize());
+  for (uint32_t y = 0; y < 5; y++)
+    for (uint32_t i = 21; i < raw.Stride(); i++)
+      assert(raw.Row(y)[i] == 0);
+  raw.Fill(RED);
+  plain.Fill(RED);
+  assert(raw.vec_pixels == plain.vec_pixels);
+
+  BMP::BitmapPool pool;
+  for (int frame = 0; frame < 10; frame++) {
+    BMP::Bitmap image("test_output/pool.bmp", 640, 480, true,
+                      BMP::uninitialized, &pool);
+    assert(aligned(image.Data()));
+    assert(image.vec_pixels.GetPool() == &pool);
+    image.Fill(BLUE);
+    BMP::Bitmap copy = image;
+    assert(copy.vec_pixels.GetPool() == &pool);
+    assert(copy.vec_pixels == image.vec_pixels);
+    copy.SetPixel(0, 0, RED);
+    assert(image.GetPixelColor(0, 0) == BLUE);
+    BMP::Bitmap small = image.Resize(320, 240);
+    assert(small.GetPixelColor(7, 7) == BLUE);
+  }
+  // Efter första bilden återanvänds blocken, varje block har ett huvud på
+  // 64 byte
+  assert(pool.Misses() == 3);
+  assert(pool.CachedBytes() == 2 * (640 * 480 * 4 + 64) + 320 * 240 * 4 + 64);
+
+  BMP::BasicBitmap<BMP::BGR24> basic("test_output/pool.bmp", 9, 3,
+                                     BMP::uninitialized, &pool);
+  assert(aligned(basic.Data()) && basic.Row(2)[27] == 0);
+  pool.Trim();
+  assert(pool.CachedBytes() == 0);
+
+  // Ett block mer än dubbelt så stort som behövs återanvänds inte
+  BMP::BitmapPool limited(1000);
+  {
+    BMP::PixelBuffer big(&limited), tiny(&limited);
+    big.resize(640);
+    tiny.resize(2000);
+  }
+  assert(limited.CachedBytes() == 704);
+  BMP::PixelBuffer buffer(&limited);
+  buffer.resize(100, 1);
+  assert(limited.Misses() == 3 && limited.CachedBytes() == 704);
+  buffer.resize(400, 2);
+  assert(limited.Misses() == 3 && limited.CachedBytes() == 192);
+  assert(buffer[99] == 1 && buffer[100] == 2 && buffer.capacity() == 640);
+}
+
+void TestSubView() {
+  std::mt19937 rng(18);
+  auto random_image = [&](uint32_t w, uint32_t h, bool alpha) {
+    BMP::Bitmap image("test_output/subview.bmp", w, h, alpha);
+    for (uint32_t y = 0; y < h; y++)
+      for (uint32_t x = 0; x < w; x++)
+        image.SetPixel(x, y, BMP::Color{(uint8_t)rng(), (uint8_t)rng(),
+                                        (uint8_t)rng(), (uint8_t)rng()});
+    return image;
+  };
+
+  for (bool alpha : {false, true}) {
+    BMP::Bitmap parent = random_image(20, 10, alpha);
+    const BMP::Bitmap original = parent;
+    BMP::Bitmap view = parent.SubView(3, 2, 8, 5);
+    assert(view.IsView() && view.Width() == 8 && view.Height() == 5);
+    assert(view.Stride() == parent.Stride());
+    for (int y = 0; y < 5; y++)
+      for (int x = 0; x < 8; x++)
+        assert(view.GetPixelColor(x, y) == parent.GetPixelColor(3 + x, 2 + y));
+
+    // Vyn klipps till föräldern
+    BMP::Bitmap corner = parent.SubView(15, 8, 10, 10);
+    assert(corner.Width() == 5 && corner.Height() == 2);
+    assert(parent.SubView(30, 0, 5, 5).Width() == 0);
+
+    // Ritrutiner klipps till vyn och ändrar bara föräldern inom den
+    view.FillRect(-5, -5, 100, 100, RED);
+    view.DrawLine(-10, 2, 30, 2, GREEN);
+    for (int y = 0; y < 10; y++)
+      for (int x = 0; x < 20; x++) {
+        const bool inside = x >= 3 && x < 11 && y >= 2 && y < 7;
+        const BMP::Color expected = !inside ? original.GetPixelColor(x, y)
+                                    : y == 4 ? GREEN
+                                             : RED;
+        assert(parent.GetPixelColor(x, y).red == expected.red);
+        assert(parent.GetPixelColor(x, y).green == expected.green);
+      }
+
+    // Filter på en vy ger samma resultat som på en kopia av området
+    parent = original;
+    view = parent.SubView(4, 1, 11, 7);
+    BMP::Bitmap copy("test_output/subview.bmp", 11, 7, alpha);
+    copy.Blit(parent, BMP::Rect{4, 1, 11, 7}, BMP::Vertex{0, 0});
+    view.BoxBlur(2);
+    copy.BoxBlur(2);
+    for (int y = 0; y < 7; y++)
+      for (int x = 0; x < 11; x++)
+        assert(view.GetPixelColor(x, y) == copy.GetPixelColor(x, y));
+    assert(parent.GetPixelColor(3, 1) == original.GetPixelColor(3, 1));
+    assert(parent.GetPixelColor(15, 4) == original.GetPixelColor(15, 4));
+
+    // En vy skrivs rad för rad
+    view.Write("test_output/subview.bmp");
+    BMP::Bitmap read("test_output/subview.bmp");
+    assert(read.vec_pixels == copy.vec_pixels);
+    BMP::BasicBitmap<BMP::BGRA32> basic(view);
+    assert(basic.GetPixelColor(5, 3).red == copy.GetPixelColor(5, 3).red);
+  }
+
+  // Blit mellan alla kombinationer av bitdjup, klippt mot båda bilderna
+  for (bool src_alpha : {false, true})
+    for (bool dst_alpha : {false, true}) {
+      const BMP::Bitmap src = random_image(13, 9, src_alpha);
+      BMP::Bitmap dst = random_image(10, 10, dst_alpha);
+      const BMP::Bitmap before = dst;
+      const BMP::Rect rect{2, -1, 20, 20};
+      const BMP::Vertex pos{-1, 3};
+      dst.Blit(src, rect, pos);
+      for (int y = 0; y < 10; y++)
+        for (int x = 0; x < 10; x++) {
+          const int sx = x - pos.x + rect.x, sy = y - pos.y + rect.y;
+          BMP::Color expected = before.GetPixelColor(x, y);
+          if (sx >= 2 && sy >= 0 && sx < 13 && sy < 9) {
+            expected = src.GetPixelColor(sx, sy);
+            if (!src_alpha)
+              expected.alpha = 255;
+          }
+          if (!dst_alpha)
+            expected.alpha = 255;
+          assert(dst.GetPixelColor(x, y) == expected);
+        }
+    }
+
+  // Överlappande blit inom samma bild, i båda riktningarna
+  for (int shift : {-2, 2}) {
+    BMP::Bitmap image = random_image(12, 12, false);
+    const BMP::Bitmap before = image;
+    image.Blit(image, BMP::Rect{3, 3, 6, 6}, BMP::Vertex{3 + shift, 3 + shift});
+    BMP::Bitmap view = image.SubView(0, 0, 12, 12);
+    view.Blit(view, BMP::Rect{0, 0, 12, 1}, BMP::Vertex{1, 0});
+    for (int y = 0; y < 6; y++)
+      for (int x = 0; x < 6; x++)
+        if (y + 3 + shift > 0)
+          assert(image.GetPixelColor(x + 3 + shift, y + 3 + shift) ==
+                 before.GetPixelColor(x + 3, y + 3));
+    for (int x = 1; x < 12; x++)
+      assert(image.GetPixelColor(x, 0) == before.GetPixelColor(x - 1, 0));
+  }
+}
+
+void TestCopyOnWrite() {
+  static_assert(std::is_nothrow_move_constructible_v<BMP::Bitmap>);
+  static_assert(
+      std::is_nothrow_move_constructible_v<BMP::BasicBitmap<BMP::BGR24>>);
+  std::mt19937 rng(19);
+  BMP::Bitmap image("test_output/cow.bmp", 64, 48, false);
+  for (uint32_t y = 0; y < image.Height(); y++)
+    for (uint32_t x = 0; x < image.Width(); x++)
+      image.SetPixel(x, y, BMP::Color{(uint8_t)rng(), (uint8_t)rng(),
+                                      (uint8_t)rng()});
+  BMP::PixelBuffer original;
+  original.assign(image.Data(), image.Data() + image.vec_pixels.size());
+
+  // En kopia delar pixlarna tills någon av dem skrivs
+  BMP::Bitmap copy = image;
+  assert(copy.vec_pixels.IsShared() && image.vec_pixels.IsShared());
+  assert(std::as_const(copy).Data() == std::as_const(image).Data());
+  copy.SetPixel(1, 1, RED);
+  assert(!copy.vec_pixels.IsShared() && !image.vec_pixels.IsShared());
+  assert(image.vec_pixels == original);
+  assert(copy.GetPixelColor(1, 1) == RED);
+
+  // Alla ändrande rutiner ger kopian egna pixlar först
+  BMP::ThreadPool pool(4);
+  std::vector<std::function<void(BMP::Bitmap &)>> writes = {
+      [](BMP::Bitmap &b) { b.Fill(GREEN); },
+      [](BMP::Bitmap &b) { b.FillRect(3, 4, 20, 10, BLUE); },
+      [](BMP::Bitmap &b) { b.BoxBlur(2); },
+      [](BMP::Bitmap &b) { b.Convolve({}, std::vector<float>{0.25f, 0.5f, 0.25f}); },
+      [](BMP::Bitmap &b) { b.Blit(b, BMP::Rect{0, 0, 30, 30}, BMP::Vertex{5, 3}); },
+      [](BMP::Bitmap &b) { b.Composite(BMP::Bitmap("", 8, 8, true), 2, 2); },
+      [](BMP::Bitmap &b) { b.SubView(10, 10, 5, 5).Fill(RED); },
+      [](BMP::Bitmap &b) { b.ConvertTo(BMP::BIT_DEPTH::BD_32); },
+      [&](BMP::Bitmap &b) {
+        b.ForEachRow(
+            [&](uint32_t y0, uint32_t y1) {
+              for (uint32_t y = y0; y < y1; y++)
+                b.Row(y)[0] = 0;
+            },
+            pool);
+      },
+      [&](BMP::Bitmap &b) {
+        BMP::DisplayList list;
+        list.FillCircle(30, 20, 15, WHITE);
+        list.Render(b, pool);
+      },
+  };
+  for (auto &write : writes) {
+    BMP::Bitmap snapshot = image;
+    BMP::Bitmap expected("test_output/cow.bmp", 64, 48, false);
+    expected.vec_pixels.assign(original.begin(), original.end());
+    write(snapshot);
+    write(expected);
+    assert(image.vec_pixels == original);
+    assert(snapshot.vec_pixels == expected.vec_pixels);
+  }
+
+  // En vy låser förälderns pixlar: kopior av föräldern får egna pixlar
+  {
+    BMP::Bitmap parent = image;
+    BMP::Bitmap view = parent.SubView(8, 8, 16, 16);
+    BMP::Bitmap snap = parent;
+    assert(!snap.vec_pixels.IsShared() && parent.vec_pixels.IsPinned());
+    view.FillRect(0, 0, 4, 4, BLUE);
+    assert(snap.vec_pixels == original);
+    assert(parent.GetPixelColor(8, 8) == BLUE);
+    BMP::Bitmap later = parent;
+    parent.SetPixel(0, 0, RED);
+    view.SetPixel(5, 5, GREEN);
+    assert(parent.GetPixelColor(13, 13) == GREEN);
+    assert(later.GetPixelColor(13, 13) != GREEN);
+    assert(later.GetPixelColor(0, 0) != RED);
+    assert(snap.vec_pixels == original);
+    // Kopior av vyn är vyer i samma pixlar
+    BMP::Bitmap view_copy = view;
+    view_copy.SetPixel(1, 1, WHITE);
+    assert(parent.GetPixelColor(9, 9) == WHITE);
+    // Vyn håller pixlarna vid liv när föräldern byts ut
+    parent = snap;
+    view.SetPixel(2, 2, RED);
+    assert(view.GetPixelColor(2, 2) == RED && snap.vec_pixels == original);
+  }
+  assert(!image.vec_pixels.IsPinned());
+
+  // Flytt lämnar källan utan pixlar
+  BMP::Bitmap moved = std::move(copy);
+  assert(copy.vec_pixels.empty() && moved.GetPixelColor(1, 1) == RED);
+
+  // Filnamnet ägs av bilden
+  std::string name = "test_output/cow.bmp";
+  BMP::Bitmap named(name.c_str(), 2, 2);
+  name = "test_output/other.bmp";
+  assert(named.GetFileName() == "test_output/cow.bmp");
+  named.SetFileName(nullptr);
+  BMP::Bitmap unnamed(nullptr, 2, 2);
+  assert(named.GetFileName().empty() && unnamed.GetFileName().empty());
+  BMP::BasicBitmap<BMP::BGR24> basic(image);
+  BMP::BasicBitmap<BMP::BGR24> basic_copy = basic;
+  assert(basic_copy.vec_pixels.IsShared());
+  basic_copy.Fill(RED);
+  assert(basic.vec_pixels == original);
+}
+
+void TestAsyncIO() {
+  // Sparade filer rapporteras inte om inte SetVerbose(true) anropats
+  assert(!BMP::Verbose());
+  BMP::ThreadPool pool(4);
+  std::vector<BMP::Bitmap> images;
+  std::vector<std::string> files;
+  for (int i = 0; i < 12; i++) {
+    images.emplace_back("", 17 + i, 9 + 2 * i, i % 2 == 0);
+    images.back().FillCircle(8, 8, i, BMP::Color{(uint8_t)(20 * i), 7, 99});
+    files.push_back("test_output/async_" + std::to_string(i) + ".bmp");
+  }
+  assert(BMP::SaveBatch(images, files, pool) == images.size());
+
+  // Filerna laddas i valfri ordning men hamnar på sitt index
+  std::vector<BMP::LoadResult> loaded = BMP::LoadBatch(files, pool);
+  assert(loaded.size() == files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    assert(loaded[i].ok && loaded[i].filename == files[i]);
+    assert(loaded[i].bitmap.GetFileName() == files[i]);
+    assert(loaded[i].bitmap.GetBitDepth() == images[i].GetBitDepth());
+    assert(loaded[i].bitmap.vec_pixels == images[i].vec_pixels);
+  }
+
+  // Återanrop per fil på I/O-tråden
+  std::atomic<size_t> pixels{0};
+  BMP::LoadBatch(
+      files,
+      [&](size_t i, BMP::LoadResult &result) {
+        assert(result.ok && result.bitmap.Width() == 17 + i);
+        pixels += result.bitmap.Width() * result.bitmap.Height();
+      },
+      pool);
+  size_t expected = 0;
+  for (auto &image : images)
+    expected += image.Width() * image.Height();
+  assert(pixels == expected);
+
+  // Bilden kan ändras medan den sparas, den sparade kopian påverkas inte
+  BMP::Bitmap image = images[3];
+  std::future<bool> saved =
+      BMP::SaveAsync(image, "test_output/async_save.bmp", pool);
+  image.Fill(RED);
+  assert(saved.get());
+  std::future<BMP::LoadResult> load =
+      BMP::LoadAsync("test_output/async_save.bmp", pool);
+  BMP::LoadResult result = load.get();
+  assert(result.ok && result.bitmap.vec_pixels == images[3].vec_pixels);
+
+  assert(!BMP::LoadAsync("test_output/missing.bmp").get().ok);
+}
+
+void TestInstrumentation() {
+  BMP::ResetCounters();
+  BMP::ClearTrace();
+  BMP::Bitmap image("", 100, 50, false);
+  image.DrawLine(-50, 10, 149, 10, RED); // 200 pixlar, 100 synliga
+  image.DrawLine(10, -10, 10, 59, RED);  // 70 pixlar, 50 synliga
+  image.DrawLine(0, 0, 99, 49, RED);     // Helt synlig
+  image.FillRect(90, 40, 20, 20, RED);   // 400 pixlar, 100 synliga
+  image.FillCircle(50, 25, 10, RED);
+  image.SetPixel(-1, 0, RED);
+  image.SetPixel(0, 0, RED);
+  assert(image.Write("test_output/instrumentation.bmp"));
+  BMP::Bitmap loaded("test_output/instrumentation.bmp");
+  assert(BMP::WriteTrace("test_output/instrumentation.json"));
+  std::ifstream trace_file("test_output/instrumentation.json");
+  std::string trace((std::istreambuf_iterator<char>(trace_file)),
+                    std::istreambuf_iterator<char>());
+  assert(trace.starts_with("{\"traceEvents\":["));
+
+  BMP::Counters &counters = BMP::GetCounters();
+  auto &line = counters[BMP::PRIMITIVE::LINE];
+  auto &rect = counters[BMP::PRIMITIVE::RECT];
+  auto &circle = counters[BMP::PRIMITIVE::CIRCLE];
+  auto &pixel = counters[BMP::PRIMITIVE::PIXEL];
+#if defined(BMP_ENABLE_INSTRUMENTATION)
+  assert(line.calls == 3 && line.pixels_written == 250);
+  assert(line.pixels_clipped == 120);
+  assert(rect.calls == 1 && rect.pixels_written == 100);
+  assert(rect.pixels_clipped == 300);
+  // Cirkelns spann räknas som cirkel
+  assert(circle.calls == 1 && circle.pixels_written > 300);
+  assert(circle.pixels_clipped == 0);
+  assert(counters[BMP::PRIMITIVE::SPAN].calls == 0);
+  assert(pixel.pixels_written == 1 && pixel.pixels_clipped == 1);
+  assert(counters.bytes_written == image.GetFileSize());
+  assert(counters.bytes_read == loaded.GetFileSize());
+  assert(counters.allocations >= 2);
+  assert(trace.find("\"Bitmap::DrawLine\"") != std::string::npos);
+  assert(trace.find("\"Bitmap::Read\"") != std::string::npos);
+
+  // Listans kommandon spåras inte var för sig, bara dess rutor
+  BMP::ClearTrace();
+  BMP::DisplayList list;
+  list.FillCircle(50, 25, 10, BLUE);
+  list.Render(image);
+  assert(BMP::WriteTrace("test_output/instrumentation.json"));
+  trace_file = std::ifstream("test_output/instrumentation.json");
+  trace.assign(std::istreambuf_iterator<char>(trace_file),
+               std::istreambuf_iterator<char>());
+  assert(trace.find("\"DisplayList::Render\"") != std::string::npos);
+  assert(trace.find("\"DisplayList tiles\"") != std::string::npos);
+  assert(trace.find("\"Bitmap::FillCircle\"") == std::string::npos);
+  assert(circle.calls == 2);
+#else
+  // Utan makrot räknas ingenting
+  assert(line.calls == 0 && rect.pixels_written == 0);
+  assert(circle.calls == 0 && pixel.pixels_clipped == 0);
+  assert(counters.bytes_written == 0 && counters.allocations == 0);
+  assert(trace.find("\"name\"") == std::string::npos);
+#endif
+}
+
+void TestRLE() {
+  // Gemensamt prefix över SIMD-gränserna
+  std::vector<uint8_t> a(100, 7), b(100, 7);
+  for (size_t n : {0, 1, 15, 16, 17, 31, 32, 33, 64, 99}) {
+    assert(BMP::CommonPrefix(a.data(), b.data(), n) == n);
+    if (n > 0) {
+      b[n - 1] = 8;
+      assert(BMP::CommonPrefix(a.data(), b.data(), 100) == n - 1);
+      b[n - 1] = 7;
+    }
+  }
+
+  // Handgjord RLE8: körning, absolut sträcka, radslut, delta och bildslut
+  const uint8_t rle8[] = {3, 5, 0, 3, 1, 2, 3, 0, 0, 0,
+                          0, 2, 1, 1, 2, 7, 0, 1};
+  std::vector<uint8_t> indices(8 * 3, 9);
+  BMP::DecodeRLE(rle8, sizeof(rle8), 8, 8, 3, indices.data());
+  assert((std::vector<uint8_t>(indices.begin(), indices.begin() + 8) ==
+          std::vector<uint8_t>{5, 5, 5, 1, 2, 3, 9, 9}));
+  assert(indices[8] == 9 && indices[17] == 7 && indices[18] == 7);
+  assert(indices[16] == 9 && indices[19] == 9);
+  // RLE4 växlar mellan nibblarna i en körning
+  const uint8_t rle4[] = {5, 0x12, 0, 3, 0xAB, 0xC0, 0, 1};
+  std::fill(indices.begin(), indices.end(), 0);
+  BMP::DecodeRLE(rle4, sizeof(rle4), 4, 8, 1, indices.data());
+  assert((std::vector<uint8_t>(indices.begin(), indices.begin() + 8) ==
+          std::vector<uint8_t>{1, 2, 1, 2, 1, 10, 11, 12}));
+  // Trasig data avkodas så långt den räcker
+  BMP::DecodeRLE(rle8, 7, 8, 8, 3, indices.data());
+
+  for (bool alpha : {false, true}) {
+    BMP::Bitmap image("", 301, 37, alpha);
+    image.Fill(WHITE);
+    image.FillRect(10, 5, 200, 20, BLUE);
+    image.FillCircle(250, 18, 15, RED);
+    // Brus ger absoluta sträckor av olika längd
+    std::mt19937 rng(3);
+    for (int x = 0; x < 301; x++)
+      if (rng() % 3)
+        image.SetPixel(x, 30, x % 2 ? GREEN : BLACK);
+    for (auto compression : {BMP::COMPRESSION::RLE8, BMP::COMPRESSION::RLE4}) {
+      const char *fn = "test_output/rle.bmp";
+      assert(image.Write(fn, compression));
+      BMP::Bitmap loaded(fn);
+      assert(loaded.GetBitDepth() == BMP::BIT_DEPTH::BD_24);
+      assert(loaded.Width() == 301 && loaded.Height() == 37);
+      for (int y = 0; y < 37; y++)
+        for (int x = 0; x < 301; x++) {
+          BMP::Color c = image.GetPixelColor(x, y);
+          c.alpha = 255;
+          assert(loaded.GetPixelColor(x, y) == c);
+        }
+      std::ifstream file(fn, std::ios::binary | std::ios::ate);
+      assert((uint64_t)file.tellg() * 3 < image.GetFileSize());
+    }
+  }
+
+  // För många färger
+  BMP::Bitmap colorful("", 20, 1, false);
+  for (int x = 0; x < 20; x++)
+    colorful.SetPixel(x, 0, BMP::Color{(uint8_t)x, 0, 0});
+  assert(!colorful.Write("test_output/rle_fail.bmp", BMP::COMPRESSION::RLE4));
+  assert(colorful.Write("test_output/rle_ok.bmp", BMP::COMPRESSION::RLE8));
+  BMP::Bitmap empty;
+  assert(empty.Write("test_output/rle_empty.bmp", BMP::COMPRESSION::RLE8));
+}
+
+void TestIndexed() {
+  // Packning och uppackning av index, 4 bitar även över SIMD-vägen
+  std::mt19937 rng(5);
+  for (uint16_t bits : {1, 4, 8})
+    for (uint32_t w : {1, 7, 8, 33, 65, 100}) {
+      std::vector<uint8_t> indices(w), unpacked(w);
+      for (auto &i : indices)
+        i = (uint8_t)(rng() % (1u << bits));
+      std::vector<uint8_t> row(BMP::UTILS::row_stride(w, bits), 0xFF);
+      BMP::PackIndices(indices.data(), bits, w, row.data());
+      BMP::UnpackIndices(row.data(), bits, w, unpacked.data());
+      assert(unpacked == indices);
+      // Oanvända bitar i sista byten är noll
+      if (w * bits % 8)
+        assert((row[w * bits / 8] & (0xFF >> (w * bits % 8))) == 0);
+    }
+
+  // 1-bitars schackbräde
+  BMP::IndexedBitmap board("test_output/indexed1.bmp", 37, 5, 1,
+                           {BLACK, WHITE});
+  for (int y = 0; y < 5; y++)
+    for (int x = 0; x < 37; x++)
+      board.SetIndex(x, y, (uint8_t)((x + y) % 2));
+  board.SetIndex(-1, 0, 1);
+  board.SetIndex(37, 0, 1);
+  assert(board.GetIndex(37, 0) == 0);
+  assert(board.Save());
+  assert(board.GetFileSize() == 54 + 2 * 4 + 8 * 5);
+  BMP::IndexedBitmap board_loaded("test_output/indexed1.bmp");
+  BMP::Bitmap board_expanded("test_output/indexed1.bmp");
+  assert(board_loaded.BitsPerPixel() == 1);
+  assert(board_loaded.GetPalette().size() == 2);
+  assert(board_expanded.GetBitDepth() == BMP::BIT_DEPTH::BD_24);
+  for (int y = 0; y < 5; y++)
+    for (int x = 0; x < 37; x++) {
+      assert(board_loaded.GetIndex(x, y) == (x + y) % 2);
+      assert(board_expanded.GetPixelColor(x, y) ==
+             ((x + y) % 2 ? WHITE : BLACK));
+    }
+
+  // Bilder med få färger behåller dem exakt, okomprimerat och som RLE4
+  BMP::Bitmap image("", 301, 37, true);
+  image.Fill(WHITE);
+  image.FillRect(10, 5, 200, 20, BLUE);
+  image.FillCircle(250, 18, 15, RED);
+  for (uint16_t bits : {4, 8}) {
+    BMP::IndexedBitmap indexed(image, bits);
+    assert(indexed.BitsPerPixel() == bits);
+    assert(indexed.GetPalette().size() == 3);
+    assert(indexed.GetFileSize() * 3 < image.GetFileSize());
+    const char *fn = "test_output/indexed.bmp";
+    for (auto compression :
+         {BMP::COMPRESSION::RGB, bits == 4 ? BMP::COMPRESSION::RLE4
+                                           : BMP::COMPRESSION::RLE8}) {
+      assert(indexed.Write(fn, compression));
+      BMP::Bitmap loaded(fn);
+      BMP::Bitmap converted =
+          BMP::IndexedBitmap(fn).ToBitmap(BMP::BIT_DEPTH::BD_32);
+      assert(converted.GetBitDepth() == BMP::BIT_DEPTH::BD_32);
+      for (int y = 0; y < 37; y++)
+        for (int x = 0; x < 301; x++) {
+          assert(loaded.GetPixelColor(x, y) == image.GetPixelColor(x, y));
+          assert(converted.GetPixelColor(x, y) == image.GetPixelColor(x, y));
+        }
+    }
+  }
+  // RLE4 kräver 4-bitars index
+  assert(!BMP::IndexedBitmap(image, 8).Write("test_output/indexed_fail.bmp",
+                                             BMP::COMPRESSION::RLE4));
+
+  // Kvantisering av en gradient med fler färger än paletten
+  BMP::Bitmap gradient("", 256, 64, false);
+  for (int y = 0; y < 64; y++)
+    for (int x = 0; x < 256; x++)
+      gradient.SetPixel(
+          x, y, BMP::Color{(uint8_t)x, (uint8_t)(y * 4), (uint8_t)(255 - x)});
+  BMP::IndexedBitmap quantized(gradient, 8);
+  assert(quantized.GetPalette().size() == 256);
+  BMP::Bitmap restored = quantized.ToBitmap();
+  double error = 0;
+  for (int y = 0; y < 64; y++)
+    for (int x = 0; x < 256; x++) {
+      const BMP::Color a = gradient.GetPixelColor(x, y);
+      const BMP::Color b = restored.GetPixelColor(x, y);
+      error += std::abs(a.red - b.red) + std::abs(a.green - b.green) +
+               std::abs(a.blue - b.blue);
+    }
+  assert(error / (256 * 64 * 3) < 6);
+
+  // Med dithering ligger medelvärdet i varje block närmare originalet, inom
+  // paletten som k-means lägger runt 64 och 192
+  BMP::Bitmap gray("", 256, 64, false);
+  for (int y = 0; y < 64; y++)
+    for (int x = 0; x < 256; x++)
+      gray.SetPixel(x, y, BMP::Color{(uint8_t)x, (uint8_t)x, (uint8_t)x});
+  auto block_error = [&](const BMP::IndexedBitmap &indexed) {
+    BMP::Bitmap out = indexed.ToBitmap();
+    double total = 0;
+    for (int by = 0; by < 64; by += 8)
+      for (int bx = 64; bx < 192; bx += 8) {
+        int sum = 0, original = 0;
+        for (int y = by; y < by + 8; y++)
+          for (int x = bx; x < bx + 8; x++) {
+            sum += out.GetPixelColor(x, y).red;
+            original += x;
+          }
+        total += std::abs(sum - original) / 64.0;
+      }
+    return total / (16 * 8);
+  };
+  BMP::IndexedBitmap plain(gray, 1);
+  BMP::IndexedBitmap dithered(gray, 1, BMP::DITHER::FLOYD_STEINBERG);
+  assert(plain.GetPalette().size() == 2);
+  assert(block_error(dithered) < 4);
+  assert(block_error(dithered) * 3 < block_error(plain));
+  assert(dithered.Write("test_output/indexed_dithered.bmp"));
+}
+
+void TestBitfields() {
+  // Alla 16-bitarsvärden: SIMD och skalär väg ger samma pixlar, och packning
+  // återger originalet
+  for (const BMP::BitMasks &masks : {BMP::MASKS_RGB565, BMP::MASKS_RGB555}) {
+    const size_t n = masks.red == BMP::MASKS_RGB565.red ? 65536 : 32768;
+    std::vector<uint8_t> packed(2 * n), repacked(2 * n);
+    for (size_t v = 0; v < n; v++)
+      BMP::UTILS::uint16_to_bytes((uint16_t)v, &packed[2 * v]);
+    std::vector<uint8_t> wide(4 * n), single(4);
+    BMP::UnpackBitfields(packed.data(), 16, masks, wide.data(), n);
+    for (size_t v = 0; v < n; v += 97) {
+      BMP::UnpackBitfields(&packed[2 * v], 16, masks, single.data(), 1);
+      assert(std::equal(single.begin(), single.end(), &wide[4 * v]));
+    }
+    BMP::PackBitfields(wide.data(), 16, masks, repacked.data(), n);
+    assert(repacked == packed);
+    // Godtyckliga pixlar avrundas lika i båda vägarna
+    std::mt19937 rng(9);
+    for (auto &b : wide)
+      b = (uint8_t)rng();
+    BMP::PackBitfields(wide.data(), 16, masks, repacked.data(), n);
+    for (size_t v = 0; v < n; v += 89) {
+      uint8_t one[2];
+      BMP::PackBitfields(&wide[4 * v], 16, masks, one, 1);
+      assert(one[0] == repacked[2 * v] && one[1] == repacked[2 * v + 1]);
+    }
+  }
+  // Bitarna upprepas: abcde blir abcdeabc, abcdef blir abcdefab
+  for (uint32_t x = 0; x < 32; x++) {
+    uint8_t packed[2], pixel[4];
+    BMP::UTILS::uint16_to_bytes((uint16_t)(x << 11 | x << 6 | x), packed);
+    BMP::UnpackBitfields(packed, 16, BMP::MASKS_RGB565, pixel, 1);
+    assert(pixel[2] == (x << 3 | x >> 2) && pixel[0] == pixel[2]);
+    assert(pixel[1] == (x << 3 | x >> 3) && pixel[3] == 255);
+  }
+
+  // 32 bitar: RGBA-ordning och 10-10-10-2, sju pixlar över SIMD-vägen
+  const BMP::BitMasks rgba{0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF};
+  const BMP::BitMasks wide10{0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000};
+  uint8_t src[7 * 4], dst[7 * 4];
+  for (int i = 0; i < 7; i++) {
+    BMP::UTILS::uint32_to_bytes(
+        (uint32_t)(10 * i) << 24 | (uint32_t)(20 * i) << 16 | 30u * i << 8 |
+            (uint32_t)(40 * i),
+        src + 4 * i);
+  }
+  BMP::UnpackBitfields(src, 32, rgba, dst, 7);
+  for (int i = 0; i < 7; i++) {
+    assert(dst[4 * i + 2] == 10 * i && dst[4 * i + 1] == 20 * i);
+    assert(dst[4 * i] == 30 * i && dst[4 * i + 3] == 40 * i);
+  }
+  for (int i = 0; i < 7; i++)
+    BMP::UTILS::uint32_to_bytes(3u << 30 | 1023u << 20 | 512u << 10 | 4u * i,
+                                src + 4 * i);
+  BMP::UnpackBitfields(src, 32, wide10, dst, 7);
+  for (int i = 0; i < 7; i++) {
+    assert(dst[4 * i + 2] == 255 && dst[4 * i + 1] == 128);
+    assert(dst[4 * i] == i && dst[4 * i + 3] == 255);
+  }
+
+  // Okomprimerad 16-bitarsfil är RGB555
+  BMP::FileHeader fh;
+  BMP::Infoheader ih;
+  ih.width = 5;
+  ih.height = 3;
+  ih.bits_per_pixel = 16;
+  ih.image_size = 12 * 3;
+  fh.file_size = 54 + ih.image_size;
+  uint8_t header[54];
+  BMP::UTILS::write_headers(header, fh, ih);
+  std::vector<uint8_t> pixels(12 * 3, 0);
+  for (int y = 0; y < 3; y++)
+    for (int x = 0; x < 5; x++)
+      BMP::UTILS::uint16_to_bytes((uint16_t)(31 << 10 | (x * 7) << 5 | y * 15),
+                                  &pixels[12 * y + 2 * x]);
+  assert(BMP::UTILS::write_file("test_output/rgb555.bmp", header, 54,
+                                pixels.data(), pixels.size()));
+  BMP::Bitmap rgb555("test_output/rgb555.bmp");
+  assert(rgb555.GetBitDepth() == BMP::BIT_DEPTH::BD_24);
+  assert(rgb555.Width() == 5 && rgb555.Height() == 3);
+  for (int y = 0; y < 3; y++)
+    for (int x = 0; x < 5; x++) {
+      const BMP::Color c = rgb555.GetPixelColor(x, y);
+      assert(c.red == 255 && c.green == (x * 7 << 3 | x * 7 >> 2));
+      assert(c.blue == (y * 15 << 3 | y * 15 >> 2));
+    }
+
+  // RGB565 halverar filen och läses tillbaka med 5, 6 och 5 bitar
+  BMP::Bitmap image("", 301, 37, true);
+  for (int y = 0; y < 37; y++)
+    for (int x = 0; x < 301; x++)
+      image.SetPixel(x, y,
+                     BMP::Color{(uint8_t)x, (uint8_t)(y * 7), (uint8_t)(x ^ y),
+                                (uint8_t)y});
+  assert(image.Write("test_output/rgb565.bmp", BMP::COMPRESSION::BITFIELDS));
+  BMP::Bitmap rgb565("test_output/rgb565.bmp");
+  std::ifstream file("test_output/rgb565.bmp",
+                     std::ios::binary | std::ios::ate);
+  assert((uint64_t)file.tellg() == 54 + 12 + 604 * 37);
+  assert(rgb565.GetBitDepth() == BMP::BIT_DEPTH::BD_24);
+  for (int y = 0; y < 37; y++)
+    for (int x = 0; x < 301; x++) {
+      const BMP::Color a = image.GetPixelColor(x, y);
+      const BMP::Color b = rgb565.GetPixelColor(x, y);
+      assert(std::abs(a.red - b.red) <= 4 && std::abs(a.green - b.green) <= 2);
+      assert(std::abs(a.blue - b.blue) <= 4 && b.alpha == 255);
+    }
+
+  // 32-bitars BITFIELDS med alfamask i ett längre huvud
+  ih = BMP::Infoheader{};
+  ih.header_size = 56;
+  ih.width = 2;
+  ih.height = 1;
+  ih.bits_per_pixel = 32;
+  ih.compression = (uint32_t)BMP::COMPRESSION::BITFIELDS;
+  fh.offset_data = 14 + 56;
+  fh.file_size = fh.offset_data + 8;
+  std::vector<uint8_t> data(fh.offset_data + 8, 0);
+  BMP::UTILS::write_headers(data.data(), fh, ih);
+  BMP::UTILS::uint32_to_bytes(rgba.red, &data[54]);
+  BMP::UTILS::uint32_to_bytes(rgba.green, &data[58]);
+  BMP::UTILS::uint32_to_bytes(rgba.blue, &data[62]);
+  BMP::UTILS::uint32_to_bytes(rgba.alpha, &data[66]);
+  BMP::UTILS::uint32_to_bytes(0x11223344, &data[70]);
+  BMP::UTILS::uint32_to_bytes(0xFF000080, &data[74]);
+  assert(BMP::UTILS::write_file("test_output/rgba_masks.bmp", data.data(),
+                                data.size(), nullptr, 0));
+  BMP::Bitmap masked("test_output/rgba_masks.bmp");
+  assert(masked.GetBitDepth() == BMP::BIT_DEPTH::BD_32);
+  assert((masked.GetPixelColor(0, 0) == BMP::Color{0x11, 0x22, 0x33, 0x44}));
+  assert((masked.GetPixelColor(1, 0) == BMP::Color{0xFF, 0, 0, 0x80}));
+
+  // En mask utan bitar ger kanalen 0
+  auto write_rgb565 = [&](const char *fn, uint32_t w, uint32_t blue_mask,
+                          size_t size) {
+    BMP::FileHeader f;
+    BMP::Infoheader i;
+    i.width = w;
+    i.height = 2;
+    i.bits_per_pixel = 16;
+    i.compression = (uint32_t)BMP::COMPRESSION::BITFIELDS;
+    f.offset_data = 54 + 12;
+    f.file_size = f.offset_data + BMP::UTILS::row_stride(w, 16) * 2;
+    std::vector<uint8_t> bytes(f.file_size, 0xFF);
+    BMP::UTILS::write_headers(bytes.data(), f, i);
+    BMP::UTILS::uint32_to_bytes(BMP::MASKS_RGB565.red, &bytes[54]);
+    BMP::UTILS::uint32_to_bytes(BMP::MASKS_RGB565.green, &bytes[58]);
+    BMP::UTILS::uint32_to_bytes(blue_mask, &bytes[62]);
+    assert(BMP::UTILS::write_file(fn, bytes.data(),
+                                  std::min(size, bytes.size()), nullptr, 0));
+  };
+  write_rgb565("test_output/no_blue.bmp", 2, 0, SIZE_MAX);
+  BMP::Bitmap no_blue("test_output/no_blue.bmp");
+  assert((no_blue.GetPixelColor(1, 1) == BMP::Color{255, 255, 0}));
+  // Avhuggna masker, masker med hål och överlappande masker läses inte
+  BMP::Bitmap rejected;
+  write_rgb565("test_output/truncated_masks.bmp", 2, 0x1F, 56);
+  assert(!rejected.Read("test_output/truncated_masks.bmp"));
+  write_rgb565("test_output/holey_masks.bmp", 2, 0x1D, SIZE_MAX);
+  assert(!rejected.Read("test_output/holey_masks.bmp"));
+  write_rgb565("test_output/overlapping_masks.bmp", 2, 0x3F, SIZE_MAX);
+  assert(!rejected.Read("test_output/overlapping_masks.bmp"));
+  // Bild utan bredd
+  write_rgb565("test_output/no_width.bmp", 0, 0x1F, SIZE_MAX);
+  BMP::Bitmap no_width("test_output/no_width.bmp");
+  assert(no_width.Width() == 0 && no_width.Height() == 2);
+}
+
 int main() {
   TestExampleImage();
   TestFill();
@@ -115,4 +1655,29 @@ int main() {
   TestTriangle();
   TestTriangleFilled();
   TestLoadFromByteArray();
+  TestBitmapView();
+  TestBitmapWriter();
+  TestBitmapReader();
+  TestShortRead();
+  TestWriteHeaders();
+  TestBasicBitmap();
+  TestRawAccess();
+  TestFillKernels();
+  TestFillCircleSpans();
+  TestFillTriangles();
+  TestClipping();
+  TestDisplayList();
+  TestThreadPool();
+  TestConvert();
+  TestBlend();
+  TestFilters();
+  TestResize();
+  TestPool();
+  TestSubView();
+  TestCopyOnWrite();
+  TestAsyncIO();
+  TestInstrumentation();
+  TestRLE();
+  TestIndexed();
+  TestBitfields();
 }